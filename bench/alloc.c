@@ -0,0 +1,483 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/*
+ * Userspace microbenchmark of the block allocator (bitmap.h, bitmap.c) and of
+ * the extent search (extent.c), built from the module sources against the
+ * stand-ins of bench/include/kshim.h.
+ *
+ * The block bitmap of an image of each size is made up on the fly at a given
+ * fill ratio: bitmap blocks are copies of a few pregenerated ones, so that
+ * loading a chunk costs about as much as a page cache hit. Every call is
+ * timed on its own; the timer overhead is printed and included.
+ */
+
+/* Distinct bitmap blocks generated for a fill ratio */
+#define BENCH_POOL_SIZE 64
+
+/* Mean length of a free run with the runs pattern */
+#define BENCH_FREE_RUN 16
+
+enum pattern { PATTERN_RUNS, PATTERN_RANDOM, PATTERN_FRONT };
+static const char *pattern_names[] = {"runs", "random", "front"};
+
+/* Command line */
+static uint32_t block_size_bits = SIMPLEFS_BLOCK_SIZE_BITS;
+static enum pattern pattern = PATTERN_RUNS;
+static uint32_t alloc_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+static uint64_t nr_ops = 100000;
+static uint64_t seed = 1;
+
+/* Device being simulated */
+static struct {
+    uint64_t nr_blocks;
+    uint32_t bitmap_start; /* First bfree block */
+    uint32_t fill;         /* Percent of used blocks */
+    unsigned long *pool[BENCH_POOL_SIZE];
+    uint64_t nr_reads;
+} dev;
+
+static uint64_t rng_state;
+
+/* xorshift64* */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Fill a bitmap block of nr_bits bits with the pattern, at dev.fill percent */
+static void gen_block(unsigned long *map, uint32_t nr_bits)
+{
+    uint32_t bit = 0, len, used_run;
+
+    memset(map, 0, nr_bits / 8);
+    switch (pattern) {
+    case PATTERN_RANDOM:
+        for (bit = 0; bit < nr_bits; bit++) {
+            if (rng() % 100 >= dev.fill)
+                set_bit(bit, map);
+        }
+        break;
+    case PATTERN_FRONT:
+        bitmap_set(map, 0, nr_bits);
+        bitmap_clear(map, 0, (uint64_t) nr_bits * dev.fill / 100);
+        break;
+    case PATTERN_RUNS:
+        /* Used and free runs, of mean lengths giving the fill ratio */
+        if (dev.fill == 100)
+            break;
+        used_run = BENCH_FREE_RUN * dev.fill / (100 - dev.fill);
+        if (used_run)
+            bit = rng() % (2 * used_run);
+        while (bit < nr_bits) {
+            len = 1 + rng() % (2 * BENCH_FREE_RUN - 1);
+            bitmap_set(map, bit, min(len, nr_bits - bit));
+            bit += len;
+            if (used_run)
+                bit += 1 + rng() % (2 * used_run - 1);
+        }
+        break;
+    }
+}
+
+int bench_read_block(struct super_block *sb, u64 bno, void *data)
+{
+    uint64_t i = bno - dev.bitmap_start, nr_bits = sb->s_blocksize * 8;
+    uint64_t used, first = i * nr_bits;
+
+    dev.nr_reads++;
+    if (pattern == PATTERN_FRONT) {
+        /* Used blocks first, then free ones */
+        used = dev.nr_blocks * dev.fill / 100;
+        memset(data, first + nr_bits <= used ? 0 : 0xff, sb->s_blocksize);
+        if (first < used && used < first + nr_bits)
+            bitmap_clear(data, 0, used - first);
+    } else {
+        /* Top 6 bits of a multiplicative hash, BENCH_POOL_SIZE is 64 */
+        memcpy(data, dev.pool[(i * 0x9E3779B97F4A7C15ULL) >> 58],
+               sb->s_blocksize);
+    }
+
+    /* Block 0 holds the superblock */
+    if (!i)
+        clear_bit(0, data);
+    return 0;
+}
+
+/* Not called: simplefs_trim_fs() is not benchmarked */
+bool simplefs_discard_supported(struct super_block *sb)
+{
+    return false;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Print ops per second and latency percentiles of the n calls timed in lat,
+ * after the first columns of the line, given by label.
+ */
+static void report(const char *label, uint64_t *lat, uint64_t n, const char *note)
+{
+    uint64_t i, total = 0;
+
+    if (!n) {
+        printf("%s %10s  %s\n", label, "-", note);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        total += lat[i];
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%s %10.0f %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %9" PRIu64
+           "  %s\n",
+           label, n * 1e9 / (total ? total : 1), lat[n / 2], lat[n * 9 / 10],
+           lat[n * 99 / 100], lat[n - 1], note);
+}
+
+static void format_size(char *buf, size_t len, uint64_t size)
+{
+    const char *units = "KMGTPE";
+    int u = -1;
+
+    while (size >= 1024 && !(size % 1024) && units[u + 1]) {
+        size /= 1024;
+        u++;
+    }
+    snprintf(buf, len, "%" PRIu64 "%.*s", size, u < 0 ? 0 : 1,
+             u < 0 ? "" : units + u);
+}
+
+/* Regenerate the pool of bitmap blocks for fill percent */
+static void set_fill(uint32_t fill)
+{
+    uint32_t i;
+
+    dev.fill = fill;
+    for (i = 0; i < BENCH_POOL_SIZE; i++)
+        gen_block(dev.pool[i], 8U << block_size_bits);
+}
+
+/* get_first_free_bits() on single bitmap blocks, put back after each call */
+static void bench_first_free_bits(uint64_t *lat)
+{
+    uint32_t nr_bits = 8U << block_size_bits, bit;
+    uint64_t i, n = 0, misses = 0, t;
+    unsigned long *map;
+    char label[96], note[64];
+
+    for (i = 0; i < nr_ops; i++) {
+        map = dev.pool[i % BENCH_POOL_SIZE];
+        t = now_ns();
+        bit = get_first_free_bits(map, nr_bits, 0, alloc_len);
+        lat[n++] = now_ns() - t;
+        if (bit == (uint32_t) -1)
+            misses++;
+        else
+            bitmap_set(map, bit, alloc_len);
+    }
+
+    snprintf(label, sizeof(label), "%-20s %6s %4u%% %4u %8" PRIu64,
+             "get_first_free_bits", "-", dev.fill, alloc_len, n);
+    snprintf(note, sizeof(note), "misses=%" PRIu64, misses);
+    report(label, lat, n, note);
+}
+
+/*
+ * get_free_blocks() nr_ops times, or until the image is full, then
+ * put_blocks() on the runs allocated, in random order.
+ */
+static int bench_alloc_free(uint64_t size, uint64_t *lat, uint64_t *bnos)
+{
+    struct simplefs_sb_info sbi = {0};
+    struct super_block sb = {
+        .s_blocksize = 1UL << block_size_bits,
+        .s_blocksize_bits = block_size_bits,
+        .s_fs_info = &sbi,
+    };
+    uint64_t i, j, n, t, bno, reads;
+    uint32_t nr_chunks;
+    char label[96], note[64], size_str[16];
+    int ret;
+
+    sbi.sb = &sb;
+    dev.nr_blocks = size >> block_size_bits;
+    dev.bitmap_start = 1;
+    dev.nr_reads = 0;
+    sbi.nr_blocks = dev.nr_blocks;
+    sbi.nr_free_blocks = dev.nr_blocks;
+    nr_chunks = (dev.nr_blocks + (8U << block_size_bits) - 1) >>
+                (block_size_bits + 3);
+    ret = simplefs_bitmap_init(&sb, &sbi.bfree_bitmap, dev.bitmap_start,
+                               nr_chunks, dev.nr_blocks, &sbi.nr_free_blocks);
+    if (ret)
+        return ret;
+    format_size(size_str, sizeof(size_str), size);
+
+    for (n = 0; n < nr_ops; n++) {
+        t = now_ns();
+        bno = get_free_blocks(&sbi, alloc_len, &ret);
+        lat[n] = now_ns() - t;
+        if (!bno && ret != -ENOSPC)
+            return ret;
+        if (!bno)
+            break;
+        bnos[n] = bno;
+    }
+    reads = dev.nr_reads;
+
+    snprintf(label, sizeof(label), "%-20s %6s %4u%% %4u %8" PRIu64,
+             "get_free_blocks", size_str, dev.fill, alloc_len,
+             n < nr_ops ? n + 1 : n);
+    snprintf(note, sizeof(note), "chunks=%" PRIu64 "/%u%s", reads, nr_chunks,
+             n < nr_ops ? " full" : "");
+    report(label, lat, n < nr_ops ? n + 1 : n, note);
+
+    for (i = n; i > 1; i--) {
+        j = rng() % i;
+        bno = bnos[i - 1];
+        bnos[i - 1] = bnos[j];
+        bnos[j] = bno;
+    }
+    for (i = 0; i < n; i++) {
+        t = now_ns();
+        put_blocks(&sbi, bnos[i], alloc_len);
+        lat[i] = now_ns() - t;
+    }
+    snprintf(label, sizeof(label), "%-20s %6s %4u%% %4u %8" PRIu64,
+             "put_blocks", size_str, dev.fill, alloc_len, n);
+    report(label, lat, n, "");
+
+    simplefs_bitmap_destroy(&sbi.bfree_bitmap);
+    return 0;
+}
+
+/* simplefs_ext_search() of random blocks of a file of nr_ext full extents */
+static void bench_ext_search(uint32_t nr_ext, uint64_t *lat)
+{
+    struct simplefs_sb_info sbi = {0};
+    struct super_block sb = {
+        .s_blocksize = 1UL << block_size_bits,
+        .s_blocksize_bits = block_size_bits,
+        .s_fs_info = &sbi,
+    };
+    struct simplefs_file_ei_block *index;
+    uint64_t i, t, nr_blocks = (uint64_t) nr_ext * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    uint32_t e, iblock;
+    char label[96];
+
+    sbi.max_extents = SIMPLEFS_MAX_EXTENTS(sb.s_blocksize);
+    index = calloc(1, sb.s_blocksize);
+    if (!index)
+        return;
+    for (e = 0; e < nr_ext; e++) {
+        index->extents[e].ee_block = e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        index->extents[e].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        simplefs_ext_set_start(&index->extents[e],
+                               1000 + e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+    }
+
+    /* Blocks of the file, and the one after it as when appending */
+    for (i = 0; i < nr_ops; i++) {
+        iblock = rng() % (nr_blocks + 1);
+        t = now_ns();
+        e = simplefs_ext_search(&sb, index, iblock);
+        lat[i] = now_ns() - t;
+        if (e != (iblock < nr_blocks ? iblock / SIMPLEFS_MAX_BLOCKS_PER_EXTENT
+                  : nr_ext < sbi.max_extents ? nr_ext
+                                             : (uint32_t) -1)) {
+            fprintf(stderr, "simplefs_ext_search(%u) returned %u\n", iblock, e);
+            break;
+        }
+    }
+
+    snprintf(label, sizeof(label), "%-20s %6u %5s %4s %8" PRIu64,
+             "simplefs_ext_search", nr_ext, "-", "-", i);
+    report(label, lat, i, "");
+    free(index);
+}
+
+/* Parse a comma-separated list of sizes with an optional K, M, G or T suffix */
+static int parse_list(const char *arg, uint64_t *list, int max, int sizes)
+{
+    const char *p = arg;
+    char *end;
+    int n = 0;
+
+    while (*p && n < max) {
+        list[n] = strtoull(p, &end, 0);
+        if (sizes) {
+            switch (*end) {
+            case 'T':
+                list[n] <<= 10;
+                /* fallthrough */
+            case 'G':
+                list[n] <<= 10;
+                /* fallthrough */
+            case 'M':
+                list[n] <<= 10;
+                /* fallthrough */
+            case 'K':
+                list[n] <<= 10;
+                end++;
+            }
+        }
+        if (end == p || (*end && *end != ','))
+            return -1;
+        n++;
+        p = *end ? end + 1 : end;
+    }
+    return *p ? -1 : n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b block_size] [-s sizes] [-f fills] [-p pattern]\n"
+            "          [-l len] [-n ops] [-r seed]\n"
+            "  -b size     block size in bytes (default %d)\n"
+            "  -s sizes    image sizes (default 1G,16G,256G,4T,16T)\n"
+            "  -f fills    percents of used blocks (default 0,50,90,99)\n"
+            "  -p pattern  layout of the used blocks: runs (default), random\n"
+            "              or front (all used blocks first)\n"
+            "  -l len      blocks per allocation (default %d)\n"
+            "  -n ops      calls per measure (default 100000)\n"
+            "  -r seed     random seed (default 1)\n",
+            prog, SIMPLEFS_BLOCK_SIZE, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t sizes[16] = {1ULL << 30, 16ULL << 30, 256ULL << 30, 4ULL << 40,
+                          16ULL << 40};
+    uint64_t fills[16] = {0, 50, 90, 99};
+    uint64_t *lat, *bnos, t, overhead = UINT64_MAX;
+    uint32_t e, max_extents, nr_ext[] = {1, 16, 64, 0};
+    int nr_sizes = 5, nr_fills = 4, i, j, opt;
+
+    while ((opt = getopt(argc, argv, "b:s:f:p:l:n:r:")) != -1) {
+        switch (opt) {
+        case 'b':
+            for (block_size_bits = SIMPLEFS_MIN_BLOCK_SIZE_BITS;
+                 block_size_bits <= SIMPLEFS_MAX_BLOCK_SIZE_BITS;
+                 block_size_bits++) {
+                if (strtoul(optarg, NULL, 0) == 1UL << block_size_bits)
+                    break;
+            }
+            if (block_size_bits > SIMPLEFS_MAX_BLOCK_SIZE_BITS) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            nr_sizes = parse_list(optarg, sizes, 16, 1);
+            break;
+        case 'f':
+            nr_fills = parse_list(optarg, fills, 16, 0);
+            for (i = 0; i < nr_fills; i++) {
+                if (fills[i] > 100)
+                    nr_fills = -1;
+            }
+            break;
+        case 'p':
+            for (pattern = 0; pattern < 3; pattern++) {
+                if (!strcmp(optarg, pattern_names[pattern]))
+                    break;
+            }
+            if (pattern == 3) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            alloc_len = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || nr_sizes <= 0 || nr_fills <= 0 || !nr_ops ||
+        !alloc_len || alloc_len > (8U << block_size_bits)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    rng_state = seed ? seed : 1;
+
+    lat = malloc(nr_ops * sizeof(*lat));
+    bnos = malloc(nr_ops * sizeof(*bnos));
+    if (!lat || !bnos) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < BENCH_POOL_SIZE; i++) {
+        dev.pool[i] = malloc(1UL << block_size_bits);
+        if (!dev.pool[i]) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < 1000; i++) {
+        t = now_ns();
+        t = now_ns() - t;
+        if (t < overhead)
+            overhead = t;
+    }
+    printf("block size %u, pattern %s, timer overhead %" PRIu64
+           " ns (included), latencies in ns\n\n",
+           1U << block_size_bits, pattern_names[pattern], overhead);
+    printf("%-20s %6s %5s %4s %8s %10s %7s %7s %7s %9s\n", "op", "size",
+           "fill", "len", "ops", "ops/s", "p50", "p90", "p99", "max");
+
+    for (j = 0; j < nr_fills; j++) {
+        set_fill(fills[j]);
+        bench_first_free_bits(lat);
+        for (i = 0; i < nr_sizes; i++) {
+            if (bench_alloc_free(sizes[i], lat, bnos)) {
+                fprintf(stderr, "Cannot set up the bitmap: %s\n",
+                        strerror(ENOMEM));
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* The size column is the number of extents of the file here */
+    max_extents = SIMPLEFS_MAX_EXTENTS(1U << block_size_bits);
+    nr_ext[3] = max_extents;
+    for (e = 0; e < 4; e++) {
+        if (nr_ext[e] <= max_extents && (!e || nr_ext[e] > nr_ext[e - 1]))
+            bench_ext_search(nr_ext[e], lat);
+    }
+
+    for (i = 0; i < BENCH_POOL_SIZE; i++)
+        free(dev.pool[i]);
+    free(bnos);
+    free(lat);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * bench-data: run one data path job, in the manner of a fio job, on files of
+ * directory dir, for script/bench-data.sh:
+ *
+ *   write      write the files sequentially, bs per call, then fsync them
+ *   read       read them sequentially
+ *   randwrite  overwrite bs blocks at random offsets of the files, then fsync
+ *   randread   read bs blocks at random offsets of the files
+ *   append     append bs to a new file and fsync it, until it is full size
+ *   mmapwrite  fill new files through shared mappings, then msync them
+ *   mmapread   read them through mappings
+ *
+ * The random jobs transfer as much as the sequential ones. Each call (or copy
+ * from a mapping) is timed; the final fsync or msync counts in the total time
+ * only. Prints one CSV line: bytes,seconds,mb_per_s,iops,p50_us,p99_us.
+ * Exits with 2 if the file system does not support the job (O_DIRECT, mmap).
+ */
+
+/* Exit code for jobs the file system does not support */
+#define EXIT_UNSUPPORTED 2
+
+static uint32_t nr_files = 8;
+static uint64_t file_size = 8 << 20;
+static int direct;
+
+static uint64_t rng_state = 1;
+
+/* xorshift64* */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Open file i of the job's files in dir, -errno on error */
+static int open_file(const char *dir, const char *prefix, uint32_t i, int flags)
+{
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s%u", dir, prefix, i);
+    fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    return fd < 0 ? -errno : fd;
+}
+
+/* Whether err means the file system does not support the job */
+static inline int unsupported(int err)
+{
+    return err == -EINVAL || err == -ENODEV || err == -EOPNOTSUPP;
+}
+
+int main(int argc, char **argv)
+{
+    const char *job, *dir, *prefix;
+    uint64_t *lat, n = 0, nr_ops, off, t, start, total, bs;
+    uint32_t f;
+    char *buf, *map;
+    int *fds, opt, flags, err = 0;
+    ssize_t ret;
+
+    while ((opt = getopt(argc, argv, "dn:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            direct = 1;
+            break;
+        case 'n':
+            nr_files = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            file_size = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 3)
+        goto usage;
+    job = argv[optind];
+    bs = strtoull(argv[optind + 1], NULL, 0);
+    dir = argv[optind + 2];
+    if (!nr_files || !bs || !file_size || file_size % bs)
+        goto usage;
+
+    nr_ops = nr_files * (file_size / bs);
+    lat = malloc(nr_ops * sizeof(*lat));
+    fds = calloc(nr_files, sizeof(*fds));
+    if (!lat || !fds || posix_memalign((void **) &buf, 4096, bs)) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (off = 0; off < bs; off++)
+        buf[off] = rng();
+
+    /* Open the files, new ones for the jobs writing a whole file */
+    if (!strcmp(job, "write") || !strcmp(job, "append") ||
+        !strcmp(job, "mmapwrite")) {
+        flags = O_RDWR | O_CREAT | O_TRUNC;
+    } else if (!strcmp(job, "read") || !strcmp(job, "randread") ||
+               !strcmp(job, "mmapread")) {
+        flags = O_RDONLY;
+    } else if (!strcmp(job, "randwrite")) {
+        flags = O_WRONLY;
+    } else {
+        goto usage;
+    }
+    prefix = !strcmp(job, "append") ? "append" : !strncmp(job, "mmap", 4) ? "m"
+                                                                         : "f";
+    if (!strcmp(job, "append"))
+        nr_files = 1;
+    for (f = 0; f < nr_files && !err; f++) {
+        fds[f] = open_file(dir, prefix, f, flags);
+        if (fds[f] < 0)
+            err = fds[f];
+        else if (!strcmp(job, "mmapwrite") && ftruncate(fds[f], file_size))
+            err = -errno;
+    }
+    if (err)
+        goto error;
+    if (!strcmp(job, "append"))
+        nr_ops = file_size / bs;
+
+    start = now_ns();
+    if (!strcmp(job, "write") || !strcmp(job, "read")) {
+        for (f = 0; f < nr_files && !err; f++) {
+            for (off = 0; off < file_size && !err; off += bs) {
+                t = now_ns();
+                ret = job[0] == 'w' ? pwrite(fds[f], buf, bs, off)
+                                    : pread(fds[f], buf, bs, off);
+                lat[n++] = now_ns() - t;
+                if (ret != (ssize_t) bs)
+                    err = ret < 0 ? -errno : -EIO;
+            }
+        }
+    } else if (!strcmp(job, "randwrite") || !strcmp(job, "randread")) {
+        for (n = 0; n < nr_ops && !err;) {
+            f = rng() % nr_files;
+            off = rng() % (file_size / bs) * bs;
+            t = now_ns();
+            ret = job[4] == 'w' ? pwrite(fds[f], buf, bs, off)
+                                : pread(fds[f], buf, bs, off);
+            lat[n++] = now_ns() - t;
+            if (ret != (ssize_t) bs)
+                err = ret < 0 ? -errno : -EIO;
+        }
+    } else if (!strcmp(job, "append")) {
+        for (n = 0; n < nr_ops && !err;) {
+            t = now_ns();
+            ret = write(fds[0], buf, bs);
+            if (ret == (ssize_t) bs && fsync(fds[0]))
+                ret = -1;
+            lat[n++] = now_ns() - t;
+            if (ret != (ssize_t) bs)
+                err = ret < 0 ? -errno : -EIO;
+        }
+    } else {
+        /* Mappings, each bs copy timed with the page faults it takes */
+        for (f = 0; f < nr_files && !err; f++) {
+            map = mmap(NULL, file_size,
+                       job[4] == 'w' ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, fds[f], 0);
+            if (map == MAP_FAILED) {
+                err = -errno;
+                break;
+            }
+            for (off = 0; off < file_size; off += bs) {
+                t = now_ns();
+                if (job[4] == 'w')
+                    memcpy(map + off, buf, bs);
+                else
+                    memcpy(buf, map + off, bs);
+                lat[n++] = now_ns() - t;
+            }
+            if (job[4] == 'w' && msync(map, file_size, MS_SYNC))
+                err = -errno;
+            munmap(map, file_size);
+        }
+    }
+
+    /* Writes are measured until they are on disk */
+    if (!err && (!strcmp(job, "write") || !strcmp(job, "randwrite"))) {
+        for (f = 0; f < nr_files && !err; f++) {
+            if (fsync(fds[f]))
+                err = -errno;
+        }
+    }
+    total = now_ns() - start;
+    if (err)
+        goto error;
+
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%" PRIu64 ",%.6f,%.2f,%.0f,%.2f,%.2f\n", n * bs, total / 1e9,
+           n * bs * 1e3 / (total ? total : 1) / 1.048576,
+           n * 1e9 / (total ? total : 1), lat[n / 2] / 1e3,
+           lat[n * 99 / 100] / 1e3);
+    return EXIT_SUCCESS;
+
+error:
+    fprintf(stderr, "%s%s %s: %s\n", direct ? "direct " : "", job, dir,
+            strerror(-err));
+    return unsupported(err) ? EXIT_UNSUPPORTED : EXIT_FAILURE;
+
+usage:
+    fprintf(stderr,
+            "Usage: %s [-d] [-n files] [-s file_size] job bs dir\n"
+            "  job: write, read, randwrite, randread, append, mmapwrite or\n"
+            "       mmapread\n"
+            "  -d   use O_DIRECT\n"
+            "  -n   number of files (default 8)\n"
+            "  -s   size of each file, a multiple of bs (default 8 MiB)\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,299 @@
+#ifndef SIMPLEFS_KSHIM_H
+#define SIMPLEFS_KSHIM_H
+
+/*
+ * Userspace stand-ins for the kernel API used by bitmap.c, bitmap.h and
+ * extent.c, so that they can be built and timed without the module (see
+ * bench/alloc.c). The headers under linux/ all include this one. Only what
+ * these files use is provided; bit operations follow the word at a time
+ * versions of lib/find_bit.c and lib/bitmap.c so that timings stay close.
+ *
+ * Block reads are served from memory by bench_read_block(), defined by the
+ * benchmark; writes and discards are dropped.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define ERESTARTSYS 512
+
+/* Errors encoded in pointers, as the kernel does */
+#define MAX_ERRNO 4095
+#define ERR_PTR(err) ((void *) (long) (err))
+#define PTR_ERR(ptr) ((long) (ptr))
+#define IS_ERR(ptr) ((unsigned long) (ptr) >= (unsigned long) -MAX_ERRNO)
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef unsigned short umode_t;
+
+#define KBUILD_MODNAME "simplefs"
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+#define pr_err(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 8, 0)
+
+#define U64_MAX UINT64_MAX
+#define round_up(x, y) ((((x) - 1) | ((__typeof__(x)) (y) - 1)) + 1)
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define min_t(type, x, y) ((type) (x) < (type) (y) ? (type) (x) : (type) (y))
+#define max_t(type, x, y) ((type) (x) > (type) (y) ? (type) (x) : (type) (y))
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* Memory */
+#define GFP_KERNEL 0
+#define GFP_NOFS 0
+#define kmalloc(size, gfp) malloc(size)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvcalloc(n, size, gfp) calloc(n, size)
+#define memalloc_nofs_save() 0
+#define memalloc_nofs_restore(flags) ((void) (flags))
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+
+/* Locks, uncontended in the benchmark */
+struct mutex {
+    pthread_mutex_t m;
+};
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+typedef struct {
+    int unused;
+} spinlock_t;
+
+/* Scheduling */
+#define current NULL
+#define fatal_signal_pending(task) 0
+#define cond_resched() \
+    do {               \
+    } while (0)
+
+/* Bitmaps */
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
+#define BITMAP_LAST_WORD_MASK(nbits) (~0UL >> (-(nbits) % BITS_PER_LONG))
+
+static inline void set_bit(unsigned long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+    return (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+/* First bit from start which is set (invert == 0) or clear, size if none */
+static inline unsigned long _find_next_bit(const unsigned long *addr,
+                                           unsigned long size,
+                                           unsigned long start,
+                                           unsigned long invert)
+{
+    unsigned long word;
+
+    if (start >= size)
+        return size;
+    word = (addr[BIT_WORD(start)] ^ invert) & BITMAP_FIRST_WORD_MASK(start);
+    start -= start % BITS_PER_LONG;
+    while (!word) {
+        start += BITS_PER_LONG;
+        if (start >= size)
+            return size;
+        word = addr[BIT_WORD(start)] ^ invert;
+    }
+    return min(start + __builtin_ctzl(word), size);
+}
+
+#define find_next_bit(addr, size, start) _find_next_bit(addr, size, start, 0)
+#define find_next_zero_bit(addr, size, start) \
+    _find_next_bit(addr, size, start, ~0UL)
+
+#define for_each_set_bit(bit, addr, size)                    \
+    for ((bit) = find_next_bit((addr), (size), 0); (bit) < (size); \
+         (bit) = find_next_bit((addr), (size), (bit) + 1))
+#define for_each_set_bit_from(bit, addr, size)                    \
+    for ((bit) = find_next_bit((addr), (size), (bit)); (bit) < (size); \
+         (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+static inline void bitmap_set(unsigned long *map,
+                              unsigned int start,
+                              unsigned int len)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const unsigned int size = start + len;
+    int bits_to_set = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_set = BITMAP_FIRST_WORD_MASK(start);
+
+    while ((int) len >= bits_to_set) {
+        *p |= mask_to_set;
+        len -= bits_to_set;
+        bits_to_set = BITS_PER_LONG;
+        mask_to_set = ~0UL;
+        p++;
+    }
+    if (len) {
+        mask_to_set &= BITMAP_LAST_WORD_MASK(size);
+        *p |= mask_to_set;
+    }
+}
+
+static inline void bitmap_clear(unsigned long *map,
+                                unsigned int start,
+                                unsigned int len)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const unsigned int size = start + len;
+    int bits_to_clear = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_clear = BITMAP_FIRST_WORD_MASK(start);
+
+    while ((int) len >= bits_to_clear) {
+        *p &= ~mask_to_clear;
+        len -= bits_to_clear;
+        bits_to_clear = BITS_PER_LONG;
+        mask_to_clear = ~0UL;
+        p++;
+    }
+    if (len) {
+        mask_to_clear &= BITMAP_LAST_WORD_MASK(size);
+        *p &= ~mask_to_clear;
+    }
+}
+
+static inline unsigned int bitmap_weight(const unsigned long *map,
+                                         unsigned int nbits)
+{
+    unsigned int i, w = 0;
+
+    for (i = 0; i < nbits / BITS_PER_LONG; i++)
+        w += __builtin_popcountl(map[i]);
+    if (nbits % BITS_PER_LONG)
+        w += __builtin_popcountl(map[i] & BITMAP_LAST_WORD_MASK(nbits));
+    return w;
+}
+
+/* VFS, only the fields used */
+struct super_block {
+    unsigned long s_blocksize;
+    unsigned char s_blocksize_bits;
+    void *s_fs_info;
+};
+
+struct inode {
+    struct super_block *i_sb;
+    unsigned long i_ino;
+    umode_t i_mode;
+    loff_t i_size;
+};
+
+#define i_size_read(inode) ((inode)->i_size)
+
+struct qstr;
+struct file;
+struct file_operations;
+struct address_space_operations;
+
+struct fstrim_range {
+    u64 start;
+    u64 len;
+    u64 minlen;
+};
+
+/* Block layer */
+struct buffer_head {
+    char *b_data;
+};
+
+/* Fill data with block bno of the device of sb, return 0 or -1 */
+int bench_read_block(struct super_block *sb, u64 bno, void *data);
+
+static inline struct buffer_head *sb_getblk(struct super_block *sb, u64 bno)
+{
+    struct buffer_head *bh = malloc(sizeof(*bh) + sb->s_blocksize);
+
+    if (bh)
+        bh->b_data = (char *) (bh + 1);
+    return bh;
+}
+
+static inline struct buffer_head *sb_bread(struct super_block *sb, u64 bno)
+{
+    struct buffer_head *bh = sb_getblk(sb, bno);
+
+    if (bh && bench_read_block(sb, bno, bh->b_data)) {
+        free(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+#define brelse(bh) free(bh)
+#define sb_breadahead(sb, bno) ((void) (bno))
+#define lock_buffer(bh) ((void) (bh))
+#define unlock_buffer(bh) ((void) (bh))
+#define set_buffer_uptodate(bh) ((void) (bh))
+#define mark_buffer_dirty(bh) ((void) (bh))
+
+static inline int sb_issue_discard(struct super_block *sb,
+                                   u64 bno,
+                                   u64 len,
+                                   int gfp,
+                                   unsigned long flags)
+{
+    return 0;
+}
+
+struct blk_plug {
+    int unused;
+};
+#define blk_start_plug(plug) ((void) (plug))
+#define blk_finish_plug(plug) ((void) (plug))
+
+/* FIEMAP, reported extents are dropped */
+struct fiemap_extent_info {
+    unsigned int fi_extents_mapped;
+};
+#define FIEMAP_EXTENT_LAST 0x00000001
+#define FIEMAP_EXTENT_DATA_INLINE 0x00000200
+
+static inline int fiemap_prep(struct inode *inode,
+                              struct fiemap_extent_info *fieinfo,
+                              u64 start,
+                              u64 *len,
+                              u32 supported_flags)
+{
+    return 0;
+}
+
+static inline int fiemap_fill_next_extent(struct fiemap_extent_info *fieinfo,
+                                          u64 logical,
+                                          u64 phys,
+                                          u64 len,
+                                          u32 flags)
+{
+    fieinfo->fi_extents_mapped++;
+    return flags & FIEMAP_EXTENT_LAST ? 1 : 0;
+}
+
+#endif /* SIMPLEFS_KSHIM_H */
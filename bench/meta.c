@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * bench-meta: time one metadata operation on count entries of directory dir,
+ * for script/bench-meta.sh. The operations are meant to run in this order on
+ * an empty directory:
+ *
+ *   create   create f0000000 ... (empty files)
+ *   stat     stat them
+ *   readdir  list the directory (each getdents64 call is timed)
+ *   rename   rename f* to r*, in the same directory
+ *   unlink   remove r*
+ *
+ * Prints one CSV line: calls,seconds,ops_per_sec,p50_us,p99_us,sync_ms where
+ * ops_per_sec counts entries, and sync_ms is the time syncfs() then took to
+ * write back the changes (not included in seconds).
+ */
+
+/* Buffer of a getdents64 call, as glibc's readdir */
+#define BENCH_DIRENT_BUF 32768
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Run op on entry i of dfd, return 0 or -errno */
+static int do_op(const char *op, int dfd, uint32_t i)
+{
+    char name[16], to[16];
+    struct stat st;
+    int fd;
+
+    snprintf(name, sizeof(name), "%c%07u", strcmp(op, "unlink") ? 'f' : 'r',
+             i);
+    if (!strcmp(op, "create")) {
+        fd = openat(dfd, name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0)
+            return -errno;
+        close(fd);
+        return 0;
+    }
+    if (!strcmp(op, "stat"))
+        return fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) ? -errno : 0;
+    if (!strcmp(op, "rename")) {
+        snprintf(to, sizeof(to), "r%07u", i);
+        return renameat(dfd, name, dfd, to) ? -errno : 0;
+    }
+    return unlinkat(dfd, name, 0) ? -errno : 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t *lat, i, n = 0, entries = 0, t, start, total, sync_ns = 0;
+    uint32_t count;
+    char *buf;
+    long ret;
+    int dfd, err = 0;
+
+    if (argc != 4 || (strcmp(argv[1], "create") && strcmp(argv[1], "stat") &&
+                      strcmp(argv[1], "readdir") &&
+                      strcmp(argv[1], "rename") && strcmp(argv[1], "unlink"))) {
+        fprintf(stderr,
+                "Usage: %s create|stat|readdir|rename|unlink dir count\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    count = strtoul(argv[3], NULL, 0);
+    dfd = open(argv[2], O_RDONLY | O_DIRECTORY);
+    lat = malloc((count + 1) * sizeof(*lat));
+    buf = malloc(BENCH_DIRENT_BUF);
+    if (dfd < 0 || !lat || !buf) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    start = now_ns();
+    if (!strcmp(argv[1], "readdir")) {
+        /* Entries counted from the d_reclen chain, "." and ".." included */
+        do {
+            t = now_ns();
+            ret = syscall(SYS_getdents64, dfd, buf, BENCH_DIRENT_BUF);
+            lat[n++] = now_ns() - t;
+            for (i = 0; ret > 0 && i < (uint64_t) ret;
+                 i += ((struct dirent64 *) (buf + i))->d_reclen)
+                entries++;
+        } while (ret > 0 && n <= count);
+        if (ret < 0)
+            err = -errno;
+    } else {
+        for (i = 0; i < count && !err; i++) {
+            t = now_ns();
+            err = do_op(argv[1], dfd, i);
+            lat[n++] = now_ns() - t;
+        }
+        entries = n;
+        if (!err && strcmp(argv[1], "stat")) {
+            t = now_ns();
+            if (syncfs(dfd))
+                err = -errno;
+            sync_ns = now_ns() - t;
+        }
+    }
+    total = now_ns() - start - sync_ns;
+
+    if (err) {
+        fprintf(stderr, "%s %s: %s\n", argv[1], argv[2], strerror(-err));
+        return EXIT_FAILURE;
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%" PRIu64 ",%.6f,%.0f,%.2f,%.2f,%.2f\n", n, total / 1e9,
+           entries * 1e9 / (total ? total : 1), lat[n / 2] / 1e3,
+           lat[n * 99 / 100] / 1e3, sync_ns / 1e6);
+
+    free(buf);
+    free(lat);
+    close(dfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,362 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Number of bits held by one bitmap block */
+#define SIMPLEFS_BITS_PER_CHUNK(map) (1U << (map)->chunk_shift)
+
+/* Number of meaningful bits in the i-th chunk of map */
+static inline uint32_t chunk_bits(struct simplefs_bitmap *map, uint32_t i)
+{
+    if (i == map->nr_chunks - 1)
+        return map->nr_bits - ((uint64_t) i << map->chunk_shift);
+    return SIMPLEFS_BITS_PER_CHUNK(map);
+}
+
+/*
+ * Start reading the bitmap blocks of the nr chunks from the i-th one which are
+ * not loaded yet, without waiting for them. The requests are plugged so that
+ * adjacent blocks are merged into a few large bios instead of one per block.
+ */
+void simplefs_bitmap_readahead(struct super_block *sb,
+                               struct simplefs_bitmap *map,
+                               uint32_t i,
+                               uint32_t nr)
+{
+    struct blk_plug plug;
+    uint32_t end = min_t(uint32_t, i + nr, map->nr_chunks);
+
+    blk_start_plug(&plug);
+    for (; i < end; i++) {
+        if (!map->chunks[i])
+            sb_breadahead(sb, map->start + i);
+    }
+    blk_finish_plug(&plug);
+}
+
+/*
+ * Return the i-th chunk of map, reading its bitmap block from disk on first
+ * access and counting its free bits. The following blocks are read ahead in
+ * the same request since chunks are mostly scanned in order.
+ * Return ERR_PTR(-ENOMEM) or ERR_PTR(-EIO) if the chunk cannot be loaded.
+ * Called with map->lock held.
+ */
+static unsigned long *simplefs_bitmap_chunk(struct super_block *sb,
+                                            struct simplefs_bitmap *map,
+                                            uint32_t i)
+{
+    struct buffer_head *bh;
+    unsigned long *chunk;
+    unsigned int nofs;
+
+    if (map->chunks[i])
+        return map->chunks[i];
+
+    /*
+     * A chunk takes a whole block, an order-4 allocation with 64 KiB blocks.
+     * kvmalloc() falls back to vmalloc, which only honours GFP_NOFS through
+     * the scope API on older kernels.
+     */
+    nofs = memalloc_nofs_save();
+    chunk = kvmalloc(sb->s_blocksize, GFP_KERNEL);
+    memalloc_nofs_restore(nofs);
+    if (!chunk)
+        return ERR_PTR(-ENOMEM);
+
+    simplefs_bitmap_readahead(sb, map, i, SIMPLEFS_BITMAP_RA_BLOCKS);
+    bh = sb_bread(sb, map->start + i);
+    if (!bh) {
+        pr_err("Failed to read bitmap block %u\n", map->start + i);
+        kvfree(chunk);
+        return ERR_PTR(-EIO);
+    }
+    memcpy(chunk, bh->b_data, sb->s_blocksize);
+    brelse(bh);
+
+    map->nr_free[i] = bitmap_weight(chunk, chunk_bits(map, i));
+    map->chunks[i] = chunk;
+
+    return chunk;
+}
+
+/*
+ * Initialize map for a bitmap of nr_bits bits stored in nr_chunks blocks
+ * starting at block start. Nothing is read here: chunks are loaded on first
+ * access, so mounting does not depend on the size of the volume. nr_free
+ * points to the matching free counter of the superblock info. The block size
+ * of sb must be set already.
+ * Return 0 on success, a negative error code otherwise.
+ */
+int simplefs_bitmap_init(struct super_block *sb,
+                         struct simplefs_bitmap *map,
+                         uint32_t start,
+                         uint32_t nr_chunks,
+                         uint64_t nr_bits,
+                         uint64_t *nr_free)
+{
+    memset(map, 0, sizeof(struct simplefs_bitmap));
+    map->chunk_shift = sb->s_blocksize_bits + 3;
+
+    if (!nr_chunks || ((uint64_t) nr_chunks << map->chunk_shift) < nr_bits)
+        return -EINVAL;
+
+    map->start = start;
+    map->nr_chunks = nr_chunks;
+    map->nr_bits = nr_bits;
+    map->nr_free_total = nr_free;
+    mutex_init(&map->lock);
+
+    /*
+     * These tables grow with the volume (a 16 TiB volume has 128Ki bfree
+     * chunks), so do not require physically contiguous memory for them.
+     */
+    map->chunks = kvcalloc(nr_chunks, sizeof(unsigned long *), GFP_KERNEL);
+    map->nr_free = kvcalloc(nr_chunks, sizeof(uint32_t), GFP_KERNEL);
+    map->dirty =
+        kvcalloc(BITS_TO_LONGS(nr_chunks), sizeof(unsigned long), GFP_KERNEL);
+    if (!map->chunks || !map->nr_free || !map->dirty) {
+        simplefs_bitmap_destroy(map);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Free all the memory held by map */
+void simplefs_bitmap_destroy(struct simplefs_bitmap *map)
+{
+    uint32_t i;
+
+    if (map->chunks) {
+        for (i = 0; i < map->nr_chunks; i++)
+            kvfree(map->chunks[i]);
+    }
+    kvfree(map->chunks);
+    kvfree(map->nr_free);
+    kvfree(map->dirty);
+    map->chunks = NULL;
+    map->nr_free = NULL;
+    map->dirty = NULL;
+}
+
+/*
+ * Find `len` consecutive free bits in map, mark them used and return the
+ * first one. Chunks are searched in order, loading them as needed, from the
+ * bit goal and wrapping around to the start of the bitmap, or from the first
+ * chunk which may have free bits if goal is 0; a run never spans two chunks.
+ * Return 0 if no run was allocated (bit 0 is never free because of the
+ * superblock and the root inode), *errp being set to -ENOSPC if no such run
+ * was found, or to the error which stopped the search.
+ */
+uint64_t simplefs_bitmap_alloc(struct super_block *sb,
+                               struct simplefs_bitmap *map,
+                               uint32_t len,
+                               uint64_t goal,
+                               int *errp)
+{
+    unsigned long *chunk;
+    uint32_t i, n, first, off, bit;
+    uint64_t ret = 0;
+
+    *errp = -ENOSPC;
+
+    if (goal >= map->nr_bits)
+        goal = 0;
+
+    mutex_lock(&map->lock);
+    first = goal ? goal >> map->chunk_shift : map->hint;
+    off = goal & (SIMPLEFS_BITS_PER_CHUNK(map) - 1);
+
+    /* The chunk of goal comes again last, searched before goal this time */
+    for (n = 0; n <= map->nr_chunks; n++) {
+        i = (first + n) % map->nr_chunks;
+        if (n == map->nr_chunks && !off)
+            break;
+        if (i < map->hint)
+            continue;
+
+        chunk = simplefs_bitmap_chunk(sb, map, i);
+        if (IS_ERR(chunk)) {
+            *errp = PTR_ERR(chunk);
+            break;
+        }
+        if (map->nr_free[i] < len)
+            continue;
+
+        bit = get_first_free_bits(chunk, chunk_bits(map, i), n ? 0 : off, len);
+        if (bit == -1)
+            continue;
+
+        map->nr_free[i] -= len;
+        *map->nr_free_total -= len;
+        set_bit(i, map->dirty);
+        ret = ((uint64_t) i << map->chunk_shift) + bit;
+        *errp = 0;
+        break;
+    }
+
+    /* Move the hint past the chunks known to be full */
+    while (map->hint < map->nr_chunks && map->chunks[map->hint] &&
+           !map->nr_free[map->hint])
+        map->hint++;
+    mutex_unlock(&map->lock);
+
+    return ret;
+}
+
+/*
+ * Mark the `len` bits from bit as free in map.
+ * Return 0 on success, -1 if the range is invalid or cannot be read.
+ */
+int simplefs_bitmap_free(struct super_block *sb,
+                         struct simplefs_bitmap *map,
+                         uint64_t bit,
+                         uint32_t len)
+{
+    unsigned long *chunk;
+    uint32_t i, off, n;
+    int ret = 0;
+
+    if (!len || bit + len > map->nr_bits)
+        return -1;
+
+    mutex_lock(&map->lock);
+    while (len) {
+        i = bit >> map->chunk_shift;
+        off = bit & (SIMPLEFS_BITS_PER_CHUNK(map) - 1);
+        n = min_t(uint32_t, len, SIMPLEFS_BITS_PER_CHUNK(map) - off);
+
+        chunk = simplefs_bitmap_chunk(sb, map, i);
+        if (IS_ERR(chunk)) {
+            ret = -1;
+            break;
+        }
+        put_free_bits(chunk, chunk_bits(map, i), off, n);
+
+        map->nr_free[i] += n;
+        *map->nr_free_total += n;
+        set_bit(i, map->dirty);
+        if (i < map->hint)
+            map->hint = i;
+
+        bit += n;
+        len -= n;
+    }
+    mutex_unlock(&map->lock);
+
+    return ret;
+}
+
+/*
+ * Copy the chunks of map modified since the last call to their bitmap blocks
+ * and mark them dirty. Chunks which were never loaded did not change and are
+ * skipped. The blocks are written by the block device sync which follows
+ * sync_fs, so they go out together instead of one synchronous write each.
+ */
+void simplefs_bitmap_sync(struct super_block *sb, struct simplefs_bitmap *map)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+
+    mutex_lock(&map->lock);
+    for_each_set_bit (i, map->dirty, map->nr_chunks) {
+        bh = sb_getblk(sb, map->start + i);
+        lock_buffer(bh);
+        memcpy(bh->b_data, map->chunks[i], sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+        clear_bit(i, map->dirty);
+    }
+    mutex_unlock(&map->lock);
+}
+
+/*
+ * Discard the free blocks in the byte range described by range, for the
+ * FITRIM ioctl. Each run of free bits in the block bitmap becomes a single
+ * discard request, runs shorter than range->minlen are skipped. A run is
+ * marked used while it is discarded so that it cannot be allocated meanwhile.
+ * On return, range->len holds the number of bytes discarded.
+ */
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_bitmap *map = &sbi->bfree_bitmap;
+    unsigned long *chunk;
+    uint64_t start, end, minlen, base;
+    unsigned long bit, next, last;
+    uint64_t trimmed = 0;
+    uint32_t i;
+    int ret = 0;
+
+    if (!simplefs_discard_supported(sb))
+        return -EOPNOTSUPP;
+
+    start = range->start >> sb->s_blocksize_bits;
+    if (start >= sbi->nr_blocks || range->len < sb->s_blocksize)
+        return -EINVAL;
+    end = sbi->nr_blocks;
+    if ((range->len >> sb->s_blocksize_bits) < end - start)
+        end = start + (range->len >> sb->s_blocksize_bits);
+    minlen = max_t(u64, range->minlen >> sb->s_blocksize_bits, 1);
+
+    for (i = start >> map->chunk_shift;
+         !ret && i <= (end - 1) >> map->chunk_shift; i++) {
+        mutex_lock(&map->lock);
+        chunk = simplefs_bitmap_chunk(sb, map, i);
+        mutex_unlock(&map->lock);
+        if (IS_ERR(chunk)) {
+            ret = PTR_ERR(chunk);
+            break;
+        }
+
+        base = (uint64_t) i << map->chunk_shift;
+        bit = max(start, base) - base;
+        last = min_t(uint64_t, end - base, chunk_bits(map, i));
+        for (; bit < last; bit = next) {
+            mutex_lock(&map->lock);
+            bit = find_next_bit(chunk, last, bit);
+            if (bit >= last) {
+                mutex_unlock(&map->lock);
+                break;
+            }
+            next = find_next_zero_bit(chunk, last, bit);
+            if (next - bit < minlen) {
+                mutex_unlock(&map->lock);
+                continue;
+            }
+            bitmap_clear(chunk, bit, next - bit);
+            mutex_unlock(&map->lock);
+
+            ret = sb_issue_discard(sb, base + bit, next - bit, GFP_NOFS, 0);
+
+            mutex_lock(&map->lock);
+            bitmap_set(chunk, bit, next - bit);
+            mutex_unlock(&map->lock);
+            if (ret)
+                break;
+            trimmed += next - bit;
+
+            if (fatal_signal_pending(current)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            cond_resched();
+        }
+    }
+
+    range->len = trimmed << sb->s_blocksize_bits;
+
+    return ret;
+}
@@ -2,23 +2,23 @@
 #define SIMPLEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/blkdev.h>
 #include "simplefs.h"
 
 /*
- * Return the first bit we found and clear the the following `len` consecutive
- * free bit(s) (set to 1) in a given in-memory bitmap spanning over multiple
- * blocks. Return 0 if no enough free bit(s) were found (we assume that the
- * first bit is never free because of the superblock and the root inode, thus
- * allowing us to use 0 as an error value).
+ * Return the first bit we found from the start-th one and clear the the
+ * following `len` consecutive free bit(s) (set to 1) in a given in-memory
+ * bitmap chunk. Return (uint32_t) -1 if no enough free bit(s) were found.
  */
 static inline uint32_t get_first_free_bits(unsigned long *freemap,
                                            unsigned long size,
+                                           uint32_t start,
                                            uint32_t len)
 {
-    uint32_t bit, prev = 0, count = 0;
+    uint32_t bit = start, prev = 0, count = 0;
 
     /* Iterates over bits which are set (bit, address, size) */
-    for_each_set_bit (bit, freemap, size) {
+    for_each_set_bit_from (bit, freemap, size) {
         if (prev != bit - 1)
             count = 0;
         prev = bit;
@@ -27,37 +27,9 @@ static inline uint32_t get_first_free_bits(unsigned long *freemap,
             return bit - len + 1;
         }
     }
-    return 0;
+    return -1;
 }
 
-/*
- * Return an unused inode number and mark it used.
- * Return 0 if no free inode was found.
- */
-static inline uint32_t get_free_inode(struct simplefs_sb_info *sbi)
-{
-    uint32_t ret = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
-    if (ret)
-        /* Decrease number of free inodes */
-        sbi->nr_free_inodes--;
-    return ret;
-}
-
-/*
- * Return `len` unused block(s) number and mark it used.
- * Return 0 if no enough free block(s) were found.
- */
-static inline uint32_t get_free_blocks(struct simplefs_sb_info *sbi,
-                                       uint32_t len)
-{
-    uint32_t ret = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
-    if (ret)
-        /* Decrease number of free blocks */
-        sbi->nr_free_blocks -= len;
-    return ret;
-}
-
-
 /* Mark the `len` bit(s) from i-th bit in freemap as free (i.e. 1) */
 static inline int put_free_bits(unsigned long *freemap,
                                 unsigned long size,
@@ -74,26 +46,51 @@ static inline int put_free_bits(unsigned long *freemap,
     return 0;
 }
 
+/*
+ * Return an unused inode number, the first one from goal if possible, and
+ * mark it used. Return 0 on failure, with *errp set to -ENOSPC if no free
+ * inode was found or to the error met reading the bitmap.
+ */
+static inline uint32_t get_free_inode(struct simplefs_sb_info *sbi,
+                                      uint32_t goal,
+                                      int *errp)
+{
+    return simplefs_bitmap_alloc(sbi->sb, &sbi->ifree_bitmap, 1, goal, errp);
+}
+
+/*
+ * Return `len` unused block(s) number and mark it used.
+ * Return 0 on failure, with *errp set to -ENOSPC if no enough free block(s)
+ * were found or to the error met reading the bitmap.
+ */
+static inline uint64_t get_free_blocks(struct simplefs_sb_info *sbi,
+                                       uint32_t len,
+                                       int *errp)
+{
+    return simplefs_bitmap_alloc(sbi->sb, &sbi->bfree_bitmap, len, 0, errp);
+}
+
 /* Mark an inode as unused */
 static inline void put_inode(struct simplefs_sb_info *sbi, uint32_t ino)
 {
-    if (put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1))
-        return;
-
-    /* Increase number of free inodes */
-    sbi->nr_free_inodes++;
+    simplefs_bitmap_free(sbi->sb, &sbi->ifree_bitmap, ino, 1);
 }
 
 /* Mark len block(s) as unused */
 static inline void put_blocks(struct simplefs_sb_info *sbi,
-                              uint32_t bno,
+                              uint64_t bno,
                               uint32_t len)
 {
-    if (put_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, bno, len))
-        return;
+    /*
+     * Let the device reclaim the blocks if mounted with -o discard. This is
+     * done while they are still marked used: once freed they may be handed
+     * out and written again before the discard reaches the device.
+     */
+    if (simplefs_test_opt(sbi, DISCARD) && len &&
+        bno + len <= sbi->bfree_bitmap.nr_bits)
+        sb_issue_discard(sbi->sb, bno, len, GFP_NOFS, 0);
 
-    /* Increase number of free blocks */
-    sbi->nr_free_blocks += len;
+    simplefs_bitmap_free(sbi->sb, &sbi->bfree_bitmap, bno, len);
 }
 
 #endif /* SIMPLEFS_BITMAP_H */
@@ -1,12 +1,426 @@
 #define pr_fmt(fmt) "simplefs: " fmt
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/stringhash.h>
 
 #include "simplefs.h"
 
+/*
+ * In-memory name index of a directory, used by lookup with -o dircache.
+ * It is built by the first lookup in the directory, kept up to date by the
+ * operations adding or removing entries (which hold the directory lock
+ * exclusively, so they never run concurrently with a build) and released by
+ * the shrinker under memory pressure or when the directory inode goes away.
+ *
+ * ci->i_dindex and the content of the index are protected by
+ * ci->i_dindex_lock. simplefs_dindex_list, in the order indexes were built,
+ * is protected by simplefs_dindex_list_lock, taken before i_dindex_lock.
+ */
+struct simplefs_dindex {
+    struct list_head list;          /* Entry in simplefs_dindex_list */
+    struct simplefs_inode_info *ci; /* Directory owning this index */
+    unsigned int bits;              /* log2 of the number of buckets */
+    unsigned int nr;                /* Number of names */
+    bool referenced;                /* Used since the last shrinker pass */
+    struct hlist_head hash[];
+};
+
+struct simplefs_dindex_entry {
+    struct hlist_node node;
+    uint32_t ino;
+    uint8_t len;
+    char name[];
+};
+
+/* Bounds on the number of buckets of an index */
+#define SIMPLEFS_DINDEX_MIN_BITS 4
+#define SIMPLEFS_DINDEX_MAX_BITS 16
+
+static LIST_HEAD(simplefs_dindex_list);
+static DEFINE_SPINLOCK(simplefs_dindex_list_lock);
+static atomic_long_t simplefs_dindex_nr_names = ATOMIC_LONG_INIT(0);
+
+static inline struct hlist_head *simplefs_dindex_bucket(
+    struct simplefs_dindex *index,
+    const char *name,
+    unsigned int len)
+{
+    return &index->hash[hash_32(full_name_hash(NULL, name, len), index->bits)];
+}
+
+static void simplefs_dindex_destroy(struct simplefs_dindex *index)
+{
+    struct simplefs_dindex_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << index->bits); i++) {
+        hlist_for_each_entry_safe (entry, tmp, &index->hash[i], node)
+            kfree(entry);
+    }
+    kvfree(index);
+}
+
+/* Detach the index of ci, if any, and free it */
+static void simplefs_dindex_drop(struct simplefs_inode_info *ci)
+{
+    struct simplefs_dindex *index;
+
+    spin_lock(&simplefs_dindex_list_lock);
+    spin_lock(&ci->i_dindex_lock);
+    index = ci->i_dindex;
+    ci->i_dindex = NULL;
+    spin_unlock(&ci->i_dindex_lock);
+    if (index) {
+        list_del(&index->list);
+        atomic_long_sub(index->nr, &simplefs_dindex_nr_names);
+    }
+    spin_unlock(&simplefs_dindex_list_lock);
+
+    if (index)
+        simplefs_dindex_destroy(index);
+}
+
+/* Release the index of a directory inode about to be freed */
+void simplefs_dindex_free(struct simplefs_inode_info *ci)
+{
+    if (READ_ONCE(ci->i_dindex))
+        simplefs_dindex_drop(ci);
+}
+
+/*
+ * Look for name in the index of dir. Return false if dir has no index,
+ * otherwise true with *ino set to the inode number of name, or 0 if dir has
+ * no such entry.
+ */
+bool simplefs_dindex_lookup(struct inode *dir,
+                            const struct qstr *name,
+                            uint32_t *ino)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(dir);
+    struct simplefs_dindex_entry *entry;
+    struct simplefs_dindex *index;
+
+    spin_lock(&ci->i_dindex_lock);
+    index = ci->i_dindex;
+    if (!index) {
+        spin_unlock(&ci->i_dindex_lock);
+        return false;
+    }
+
+    WRITE_ONCE(index->referenced, true);
+    *ino = 0;
+    hlist_for_each_entry (entry,
+                          simplefs_dindex_bucket(index, name->name, name->len),
+                          node) {
+        if (entry->len == name->len &&
+            !memcmp(entry->name, name->name, name->len)) {
+            *ino = entry->ino;
+            break;
+        }
+    }
+    spin_unlock(&ci->i_dindex_lock);
+
+    return true;
+}
+
+static struct simplefs_dindex_entry *simplefs_dindex_new_entry(
+    const char *name,
+    unsigned int len,
+    uint32_t ino)
+{
+    struct simplefs_dindex_entry *entry;
+
+    entry = kmalloc(sizeof(*entry) + len, GFP_NOFS);
+    if (!entry)
+        return NULL;
+    entry->ino = ino;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+
+    return entry;
+}
+
+/*
+ * Read all the entries of dir and install an index of their names.
+ * Return 0 on success, a negative error code otherwise.
+ */
+int simplefs_dindex_build(struct inode *dir)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(dir);
+    struct super_block *sb = dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct buffer_head *bh = NULL, *bh2 = NULL;
+    struct simplefs_file_ei_block *eblock = NULL;
+    struct simplefs_dir_block *dblock = NULL;
+    struct simplefs_dindex_entry *entry;
+    struct simplefs_dindex *index;
+    struct simplefs_file *f;
+    unsigned int bits;
+    int ei, bi, fi;
+    int ret = 0;
+
+    bh = sb_bread(sb, ci->ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct simplefs_file_ei_block *) bh->b_data;
+
+    bits = clamp_t(unsigned int, order_base_2(eblock->nr_files),
+                   SIMPLEFS_DINDEX_MIN_BITS, SIMPLEFS_DINDEX_MAX_BITS);
+    index = kvzalloc(struct_size(index, hash, 1U << bits), GFP_NOFS);
+    if (!index) {
+        brelse(bh);
+        return -ENOMEM;
+    }
+    index->ci = ci;
+    index->bits = bits;
+
+    for (ei = 0; ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&eblock->extents[ei]))
+            break;
+
+        for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
+            bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
+            if (!bh2) {
+                ret = -EIO;
+                goto failed;
+            }
+            dblock = (struct simplefs_dir_block *) bh2->b_data;
+
+            for (fi = 0; fi < sbi->files_per_block; fi++) {
+                f = &dblock->files[fi];
+                if (!f->inode) {
+                    brelse(bh2);
+                    goto install;
+                }
+                entry = simplefs_dindex_new_entry(
+                    f->filename, strnlen(f->filename, SIMPLEFS_FILENAME_LEN),
+                    f->inode);
+                if (!entry) {
+                    brelse(bh2);
+                    ret = -ENOMEM;
+                    goto failed;
+                }
+                hlist_add_head(&entry->node,
+                               simplefs_dindex_bucket(index, entry->name,
+                                                      entry->len));
+                index->nr++;
+            }
+            brelse(bh2);
+        }
+    }
+
+install:
+    brelse(bh);
+
+    /* Another lookup may have built it meanwhile */
+    spin_lock(&simplefs_dindex_list_lock);
+    spin_lock(&ci->i_dindex_lock);
+    if (!ci->i_dindex) {
+        ci->i_dindex = index;
+        list_add_tail(&index->list, &simplefs_dindex_list);
+        atomic_long_add(index->nr, &simplefs_dindex_nr_names);
+        index = NULL;
+    }
+    spin_unlock(&ci->i_dindex_lock);
+    spin_unlock(&simplefs_dindex_list_lock);
+
+    if (index)
+        simplefs_dindex_destroy(index);
+
+    return 0;
+
+failed:
+    brelse(bh);
+    simplefs_dindex_destroy(index);
+    return ret;
+}
+
+/*
+ * Record that dir now has an entry name for inode ino. If the name cannot be
+ * recorded, or if the index got too crowded, the index is dropped and the
+ * next lookup builds a new one.
+ */
+void simplefs_dindex_add(struct inode *dir, const struct qstr *name, uint32_t ino)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(dir);
+    struct simplefs_dindex_entry *entry;
+    struct simplefs_dindex *index;
+    bool drop = false;
+
+    if (!READ_ONCE(ci->i_dindex))
+        return;
+
+    entry = simplefs_dindex_new_entry(name->name, name->len, ino);
+
+    spin_lock(&ci->i_dindex_lock);
+    index = ci->i_dindex;
+    if (index && entry) {
+        hlist_add_head(&entry->node, simplefs_dindex_bucket(index, name->name,
+                                                             name->len));
+        index->nr++;
+        atomic_long_inc(&simplefs_dindex_nr_names);
+        entry = NULL;
+        drop = index->bits < SIMPLEFS_DINDEX_MAX_BITS &&
+               index->nr > (2U << index->bits);
+    } else if (index) {
+        drop = true;
+    }
+    spin_unlock(&ci->i_dindex_lock);
+
+    kfree(entry);
+    if (drop)
+        simplefs_dindex_drop(ci);
+}
+
+/* Record that dir has no entry name anymore */
+void simplefs_dindex_del(struct inode *dir, const struct qstr *name)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(dir);
+    struct simplefs_dindex_entry *entry;
+    struct simplefs_dindex *index;
+
+    if (!READ_ONCE(ci->i_dindex))
+        return;
+
+    spin_lock(&ci->i_dindex_lock);
+    index = ci->i_dindex;
+    if (!index) {
+        spin_unlock(&ci->i_dindex_lock);
+        return;
+    }
+    hlist_for_each_entry (entry,
+                          simplefs_dindex_bucket(index, name->name, name->len),
+                          node) {
+        if (entry->len == name->len &&
+            !memcmp(entry->name, name->name, name->len)) {
+            hlist_del(&entry->node);
+            index->nr--;
+            atomic_long_dec(&simplefs_dindex_nr_names);
+            break;
+        }
+    }
+    spin_unlock(&ci->i_dindex_lock);
+
+    /* entry is NULL at the end of the loop if name was not found */
+    kfree(entry);
+}
+
+static unsigned long simplefs_dindex_count(struct shrinker *shrink,
+                                           struct shrink_control *sc)
+{
+    return vfs_pressure_ratio(atomic_long_read(&simplefs_dindex_nr_names));
+}
+
+/*
+ * Free whole indexes, oldest first, until sc->nr_to_scan names were looked
+ * at. Indexes used since the previous pass get a second chance.
+ */
+static unsigned long simplefs_dindex_scan(struct shrinker *shrink,
+                                          struct shrink_control *sc)
+{
+    struct simplefs_dindex *index, *tmp;
+    unsigned long scanned = 0, freed = 0;
+    LIST_HEAD(dispose);
+
+    spin_lock(&simplefs_dindex_list_lock);
+    list_for_each_entry_safe (index, tmp, &simplefs_dindex_list, list) {
+        if (scanned >= sc->nr_to_scan)
+            break;
+        scanned += index->nr + 1;
+
+        if (READ_ONCE(index->referenced)) {
+            WRITE_ONCE(index->referenced, false);
+            continue;
+        }
+
+        spin_lock(&index->ci->i_dindex_lock);
+        index->ci->i_dindex = NULL;
+        spin_unlock(&index->ci->i_dindex_lock);
+        list_move(&index->list, &dispose);
+        atomic_long_sub(index->nr, &simplefs_dindex_nr_names);
+        freed += index->nr;
+    }
+    spin_unlock(&simplefs_dindex_list_lock);
+
+    list_for_each_entry_safe (index, tmp, &dispose, list)
+        simplefs_dindex_destroy(index);
+
+    return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *simplefs_dindex_shrinker;
+#else
+static struct shrinker simplefs_dindex_shrinker_s = {
+    .count_objects = simplefs_dindex_count,
+    .scan_objects = simplefs_dindex_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+#endif
+
+int simplefs_init_dindex(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    simplefs_dindex_shrinker = shrinker_alloc(0, "simplefs-dindex");
+    if (!simplefs_dindex_shrinker)
+        return -ENOMEM;
+    simplefs_dindex_shrinker->count_objects = simplefs_dindex_count;
+    simplefs_dindex_shrinker->scan_objects = simplefs_dindex_scan;
+    shrinker_register(simplefs_dindex_shrinker);
+    return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&simplefs_dindex_shrinker_s, "simplefs-dindex");
+#else
+    return register_shrinker(&simplefs_dindex_shrinker_s);
+#endif
+}
+
+void simplefs_destroy_dindex(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(simplefs_dindex_shrinker);
+#else
+    unregister_shrinker(&simplefs_dindex_shrinker_s);
+#endif
+}
+
+/*
+ * Start reading the inode store blocks of the files listed in dblock, which
+ * are about to be looked up and stat'ed by the caller of readdir (e.g. ls -l).
+ * Entries of one directory are mostly in the same or adjacent inode blocks,
+ * so only changes of block are submitted and the plug merges the requests.
+ */
+static void simplefs_readahead_dir_inodes(struct super_block *sb,
+                                          struct simplefs_dir_block *dblock)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t i, block, prev = 0;
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < sbi->files_per_block; i++) {
+        if (!dblock->files[i].inode ||
+            dblock->files[i].inode >= sbi->nr_inodes)
+            continue;
+        block = dblock->files[i].inode / sbi->inodes_per_block + 1;
+        if (block == prev)
+            continue;
+        sb_breadahead(sb, block);
+        prev = block;
+    }
+    blk_finish_plug(&plug);
+}
+
 /*
  * Iterate over the files contained in dir and commit them in ctx.
  * This function is called by the VFS while ctx->pos changes.
@@ -17,11 +431,13 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
     struct inode *inode = file_inode(dir);
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
     struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct buffer_head *bh = NULL, *bh2 = NULL;
     struct simplefs_file_ei_block *eblock = NULL;
     struct simplefs_dir_block *dblock = NULL;
     struct simplefs_file *f = NULL;
     int ei = 0, bi = 0, fi = 0;
+    uint32_t pos;
     int ret = 0;
 
     /* Check that dir is a directory */
@@ -32,7 +448,7 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
      * Check that ctx->pos is not bigger than what we can handle (including
      * . and ..)
      */
-    if (ctx->pos > SIMPLEFS_MAX_SUBFILES + 2)
+    if (ctx->pos > sbi->max_subfiles + 2)
         return 0;
 
     /* Commit . and .. to ctx */
@@ -45,38 +461,44 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
         return -EIO;
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
-    ei = (ctx->pos - 2) / SIMPLEFS_FILES_PER_EXT;
-    bi = (ctx->pos - 2) % SIMPLEFS_FILES_PER_EXT
-         / SIMPLEFS_FILES_PER_BLOCK;
-    fi = (ctx->pos - 2) % SIMPLEFS_FILES_PER_BLOCK;
+    pos = ctx->pos - 2;
+    ei = pos / sbi->files_per_ext;
+    bi = pos % sbi->files_per_ext / sbi->files_per_block;
+    fi = pos % sbi->files_per_block;
 
     /* Iterate over the index block and commit subfiles */
-    for (; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
-        if (eblock->extents[ei].ee_start == 0) {
+    for (; ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&eblock->extents[ei])) {
             break;
         }
         /* Iterate over blocks in one extent */
         for (; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+            bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
             if (!bh2) {
                 ret = -EIO;
                 goto release_bh;
             }
             dblock = (struct simplefs_dir_block *) bh2->b_data;
             if (dblock->files[0].inode == 0) {
-                break;
+                brelse(bh2);
+                goto release_bh;
             }
+            simplefs_readahead_dir_inodes(sb, dblock);
             /* Iterate every file in one block */
-            for (; fi < SIMPLEFS_FILES_PER_BLOCK; fi++) {
+            for (; fi < sbi->files_per_block; fi++) {
                 f = &dblock->files[fi];
                 if (f->inode && !dir_emit(ctx, f->filename, SIMPLEFS_FILENAME_LEN,
-                               f->inode, DT_UNKNOWN))
-                    break;
+                               f->inode, DT_UNKNOWN)) {
+                    brelse(bh2);
+                    goto release_bh;
+                }
                 ctx->pos++;
             }
             brelse(bh2);
             bh2 = NULL;
+            fi = 0;
         }
+        bi = 0;
     }
 
 release_bh:
@@ -88,4 +510,8 @@ release_bh:
 const struct file_operations simplefs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate_shared = simplefs_iterate,
+    .unlocked_ioctl = simplefs_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
 };
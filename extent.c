@@ -1,5 +1,10 @@
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/fiemap.h>
+#endif
 
 #include "simplefs.h"
 
@@ -9,16 +14,115 @@
  * Return -1 if it is out of range.
  * TODO: use binary search.
  */
-uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
+uint32_t simplefs_ext_search(struct super_block *sb,
+                             struct simplefs_file_ei_block *index,
                              uint32_t iblock)
 {
     uint32_t i;
-    for (i = 0; i < SIMPLEFS_MAX_EXTENTS; i++) {
+    for (i = 0; i < SIMPLEFS_SB(sb)->max_extents; i++) {
         uint32_t block = index->extents[i].ee_block;
         uint32_t len = index->extents[i].ee_len;
-        if (index->extents[i].ee_start == 0 ||
+        if (!simplefs_ext_start(&index->extents[i]) ||
             (iblock >= block && iblock < block + len))
             return i;
     }
     return -1;
 }
+
+/*
+ * Report the extents of inode overlapping [start, start + len) to FIEMAP.
+ * Extents are read straight from the index block pointed by ei_block, which
+ * is sorted by logical block and ends at the first unused entry. Inline data
+ * is reported as one extent located in the inode store. Regular files stop
+ * at the block holding i_size: blocks of the last extent past it were
+ * allocated ahead and hold no data.
+ * Return 0 on success, a negative error code otherwise.
+ */
+int simplefs_fiemap(struct inode *inode,
+                    struct fiemap_extent_info *fieinfo,
+                    u64 start,
+                    u64 len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct buffer_head *bh;
+    u64 logical, phys, size, end, eof;
+    uint32_t flags;
+    int i, ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    ret = fiemap_prep(inode, fieinfo, start, &len, 0);
+#else
+    ret = fiemap_check_flags(fieinfo, 0);
+#endif
+    if (ret)
+        return ret;
+
+    /* fiemap_check_flags() does not bound len, do not let the end wrap */
+    end = len > U64_MAX - start ? U64_MAX : start + len;
+
+    /* Inline data is a single extent inside the inode on disk */
+    if (simplefs_has_inline_data(ci)) {
+        if (start >= inode->i_size)
+            return 0;
+        phys = (u64) (inode->i_ino / sbi->inodes_per_block + 1) *
+                   sb->s_blocksize +
+               inode->i_ino % sbi->inodes_per_block * sbi->inode_size +
+               offsetof(struct simplefs_inode, i_data);
+        ret = fiemap_fill_next_extent(
+            fieinfo, 0, phys, inode->i_size,
+            FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_LAST);
+        return ret < 0 ? ret : 0;
+    }
+
+    if (!ci->ei_block)
+        return 0;
+
+    bh = sb_bread(sb, ci->ei_block);
+    if (!bh)
+        return -EIO;
+    index = (struct simplefs_file_ei_block *) bh->b_data;
+
+    /* Directories use all the entry blocks of their extents */
+    eof = S_ISDIR(inode->i_mode) ? U64_MAX
+                                 : round_up((u64) i_size_read(inode),
+                                            sb->s_blocksize);
+
+    for (i = 0; i < sbi->max_extents; i++) {
+        if (!simplefs_ext_start(&index->extents[i]))
+            break;
+
+        logical = (u64) index->extents[i].ee_block << sb->s_blocksize_bits;
+        phys = simplefs_ext_start(&index->extents[i]) << sb->s_blocksize_bits;
+        size = (u64) index->extents[i].ee_len << sb->s_blocksize_bits;
+
+        /* Skip extents before the requested range, stop after it or EOF */
+        if (logical + size <= start)
+            continue;
+        if (logical >= end || logical >= eof)
+            break;
+
+        flags = 0;
+        if (logical + size >= eof) {
+            size = eof - logical;
+            flags |= FIEMAP_EXTENT_LAST;
+        } else if (i == sbi->max_extents - 1 ||
+                   !simplefs_ext_start(&index->extents[i + 1])) {
+            flags |= FIEMAP_EXTENT_LAST;
+        }
+
+        /* 1 means the user buffer is full, which is not an error */
+        ret = fiemap_fill_next_extent(fieinfo, logical, phys, size, flags);
+        if (ret) {
+            if (ret == 1)
+                ret = 0;
+            break;
+        }
+    }
+
+    brelse(bh);
+
+    return ret;
+}
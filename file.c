@@ -4,15 +4,85 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/highmem.h>
 #include <linux/mpage.h>
+#include <linux/uaccess.h>
 
 #include "bitmap.h"
 #include "simplefs.h"
 
+/*
+ * Zero on disk the blocks of extent ext lying in [from, to) of the file, except
+ * block skip which the caller maps as new, and forget any stale alias of them
+ * in the buffer cache.
+ * Return 0 on success, a negative error code otherwise.
+ */
+static int simplefs_zero_extent(struct super_block *sb,
+                                struct simplefs_extent *ext,
+                                uint32_t from,
+                                uint32_t to,
+                                uint32_t skip)
+{
+    uint64_t bno;
+    int ret;
+
+    from = max(from, ext->ee_block);
+    to = min(to, ext->ee_block + ext->ee_len);
+    if (skip >= from && skip < to) {
+        ret = simplefs_zero_extent(sb, ext, from, skip, skip);
+        if (ret)
+            return ret;
+        from = skip + 1;
+    }
+    if (from >= to)
+        return 0;
+
+    bno = simplefs_ext_start(ext) + from - ext->ee_block;
+    ret = sb_issue_zeroout(sb, bno, to - from, GFP_NOFS);
+    if (!ret)
+        clean_bdev_aliases(sb->s_bdev, bno, to - from);
+
+    return ret;
+}
+
+/*
+ * Zero the allocated blocks of the file lying in [from, to), except block skip,
+ * through simplefs_zero_extent().
+ * Return 0 on success, a negative error code otherwise.
+ */
+static int simplefs_zero_range(struct super_block *sb,
+                               struct simplefs_file_ei_block *index,
+                               uint32_t from,
+                               uint32_t to,
+                               uint32_t skip)
+{
+    struct simplefs_extent *ext;
+    uint32_t i;
+    int ret;
+
+    for (i = simplefs_ext_search(sb, index, from);
+         i < SIMPLEFS_SB(sb)->max_extents; i++) {
+        ext = &index->extents[i];
+        if (!simplefs_ext_start(ext) || ext->ee_block >= to)
+            break;
+        ret = simplefs_zero_extent(sb, ext, from, to, skip);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
  * true,  allocate a new block on disk and map it.
+ *
+ * Freed blocks are not scrubbed, so allocated blocks from i_valid_blocks on may
+ * hold stale data. They are past the end of file, which is never read from
+ * disk, and are zeroed only when a write passes over them without covering
+ * them. Sequential writes thus never zero anything: the block being written is
+ * mapped as new and block_write_begin() zeroes what the write leaves of it.
  */
 static int simplefs_file_get_block(struct inode *inode,
                                    sector_t iblock,
@@ -25,11 +95,12 @@ static int simplefs_file_get_block(struct inode *inode,
     struct simplefs_file_ei_block *index;
     struct buffer_head *bh_index;
     bool alloc = false;
-    int ret = 0, bno;
-    uint32_t extent;
+    int ret = 0;
+    uint64_t bno;
+    uint32_t extent, logical;
 
     /* If block number exceeds filesize, fail */
-    if (iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_MAX_EXTENTS)
+    if (iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * sbi->max_extents)
         return -EFBIG;
 
     /* Read directory block from disk */
@@ -38,7 +109,7 @@ static int simplefs_file_get_block(struct inode *inode,
         return -EIO;
     index = (struct simplefs_file_ei_block *) bh_index->b_data;
 
-    extent = simplefs_ext_search(index, iblock);
+    extent = simplefs_ext_search(sb, index, iblock);
     if (extent == -1) {
         ret = -EFBIG;
         goto brelse_index;
@@ -46,43 +117,149 @@ static int simplefs_file_get_block(struct inode *inode,
 
     /*
      * Check if iblock is already allocated. If not and create is true,
-     * allocate it. Else, get the physical block number.
+     * allocate extents until one covers it. Else, get the physical block
+     * number.
      */
-    if (index->extents[extent].ee_start == 0) {
+    while (!simplefs_ext_start(&index->extents[extent])) {
         if (!create)
-            return 0;
-        bno = get_free_blocks(sbi, 8);
-        if (!bno) {
-            ret = -ENOSPC;
             goto brelse_index;
-        }
-        index->extents[extent].ee_start = bno;
+        bno = get_free_blocks(sbi, 8, &ret);
+        if (!bno)
+            goto brelse_index;
+
+        logical = extent ? index->extents[extent - 1].ee_block +
+                               index->extents[extent - 1].ee_len
+                         : 0;
+        simplefs_ext_set_start(&index->extents[extent], bno);
         index->extents[extent].ee_len = 8;
-        index->extents[extent].ee_block =
-            extent ? index->extents[extent - 1].ee_block +
-                         index->extents[extent - 1].ee_len
-                   : 0;
+        index->extents[extent].ee_block = logical;
+
+        /* A hole filled below i_valid_blocks must read back as zeroes */
+        ret = simplefs_zero_extent(sb, &index->extents[extent], logical,
+                                   ci->i_valid_blocks, iblock);
+        if (ret) {
+            memset(&index->extents[extent], 0, sizeof(struct simplefs_extent));
+            put_blocks(sbi, bno, 8);
+            goto brelse_index;
+        }
         alloc = true;
-    } else {
-        bno = index->extents[extent].ee_start + iblock -
-              index->extents[extent].ee_block;
+
+        /* iblock is past this extent, there is a hole before it */
+        if (iblock >= index->extents[extent].ee_block + 8) {
+            if (++extent == sbi->max_extents) {
+                ret = -EFBIG;
+                goto brelse_index;
+            }
+        }
+    }
+
+    /*
+     * A write past i_valid_blocks: zero the stale blocks it skips over, then
+     * map iblock as new so that its unwritten part is zeroed as well.
+     */
+    if (create && iblock >= ci->i_valid_blocks) {
+        ret = simplefs_zero_range(sb, index, ci->i_valid_blocks, iblock,
+                                  iblock);
+        if (ret)
+            goto brelse_index;
+        ci->i_valid_blocks = iblock + 1;
+        set_buffer_new(bh_result);
     }
 
+    bno = simplefs_ext_start(&index->extents[extent]) + iblock -
+          index->extents[extent].ee_block;
+
     /* Map the physical block to to the given buffer_head */
     map_bh(bh_result, sb, bno);
+    if (alloc)
+        set_buffer_new(bh_result);
 
 brelse_index:
+    if (alloc)
+        mark_buffer_dirty(bh_index);
     brelse(bh_index);
 
     return ret;
 }
 
+/*
+ * Fill page with the data stored inline in the inode. Only the first page of
+ * the file can hold inline data, the others are zeroed.
+ */
+static void simplefs_read_inline_page(struct inode *inode, struct page *page)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    size_t size = 0;
+    void *kaddr;
+
+    if (!page->index)
+        size = min_t(loff_t, i_size_read(inode),
+                     simplefs_inline_len(inode->i_sb));
+
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, ci->i_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap_atomic(kaddr);
+    SetPageUptodate(page);
+}
+
+/*
+ * Move the inline data of inode out of the inode: allocate its index block and
+ * leave the data in a dirty first page, which writeback maps to a regular
+ * extent through simplefs_file_get_block().
+ * Return 0 on success, a negative error code otherwise.
+ */
+static int simplefs_convert_inline(struct inode *inode, unsigned int flags)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct page *page;
+    uint64_t bno;
+    int ret = 0;
+
+    page = grab_cache_page_write_begin(inode->i_mapping, 0, flags);
+    if (!page)
+        return -ENOMEM;
+    if (!PageUptodate(page))
+        simplefs_read_inline_page(inode, page);
+
+    bno = get_free_blocks(sbi, 1, &ret);
+    if (!bno)
+        goto unlock;
+    simplefs_zero_blocks(sb, bno, 1);
+
+    ci->ei_block = bno;
+    ci->i_flags &= ~SIMPLEFS_INODE_INLINE;
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+    inode->i_blocks = 1;
+    mark_inode_dirty(inode);
+
+    if (i_size_read(inode))
+        set_page_dirty(page);
+
+unlock:
+    unlock_page(page);
+    put_page(page);
+
+    return ret;
+}
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
 static int simplefs_readpage(struct file *file, struct page *page)
 {
+    struct inode *inode = page->mapping->host;
+
+    if (simplefs_has_inline_data(SIMPLEFS_INODE(inode))) {
+        simplefs_read_inline_page(inode, page);
+        unlock_page(page);
+        return 0;
+    }
+
     return mpage_readpage(page, simplefs_file_get_block);
 }
 
@@ -92,6 +269,14 @@ static int simplefs_readpage(struct file *file, struct page *page)
  */
 static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
 {
+    struct inode *inode = page->mapping->host;
+
+    /* Inline data is written back with the inode */
+    if (simplefs_has_inline_data(SIMPLEFS_INODE(inode))) {
+        unlock_page(page);
+        return 0;
+    }
+
     return block_write_full_page(page, simplefs_file_get_block, wbc);
 }
 
@@ -109,13 +294,38 @@ static int simplefs_write_begin(struct file *file,
                                 void **fsdata)
 {
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(file->f_inode);
+    struct page *page;
     int err;
     uint32_t nr_allocs = 0;
 
     /* Check if the write can be completed (enough space?) */
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
+    if (pos + len > file->f_inode->i_sb->s_maxbytes)
         return -ENOSPC;
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
+
+    /*
+     * Small files keep their data in the inode, the write goes to the first
+     * page and is copied in i_data by simplefs_write_end(). A file growing
+     * past the inline limit is moved to regular blocks first.
+     */
+    if (simplefs_has_inline_data(ci)) {
+        if (pos + len <= simplefs_inline_len(file->f_inode->i_sb)) {
+            page = grab_cache_page_write_begin(mapping, 0, flags);
+            if (!page)
+                return -ENOMEM;
+            if (!PageUptodate(page))
+                simplefs_read_inline_page(file->f_inode, page);
+            *pagep = page;
+            return 0;
+        }
+
+        err = simplefs_convert_inline(file->f_inode, flags);
+        if (err)
+            return err;
+    }
+
+    nr_allocs = max(pos + len, file->f_inode->i_size) >>
+                file->f_inode->i_blkbits;
     if (nr_allocs > file->f_inode->i_blocks - 1)
         nr_allocs -= file->f_inode->i_blocks - 1;
     else
@@ -126,16 +336,16 @@ static int simplefs_write_begin(struct file *file,
     /* prepare the write */
     err = block_write_begin(mapping, pos, len, flags, pagep,
                             simplefs_file_get_block);
-    /* if this failed, reclaim newly allocated blocks */
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
+    /* if this failed, reclaim blocks allocated past the end of file */
+    if (err < 0 && pos + len > file->f_inode->i_size)
+        simplefs_truncate(file->f_inode, file->f_inode->i_size);
     return err;
 }
 
 /*
  * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * cache. This functions updates inode metadata. A write never shrinks the
+ * file, blocks are given back by simplefs_truncate().
  */
 static int simplefs_write_end(struct file *file,
                               struct address_space *mapping,
@@ -147,62 +357,170 @@ static int simplefs_write_end(struct file *file,
 {
     struct inode *inode = file->f_inode;
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
-    struct super_block *sb = inode->i_sb;
-    uint32_t nr_blocks_old;
+    blkcnt_t nr_blocks;
+    void *kaddr;
+    int ret;
+
+    /* Copy the written range back to the inode for inline data */
+    if (simplefs_has_inline_data(ci)) {
+        kaddr = kmap_atomic(page);
+        memcpy(ci->i_data + pos, kaddr + pos, copied);
+        kunmap_atomic(kaddr);
+        if (pos + copied > inode->i_size)
+            i_size_write(inode, pos + copied);
+        unlock_page(page);
+        put_page(page);
+
+        /* The data lives in the inode, which has to be written back */
+        mark_inode_dirty(inode);
+        return copied;
+    }
 
     /* Complete the write() */
-    int ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
     if (ret < len) {
         pr_err("wrote less than requested.");
         return ret;
     }
 
-    nr_blocks_old = inode->i_blocks;
+    /*
+     * Update inode metadata. The timestamps were updated before the write by
+     * file_update_time(), which only marks the inode dirty for them when
+     * mounted without lazytime, and generic_write_end() marked it dirty if
+     * i_size changed. Do not dirty it again for nothing when overwriting.
+     */
+    nr_blocks = (inode->i_size >> inode->i_blkbits) + 2;
+    if (inode->i_blocks != nr_blocks) {
+        inode->i_blocks = nr_blocks;
+        mark_inode_dirty(inode);
+    }
+
+    return ret;
+}
 
-    /* Update inode metadata */
-    inode->i_blocks = inode->i_size / SIMPLEFS_BLOCK_SIZE + 2;
-    inode->i_mtime = inode->i_ctime = current_time(inode);
-    mark_inode_dirty(inode);
+/*
+ * Set the size of inode to newsize. When the file shrinks, the extents lying
+ * entirely past the new end of file are freed and the extent straddling it is
+ * trimmed, so only the tail of the index block is walked.
+ * Return 0 on success, a negative error code otherwise.
+ */
+int simplefs_truncate(struct inode *inode, loff_t newsize)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct buffer_head *bh_index;
+    uint32_t nr_blocks, first_ext, keep;
+    int i, ret;
 
-    /* If file is smaller than before, free unused blocks */
-    if (nr_blocks_old > inode->i_blocks) {
-        int i;
-        struct buffer_head *bh_index;
-        struct simplefs_file_ei_block *index;
-        uint32_t first_ext;
-
-        /* Free unused blocks from page cache */
-        truncate_pagecache(inode, inode->i_size);
-
-        /* Read ei_block to remove unused blocks */
-        bh_index = sb_bread(sb, ci->ei_block);
-        if (!bh_index) {
-            pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-                   file->f_path.dentry->d_name.name,
-                   nr_blocks_old - inode->i_blocks);
-            goto end;
+    if (newsize > sb->s_maxbytes)
+        return -EFBIG;
+
+    /* Inline data only needs its tail cleared, unless it grows too big */
+    if (simplefs_has_inline_data(ci)) {
+        if (newsize <= simplefs_inline_len(inode->i_sb)) {
+            if (newsize < inode->i_size)
+                memset(ci->i_data + newsize, 0, inode->i_size - newsize);
+            truncate_setsize(inode, newsize);
+            return 0;
         }
-        index = (struct simplefs_file_ei_block *) bh_index->b_data;
-
-        first_ext = simplefs_ext_search(index, inode->i_blocks - 1);
-        /* Reserve unused block in last extent */
-        if (inode->i_blocks - 1 != index->extents[first_ext].ee_block)
-            first_ext++;
-
-        for (i = first_ext; i < SIMPLEFS_MAX_EXTENTS; i++) {
-            if (!index->extents[i].ee_start)
-                break;
-            put_blocks(SIMPLEFS_SB(sb), index->extents[i].ee_start,
-                       index->extents[i].ee_len);
-            memset(&index->extents[i], 0, sizeof(struct simplefs_extent));
+
+        ret = simplefs_convert_inline(inode, 0);
+        if (ret)
+            return ret;
+    }
+
+    /* Read ei_block to remove unused blocks */
+    bh_index = sb_bread(sb, ci->ei_block);
+    if (!bh_index)
+        return -EIO;
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    nr_blocks = DIV_ROUND_UP(newsize, sb->s_blocksize);
+
+    /* Blocks allocated past the end of file are stale, zero those grown over */
+    if (nr_blocks > ci->i_valid_blocks) {
+        ret = simplefs_zero_range(sb, index, ci->i_valid_blocks, nr_blocks,
+                                  nr_blocks);
+        if (ret)
+            goto brelse_index;
+        ci->i_valid_blocks = nr_blocks;
+    }
+
+    /* Zero the tail of the last block so that it reads back as a hole */
+    ret = block_truncate_page(inode->i_mapping, newsize,
+                              simplefs_file_get_block);
+    if (ret)
+        goto brelse_index;
+
+    /* Update i_size and drop pages past newsize from page cache */
+    truncate_setsize(inode, newsize);
+    inode->i_blocks = (inode->i_size >> inode->i_blkbits) + 2;
+
+    /* Blocks left past the new end of file are freed below */
+    ci->i_valid_blocks = nr_blocks;
+    first_ext = nr_blocks ? simplefs_ext_search(sb, index, nr_blocks - 1) : 0;
+    if (first_ext == -1)
+        goto brelse_index;
+
+    for (i = first_ext; i < sbi->max_extents; i++) {
+        ext = &index->extents[i];
+        if (!simplefs_ext_start(ext))
+            break;
+
+        /* Extent still in use, give back the blocks past newsize only */
+        if (ext->ee_block < nr_blocks) {
+            keep = nr_blocks - ext->ee_block;
+            if (keep < ext->ee_len) {
+                put_blocks(sbi, simplefs_ext_start(ext) + keep,
+                           ext->ee_len - keep);
+                ext->ee_len = keep;
+            }
+            continue;
         }
-        mark_buffer_dirty(bh_index);
-        brelse(bh_index);
+
+        put_blocks(sbi, simplefs_ext_start(ext), ext->ee_len);
+        memset(ext, 0, sizeof(struct simplefs_extent));
     }
-end:
+    mark_buffer_dirty(bh_index);
+
+brelse_index:
+    brelse(bh_index);
+
     return ret;
 }
 
+/*
+ * Handle simplefs specific ioctls, on both regular files and directories.
+ * FITRIM discards the free blocks of the whole filesystem.
+ */
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct super_block *sb = file_inode(file)->i_sb;
+    struct fstrim_range __user *urange = (struct fstrim_range __user *) arg;
+    struct fstrim_range range;
+    int ret;
+
+    switch (cmd) {
+    case FITRIM:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&range, urange, sizeof(range)))
+            return -EFAULT;
+
+        ret = simplefs_trim_fs(sb, &range);
+        if (ret < 0)
+            return ret;
+
+        if (copy_to_user(urange, &range, sizeof(range)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 const struct address_space_operations simplefs_aops = {
     .readpage = simplefs_readpage,
     .writepage = simplefs_writepage,
@@ -216,4 +534,8 @@ const struct file_operations simplefs_file_ops = {
     .read_iter = generic_file_read_iter,
     .write_iter = generic_file_write_iter,
     .fsync = generic_file_fsync,
+    .unlocked_ioctl = simplefs_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
 };
@@ -61,14 +61,26 @@ static int __init simplefs_init(void)
         goto end;
     }
 
+    ret = simplefs_init_dindex();
+    if (ret) {
+        pr_err("Directory index shrinker registration failed\n");
+        goto destroy_inode_cache;
+    }
+
     /* Register a new filesystem */
     ret = register_filesystem(&simplefs_file_system_type);
     if (ret) {
         pr_err("Register_filesystem() failed\n");
-        goto end;
+        goto destroy_dindex;
     }
 
     pr_info("Module loaded\n");
+    return 0;
+
+destroy_dindex:
+    simplefs_destroy_dindex();
+destroy_inode_cache:
+    simplefs_destroy_inode_cache();
 end:
     return ret;
 }
@@ -80,6 +92,8 @@ static void __exit simplefs_exit(void)
     if (ret)
         pr_err("Unregister_filesystem() failed\n");
 
+    simplefs_destroy_dindex();
+
     /* Destroys the cache and releases all associated resources. All allocated objects must have been previously freed. */
     simplefs_destroy_inode_cache();
 
@@ -0,0 +1,536 @@
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+/* Exit codes, as for e2fsck */
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* Inodes handed to a thread at once, a multiple of 8 so that threads never
+ * share a byte of the inode bitmap */
+#define FSCK_INODES_PER_TASK 4096
+
+struct fsck {
+    struct sfs_fs fs;
+    const uint8_t *img; /* Whole image, mapped read-only */
+    size_t img_len;
+    int repair;
+
+    /* Bitmaps rebuilt from the inodes (1 means free) */
+    uint8_t *ifree;
+    uint8_t *bfree;
+
+    uint32_t *refs;      /* Directory entries pointing to each inode */
+    uint32_t next_ino;   /* Next inode to hand out to a thread */
+    unsigned long errors;
+    unsigned long fixed;
+};
+
+#define fsck_error(fsck, ...)                                 \
+    do {                                                      \
+        __atomic_fetch_add(&(fsck)->errors, 1, __ATOMIC_RELAXED); \
+        fprintf(stderr, __VA_ARGS__);                         \
+    } while (0)
+
+static inline const void *fsck_block(struct fsck *fsck, uint64_t bno)
+{
+    return fsck->img + (bno << fsck->fs.blocksize_bits);
+}
+
+static inline const void *fsck_raw_inode(struct fsck *fsck, uint32_t ino)
+{
+    return fsck->img + sfs_inode_offset(&fsck->fs, ino);
+}
+
+/* Mode of inode ino, 0 if free (inodes of regions not zeroed yet are) */
+static inline uint32_t fsck_raw_mode(struct fsck *fsck, uint32_t ino)
+{
+    const struct simplefs_inode *cinode = fsck_raw_inode(fsck, ino);
+
+    if (sfs_itable_uninit(&fsck->fs, ino))
+        return 0;
+    return le32toh(cinode->i_mode);
+}
+
+/*
+ * Mark `len` blocks from bno as used by inode ino in the rebuilt bitmap.
+ * Return -1 if some of them are out of the data area.
+ */
+static int fsck_use_blocks(struct fsck *fsck,
+                           uint32_t ino,
+                           uint64_t bno,
+                           uint32_t len)
+{
+    uint8_t bit, old;
+    uint64_t i;
+
+    if (bno < sfs_data_start(&fsck->fs) || bno + len > fsck->fs.nr_blocks) {
+        fsck_error(fsck, "Inode %u: blocks %" PRIu64 "-%" PRIu64
+                         " out of the data area\n",
+                   ino, bno, bno + len - 1);
+        return -1;
+    }
+
+    for (i = bno; i < bno + len; i++) {
+        bit = 1 << (i % 8);
+        old = __atomic_fetch_and(&fsck->bfree[i / 8], ~bit, __ATOMIC_RELAXED);
+        if (!(old & bit))
+            fsck_error(fsck, "Inode %u: block %" PRIu64
+                             " is used more than once\n",
+                       ino, i);
+    }
+    return 0;
+}
+
+/* Give back the blocks of an inode in the rebuilt bitmap */
+static void fsck_put_blocks(struct fsck *fsck, const struct sfs_inode *inode)
+{
+    const struct simplefs_file_ei_block *index;
+    uint64_t bno, i;
+    uint32_t ei;
+
+    if (!inode->ei_block || inode->ei_block >= fsck->fs.nr_blocks)
+        return;
+    index = fsck_block(fsck, inode->ei_block);
+    for (ei = 0; ei < fsck->fs.max_extents; ei++) {
+        bno = sfs_ext_start(&index->extents[ei]);
+        if (!bno)
+            break;
+        for (i = 0; i < le16toh(index->extents[ei].ee_len) &&
+                    bno + i < fsck->fs.nr_blocks;
+             i++)
+            fsck->bfree[(bno + i) / 8] |= 1 << ((bno + i) % 8);
+    }
+    fsck->bfree[inode->ei_block / 8] |= 1 << (inode->ei_block % 8);
+}
+
+/*
+ * Check the entries of directory ino: each must point to a used inode, and
+ * their number must match nr_files of the index block. Count the references
+ * to each inode and the subdirectories of ino, for the link counts.
+ */
+static void fsck_check_dir(struct fsck *fsck,
+                           uint32_t ino,
+                           struct sfs_inode *inode)
+{
+    struct sfs_fs *fs = &fsck->fs;
+    const struct simplefs_file_ei_block *index;
+    const struct simplefs_dir_block *dblock;
+    const struct simplefs_file *f;
+    uint32_t ei, bi, fi, child, mode, nr_files = 0, subdirs = 0;
+    uint64_t bno;
+
+    index = fsck_block(fsck, inode->ei_block);
+    for (ei = 0; ei < fs->max_extents; ei++) {
+        bno = sfs_ext_start(&index->extents[ei]);
+        if (!bno)
+            break;
+        if (bno + le16toh(index->extents[ei].ee_len) > fs->nr_blocks)
+            break;
+
+        for (bi = 0; bi < le16toh(index->extents[ei].ee_len); bi++) {
+            dblock = fsck_block(fsck, bno + bi);
+            for (fi = 0; fi < fs->files_per_block; fi++) {
+                f = &dblock->files[fi];
+                child = le32toh(f->inode);
+                if (!child)
+                    goto done;
+                nr_files++;
+
+                if (child >= fs->nr_inodes) {
+                    fsck_error(fsck, "Directory %u: entry \"%.*s\" points "
+                                     "to invalid inode %u\n",
+                               ino, SIMPLEFS_FILENAME_LEN, f->filename,
+                               child);
+                    continue;
+                }
+                mode = fsck_raw_mode(fsck, child);
+                if (!mode) {
+                    fsck_error(fsck, "Directory %u: entry \"%.*s\" points "
+                                     "to free inode %u\n",
+                               ino, SIMPLEFS_FILENAME_LEN, f->filename,
+                               child);
+                    continue;
+                }
+                __atomic_fetch_add(&fsck->refs[child], 1, __ATOMIC_RELAXED);
+                if (S_ISDIR(mode))
+                    subdirs++;
+            }
+        }
+    }
+
+done:
+    if (le32toh(index->nr_files) != nr_files) {
+        fsck_error(fsck, "Directory %u: nr_files is %u, should be %u\n", ino,
+                   le32toh(index->nr_files), nr_files);
+        if (fsck->repair) {
+            uint32_t val = htole32(nr_files);
+
+            if (pwrite(fs->fd, &val, sizeof(val),
+                       inode->ei_block << fs->blocksize_bits) == sizeof(val))
+                __atomic_fetch_add(&fsck->fixed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* . in the directory and .. in each subdirectory */
+    if (inode->nlink != 2 + subdirs) {
+        fsck_error(fsck, "Directory %u: i_nlink is %u, should be %u\n", ino,
+                   inode->nlink, 2 + subdirs);
+        if (fsck->repair) {
+            inode->nlink = 2 + subdirs;
+            if (!sfs_write_inode(fs, ino, inode))
+                __atomic_fetch_add(&fsck->fixed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Check inode ino, mark it and its blocks used in the rebuilt bitmaps */
+static void fsck_check_inode(struct fsck *fsck, uint32_t ino)
+{
+    struct sfs_fs *fs = &fsck->fs;
+    const struct simplefs_file_ei_block *index;
+    struct sfs_inode inode;
+    uint64_t bno;
+    uint32_t ei;
+
+    if (sfs_itable_uninit(fs, ino))
+        memset(&inode, 0, sizeof(inode));
+    else
+        sfs_decode_inode(fs, fsck_raw_inode(fsck, ino), &inode);
+    if (!inode.mode) {
+        if (ino == SFS_ROOT_INO)
+            fsck_error(fsck, "Root inode is free\n");
+        return;
+    }
+    fsck->ifree[ino / 8] &= ~(1 << (ino % 8));
+
+    if (!S_ISDIR(inode.mode) && !S_ISREG(inode.mode) &&
+        !S_ISLNK(inode.mode)) {
+        fsck_error(fsck, "Inode %u: invalid mode %o\n", ino, inode.mode);
+        return;
+    }
+    if (S_ISLNK(inode.mode) || (inode.flags & SIMPLEFS_INODE_INLINE))
+        return;
+    if (!inode.ei_block) {
+        if (S_ISDIR(inode.mode))
+            fsck_error(fsck, "Directory %u has no index block\n", ino);
+        return;
+    }
+    if (fsck_use_blocks(fsck, ino, inode.ei_block, 1))
+        return;
+
+    index = fsck_block(fsck, inode.ei_block);
+    for (ei = 0; ei < fs->max_extents; ei++) {
+        bno = sfs_ext_start(&index->extents[ei]);
+        if (!bno)
+            break;
+        fsck_use_blocks(fsck, ino, bno, le16toh(index->extents[ei].ee_len));
+    }
+
+    if (S_ISDIR(inode.mode))
+        fsck_check_dir(fsck, ino, &inode);
+}
+
+/* Pass 1 thread: check inodes, FSCK_INODES_PER_TASK at a time */
+static void *fsck_worker(void *arg)
+{
+    struct fsck *fsck = arg;
+    uint32_t ino, end;
+
+    for (;;) {
+        ino = __atomic_fetch_add(&fsck->next_ino, FSCK_INODES_PER_TASK,
+                                 __ATOMIC_RELAXED);
+        if (ino >= fsck->fs.nr_inodes)
+            break;
+        end = ino + FSCK_INODES_PER_TASK;
+        if (end > fsck->fs.nr_inodes || end < ino)
+            end = fsck->fs.nr_inodes;
+        for (; ino < end; ino++)
+            fsck_check_inode(fsck, ino);
+    }
+    return NULL;
+}
+
+/*
+ * Pass 2: compare the link count of files with the number of entries
+ * pointing to them. Files which no entry points to are cleared.
+ */
+static void fsck_check_links(struct fsck *fsck)
+{
+    struct sfs_fs *fs = &fsck->fs;
+    struct sfs_inode inode;
+    uint32_t ino;
+
+    for (ino = 0; ino < fs->nr_inodes; ino++) {
+        if (sfs_test_bit(fsck->ifree, ino))
+            continue;
+        sfs_decode_inode(fs, fsck_raw_inode(fsck, ino), &inode);
+
+        if (S_ISDIR(inode.mode)) {
+            if (ino != SFS_ROOT_INO && fsck->refs[ino] != 1)
+                fsck_error(fsck, "Directory %u is linked %u times\n", ino,
+                           fsck->refs[ino]);
+            continue;
+        }
+
+        if (!fsck->refs[ino]) {
+            fsck_error(fsck, "Inode %u is not linked to any directory\n", ino);
+            if (fsck->repair) {
+                fsck_put_blocks(fsck, &inode);
+                fsck->ifree[ino / 8] |= 1 << (ino % 8);
+                memset(&inode, 0, sizeof(inode));
+                if (!sfs_write_inode(fs, ino, &inode))
+                    fsck->fixed++;
+            }
+            continue;
+        }
+        if (inode.nlink != fsck->refs[ino]) {
+            fsck_error(fsck, "Inode %u: i_nlink is %u, should be %u\n", ino,
+                       inode.nlink, fsck->refs[ino]);
+            if (fsck->repair) {
+                inode.nlink = fsck->refs[ino];
+                if (!sfs_write_inode(fs, ino, &inode))
+                    fsck->fixed++;
+            }
+        }
+    }
+}
+
+/* Return the number of bits set in the first nr_bits bits of map */
+static uint64_t fsck_count_free(const uint8_t *map, uint64_t nr_bits)
+{
+    uint64_t i, count = 0;
+
+    for (i = 0; i < nr_bits / 8; i++)
+        count += __builtin_popcount(map[i]);
+    for (i = nr_bits & ~7ULL; i < nr_bits; i++)
+        count += sfs_test_bit(map, i);
+    return count;
+}
+
+/* Return the number of bits which differ in the first nr_bits bits */
+static uint64_t fsck_count_diff(const uint8_t *a,
+                                const uint8_t *b,
+                                uint64_t nr_bits)
+{
+    uint64_t i, count = 0;
+
+    for (i = 0; i < nr_bits / 8; i++)
+        count += __builtin_popcount(a[i] ^ b[i]);
+    for (i = nr_bits & ~7ULL; i < nr_bits; i++)
+        count += sfs_test_bit(a, i) != sfs_test_bit(b, i);
+    return count;
+}
+
+/*
+ * Pass 3: compare the rebuilt bitmaps and free counters with the ones of the
+ * image, and replace them if repairing.
+ */
+static void fsck_check_bitmaps(struct fsck *fsck)
+{
+    struct sfs_fs *fs = &fsck->fs;
+    uint64_t free_inodes, free_blocks, diff;
+
+    free_inodes = fsck_count_free(fsck->ifree, fs->nr_inodes);
+    free_blocks = fsck_count_free(fsck->bfree, fs->nr_blocks);
+
+    diff = fsck_count_diff(fsck->ifree, fs->ifree, fs->nr_inodes);
+    if (diff)
+        fsck_error(fsck, "Inode bitmap: %" PRIu64 " inodes differ\n", diff);
+    diff += fsck_count_diff(fsck->bfree, fs->bfree, fs->nr_blocks) << 32;
+    if (diff >> 32)
+        fsck_error(fsck, "Block bitmap: %" PRIu64 " blocks differ\n",
+                   diff >> 32);
+    if (free_inodes != fs->nr_free_inodes)
+        fsck_error(fsck, "Free inodes count is %" PRIu64 ", should be %" PRIu64
+                         "\n",
+                   fs->nr_free_inodes, free_inodes);
+    if (free_blocks != fs->nr_free_blocks)
+        fsck_error(fsck, "Free blocks count is %" PRIu64 ", should be %" PRIu64
+                         "\n",
+                   fs->nr_free_blocks, free_blocks);
+
+    if (fsck->repair && (diff || free_inodes != fs->nr_free_inodes ||
+                         free_blocks != fs->nr_free_blocks)) {
+        memcpy(fs->ifree, fsck->ifree,
+               (size_t) fs->nr_ifree_blocks << fs->blocksize_bits);
+        memcpy(fs->bfree, fsck->bfree,
+               (size_t) fs->nr_bfree_blocks << fs->blocksize_bits);
+        fs->nr_free_inodes = free_inodes;
+        fs->nr_free_blocks = free_blocks;
+        fs->bitmaps_dirty = 1;
+        fsck->fixed++;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n | -y] [-j threads] disk\n"
+            "  -n          check only, do not modify the image (default)\n"
+            "  -y          repair the errors found\n"
+            "  -j threads  number of checking threads (default: number of "
+            "CPUs)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct fsck fsck = {0};
+    struct sfs_fs *fs = &fsck.fs;
+    pthread_t *threads;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct stat st;
+    uint64_t img_size;
+    size_t ilen, blen;
+    long i;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            fsck.repair = 0;
+            break;
+        case 'y':
+            fsck.repair = 1;
+            break;
+        case 'j':
+            nr_threads = strtol(optarg, NULL, 0);
+            if (nr_threads > 0)
+                break;
+            /* fallthrough */
+        default:
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+    if (nr_threads < 1)
+        nr_threads = 1;
+
+    ret = sfs_open(fs, argv[optind], fsck.repair);
+    if (ret) {
+        fprintf(stderr, "%s: cannot open simplefs image: %s\n", argv[optind],
+                strerror(-ret));
+        return FSCK_ERROR;
+    }
+    ret = sfs_load_bitmaps(fs);
+    if (ret) {
+        fprintf(stderr, "Cannot read the bitmaps: %s\n", strerror(-ret));
+        goto error;
+    }
+
+    /*
+     * Map the whole image: the kernel reads it ahead in large requests while
+     * the threads walk the inode store, instead of one read per block.
+     */
+    fsck.img_len = fs->nr_blocks << fs->blocksize_bits;
+    if (fstat(fs->fd, &st)) {
+        perror("fstat()");
+        goto error;
+    }
+    img_size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fs->fd, BLKGETSIZE64, &img_size)) {
+        perror("BLKGETSIZE64");
+        goto error;
+    }
+    /* Touching a page past the end of the file would raise SIGBUS */
+    if (img_size < fsck.img_len) {
+        fprintf(stderr,
+                "%s: image is %" PRIu64 " bytes, the superblock says %zu\n",
+                argv[optind], img_size, fsck.img_len);
+        goto error;
+    }
+    fsck.img = mmap(NULL, fsck.img_len, PROT_READ, MAP_SHARED, fs->fd, 0);
+    if (fsck.img == MAP_FAILED) {
+        perror("mmap()");
+        goto error;
+    }
+    madvise((void *) fsck.img, fsck.img_len, MADV_SEQUENTIAL);
+    madvise((void *) fsck.img,
+            (size_t) sfs_ifree_start(fs) << fs->blocksize_bits,
+            MADV_WILLNEED);
+
+    /* Rebuilt bitmaps: everything free, except the metadata blocks */
+    ilen = (size_t) fs->nr_ifree_blocks << fs->blocksize_bits;
+    blen = (size_t) fs->nr_bfree_blocks << fs->blocksize_bits;
+    fsck.ifree = malloc(ilen);
+    fsck.bfree = malloc(blen);
+    fsck.refs = calloc(fs->nr_inodes, sizeof(uint32_t));
+    if (!fsck.ifree || !fsck.bfree || !fsck.refs) {
+        fprintf(stderr, "Out of memory\n");
+        goto unmap;
+    }
+    memset(fsck.ifree, 0xff, ilen);
+    memset(fsck.bfree, 0xff, blen);
+    memset(fsck.bfree, 0, sfs_data_start(fs) / 8);
+    for (i = sfs_data_start(fs) & ~7ULL; i < sfs_data_start(fs); i++)
+        fsck.bfree[i / 8] &= ~(1 << (i % 8));
+
+    /* Pass 1: inodes, extents and directories, in parallel */
+    threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!threads) {
+        fprintf(stderr, "Out of memory\n");
+        goto unmap;
+    }
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&threads[i], NULL, fsck_worker, &fsck)) {
+            nr_threads = i;
+            break;
+        }
+    }
+    if (!nr_threads)
+        fsck_worker(&fsck);
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /* Pass 2: link counts, pass 3: bitmaps and free counters */
+    fsck_check_links(&fsck);
+    fsck_check_bitmaps(&fsck);
+
+    printf("%s: %" PRIu64 "/%u inodes, %" PRIu64 "/%" PRIu64 " blocks\n",
+           argv[optind], fs->nr_inodes - fs->nr_free_inodes, fs->nr_inodes,
+           fs->nr_blocks - fs->nr_free_blocks, fs->nr_blocks);
+
+    munmap((void *) fsck.img, fsck.img_len);
+    free(fsck.ifree);
+    free(fsck.bfree);
+    free(fsck.refs);
+    ret = sfs_close(fs);
+    if (ret) {
+        fprintf(stderr, "Cannot write the image: %s\n", strerror(-ret));
+        return FSCK_ERROR | FSCK_UNCORRECTED;
+    }
+
+    if (!fsck.errors)
+        return FSCK_OK;
+    printf("%lu errors found, %lu repairs made\n", fsck.errors, fsck.fixed);
+    return fsck.repair ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+
+unmap:
+    munmap((void *) fsck.img, fsck.img_len);
+    free(fsck.ifree);
+    free(fsck.bfree);
+    free(fsck.refs);
+error:
+    fs->writable = 0;
+    sfs_close(fs);
+    return FSCK_ERROR;
+}
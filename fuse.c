@@ -0,0 +1,1008 @@
+#define FUSE_USE_VERSION 34
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+/*
+ * simplefs-fuse: serve a simplefs image through FUSE, without the kernel
+ * module. Requests are handled by the multithreaded session loop of the
+ * low-level API. The image is accessed through libsimplefs, which is not
+ * thread-safe: requests which only read take the lock shared, so lookups and
+ * reads run in parallel, and the others take it exclusive. File data is
+ * spliced between the image and /dev/fuse when the kernel supports it.
+ *
+ * FUSE inode numbers start at FUSE_ROOT_ID, simplefs ones at SFS_ROOT_INO.
+ */
+#define SFS_FUSE_INO(ino) ((fuse_ino_t) (ino) + FUSE_ROOT_ID - SFS_ROOT_INO)
+#define SFS_INO(fino) ((uint32_t) ((fino) - FUSE_ROOT_ID + SFS_ROOT_INO))
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* Validity of attributes and entries in the kernel caches, in seconds */
+#define SFS_FUSE_TIMEOUT 1.0
+
+struct sfs_fuse {
+    struct sfs_fs fs;
+    const char *image;
+    pthread_rwlock_t lock;
+    char *zero; /* A block of zeroes, for holes */
+};
+
+static inline struct sfs_fuse *sfs_fuse(fuse_req_t req)
+{
+    return fuse_req_userdata(req);
+}
+
+static void sfs_fuse_now(struct sfs_inode *inode, int ctime, int mtime)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (ctime) {
+        inode->ctime = now.tv_sec;
+        inode->ctime_nsec = now.tv_nsec;
+    }
+    if (mtime) {
+        inode->mtime = now.tv_sec;
+        inode->mtime_nsec = now.tv_nsec;
+    }
+}
+
+static void sfs_fuse_stat(struct sfs_fs *fs,
+                          uint32_t ino,
+                          const struct sfs_inode *inode,
+                          struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = SFS_FUSE_INO(ino);
+    st->st_mode = inode->mode;
+    st->st_nlink = inode->nlink;
+    st->st_uid = inode->uid;
+    st->st_gid = inode->gid;
+    st->st_size = inode->size;
+    st->st_blksize = fs->block_size;
+    st->st_blocks = inode->blocks << (fs->blocksize_bits - 9);
+    st->st_atim.tv_sec = inode->atime;
+    st->st_atim.tv_nsec = inode->atime_nsec;
+    st->st_mtim.tv_sec = inode->mtime;
+    st->st_mtim.tv_nsec = inode->mtime_nsec;
+    st->st_ctim.tv_sec = inode->ctime;
+    st->st_ctim.tv_nsec = inode->ctime_nsec;
+}
+
+static void sfs_fuse_entry(struct sfs_fs *fs,
+                           uint32_t ino,
+                           const struct sfs_inode *inode,
+                           struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = SFS_FUSE_INO(ino);
+    e->attr_timeout = SFS_FUSE_TIMEOUT;
+    e->entry_timeout = SFS_FUSE_TIMEOUT;
+    sfs_fuse_stat(fs, ino, inode, &e->attr);
+}
+
+/* Read inode fino, which must be a directory if dir is set */
+static int sfs_fuse_read_inode(struct sfs_fs *fs,
+                               fuse_ino_t fino,
+                               struct sfs_inode *inode,
+                               int dir)
+{
+    int ret = sfs_read_inode(fs, SFS_INO(fino), inode);
+
+    if (ret)
+        return ret;
+    if (!inode->mode)
+        return -ENOENT;
+    if (dir && !S_ISDIR(inode->mode))
+        return -ENOTDIR;
+    return 0;
+}
+
+static void sfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+    /* Splice file data to and from /dev/fuse instead of copying it */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+}
+
+static void sfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct fuse_entry_param e;
+    struct sfs_inode dir, inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, parent, &dir, 1);
+    if (!ret)
+        ret = sfs_dir_lookup(&fuse->fs, &dir, name, &ino);
+    if (!ret)
+        ret = sfs_read_inode(&fuse->fs, ino, &inode);
+    pthread_rwlock_unlock(&fuse->lock);
+
+    /* Let the kernel cache negative entries too */
+    if (ret == -ENOENT) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = SFS_FUSE_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    sfs_fuse_entry(&fuse->fs, ino, &inode, &e);
+    fuse_reply_entry(req, &e);
+}
+
+static void sfs_fuse_getattr(fuse_req_t req,
+                             fuse_ino_t fino,
+                             struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_inode inode;
+    struct stat st;
+    int ret;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, fino, &inode, 0);
+    pthread_rwlock_unlock(&fuse->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    sfs_fuse_stat(&fuse->fs, SFS_INO(fino), &inode, &st);
+    fuse_reply_attr(req, &st, SFS_FUSE_TIMEOUT);
+}
+
+static void sfs_fuse_setattr(fuse_req_t req,
+                             fuse_ino_t fino,
+                             struct stat *attr,
+                             int to_set,
+                             struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_inode inode;
+    struct stat st;
+    int ret;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, fino, &inode, 0);
+    if (ret)
+        goto unlock;
+
+    /* Size changes of regular files free the blocks past the new end */
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (!S_ISREG(inode.mode)) {
+            ret = S_ISDIR(inode.mode) ? -EISDIR : -EINVAL;
+            goto unlock;
+        }
+        if ((uint64_t) attr->st_size != inode.size) {
+            ret = sfs_truncate(&fuse->fs, &inode, attr->st_size);
+            if (ret)
+                goto unlock;
+            sfs_fuse_now(&inode, 0, 1);
+        }
+    }
+    if (to_set & FUSE_SET_ATTR_MODE)
+        inode.mode = (inode.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    if (to_set & FUSE_SET_ATTR_UID)
+        inode.uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+        inode.gid = attr->st_gid;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        inode.atime = now.tv_sec;
+        inode.atime_nsec = now.tv_nsec;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+        inode.atime = attr->st_atim.tv_sec;
+        inode.atime_nsec = attr->st_atim.tv_nsec;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        sfs_fuse_now(&inode, 0, 1);
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        inode.mtime = attr->st_mtim.tv_sec;
+        inode.mtime_nsec = attr->st_mtim.tv_nsec;
+    }
+    sfs_fuse_now(&inode, 1, 0);
+
+    ret = sfs_write_inode(&fuse->fs, SFS_INO(fino), &inode);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    sfs_fuse_stat(&fuse->fs, SFS_INO(fino), &inode, &st);
+    fuse_reply_attr(req, &st, SFS_FUSE_TIMEOUT);
+}
+
+static void sfs_fuse_readlink(fuse_req_t req, fuse_ino_t fino)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    char target[SIMPLEFS_INLINE_DATA_LEN + 1];
+    struct sfs_inode inode;
+    int ret;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, fino, &inode, 0);
+    pthread_rwlock_unlock(&fuse->lock);
+    if (!ret && !S_ISLNK(inode.mode))
+        ret = -EINVAL;
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    memcpy(target, inode.data, fuse->fs.inline_len);
+    target[fuse->fs.inline_len] = '\0';
+    fuse_reply_readlink(req, target);
+}
+
+/*
+ * Create an inode of type mode named name in parent, a symlink to target if
+ * mode is S_IFLNK, and fill e. Inodes are placed as by the kernel module:
+ * directories created in the root at a random place, others next to their
+ * parent.
+ */
+static int sfs_fuse_mknod(fuse_req_t req,
+                          fuse_ino_t parent,
+                          const char *name,
+                          mode_t mode,
+                          const char *target,
+                          struct fuse_entry_param *e)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct sfs_inode dir, inode;
+    uint32_t ino, goal;
+    int ret;
+
+    if (strlen(name) > SIMPLEFS_FILENAME_LEN)
+        return -ENAMETOOLONG;
+    if (target && strlen(target) + 1 > fs->inline_len)
+        return -ENAMETOOLONG;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, parent, &dir, 1);
+    if (ret)
+        goto unlock;
+    ret = sfs_dir_lookup(fs, &dir, name, &ino);
+    if (ret != -ENOENT) {
+        ret = ret ? ret : -EEXIST;
+        goto unlock;
+    }
+
+    goal = SFS_INO(parent) - SFS_INO(parent) % fs->inodes_per_block;
+    if (S_ISDIR(mode) && SFS_INO(parent) == SFS_ROOT_INO)
+        goal = (uint32_t) rand() % fs->nr_istore_blocks * fs->inodes_per_block;
+    ret = sfs_new_inode(fs, goal, mode, &inode, &ino);
+    if (ret)
+        goto unlock;
+    inode.uid = ctx->uid;
+    inode.gid = ctx->gid;
+    sfs_fuse_now(&inode, 1, 1);
+    inode.atime = inode.mtime;
+    inode.atime_nsec = inode.mtime_nsec;
+    if (target) {
+        strcpy(inode.data, target);
+        inode.size = strlen(target);
+    }
+    ret = sfs_write_inode(fs, ino, &inode);
+    if (!ret)
+        ret = sfs_dir_add(fs, &dir, name, ino);
+    if (ret) {
+        sfs_release_inode(fs, ino, &inode);
+        goto unlock;
+    }
+
+    if (S_ISDIR(mode))
+        dir.nlink++;
+    sfs_fuse_now(&dir, 1, 1);
+    ret = sfs_write_inode(fs, SFS_INO(parent), &dir);
+    sfs_fuse_entry(fs, ino, &inode, e);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    return ret;
+}
+
+static void sfs_fuse_reply_entry(fuse_req_t req,
+                                 int ret,
+                                 struct fuse_entry_param *e)
+{
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_entry(req, e);
+}
+
+static void sfs_fuse_mknod_op(fuse_req_t req,
+                              fuse_ino_t parent,
+                              const char *name,
+                              mode_t mode,
+                              dev_t rdev)
+{
+    struct fuse_entry_param e;
+
+    /* Only directories, regular files and symlinks are supported */
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    sfs_fuse_reply_entry(req, sfs_fuse_mknod(req, parent, name, mode, NULL, &e),
+                         &e);
+}
+
+static void sfs_fuse_mkdir(fuse_req_t req,
+                           fuse_ino_t parent,
+                           const char *name,
+                           mode_t mode)
+{
+    struct fuse_entry_param e;
+
+    sfs_fuse_reply_entry(
+        req, sfs_fuse_mknod(req, parent, name, S_IFDIR | mode, NULL, &e), &e);
+}
+
+static void sfs_fuse_symlink(fuse_req_t req,
+                             const char *target,
+                             fuse_ino_t parent,
+                             const char *name)
+{
+    struct fuse_entry_param e;
+
+    sfs_fuse_reply_entry(
+        req, sfs_fuse_mknod(req, parent, name, S_IFLNK | 0777, target, &e),
+        &e);
+}
+
+static void sfs_fuse_create(fuse_req_t req,
+                            fuse_ino_t parent,
+                            const char *name,
+                            mode_t mode,
+                            struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int ret;
+
+    ret = sfs_fuse_mknod(req, parent, name, S_IFREG | mode, NULL, &e);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_create(req, &e, fi);
+}
+
+static void sfs_fuse_link(fuse_req_t req,
+                          fuse_ino_t fino,
+                          fuse_ino_t parent,
+                          const char *name)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct fuse_entry_param e;
+    struct sfs_inode dir, inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, parent, &dir, 1);
+    if (!ret)
+        ret = sfs_fuse_read_inode(fs, fino, &inode, 0);
+    if (ret)
+        goto unlock;
+    if (S_ISDIR(inode.mode)) {
+        ret = -EPERM;
+        goto unlock;
+    }
+    ret = sfs_dir_lookup(fs, &dir, name, &ino);
+    if (ret != -ENOENT) {
+        ret = ret ? ret : -EEXIST;
+        goto unlock;
+    }
+
+    ret = sfs_dir_add(fs, &dir, name, SFS_INO(fino));
+    if (ret)
+        goto unlock;
+    inode.nlink++;
+    sfs_fuse_now(&inode, 1, 0);
+    ret = sfs_write_inode(fs, SFS_INO(fino), &inode);
+    sfs_fuse_now(&dir, 1, 1);
+    if (!ret)
+        ret = sfs_write_inode(fs, SFS_INO(parent), &dir);
+    sfs_fuse_entry(fs, SFS_INO(fino), &inode, &e);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    sfs_fuse_reply_entry(req, ret, &e);
+}
+
+/* Stop at the first entry, to tell whether a directory is empty */
+static int sfs_fuse_dir_entry(const char *name, uint32_t ino, void *arg)
+{
+    return 1;
+}
+
+/*
+ * Remove name from parent, an empty directory if rmdir is set. The inode is
+ * freed with its last link, as the kernel module does.
+ */
+static int sfs_fuse_remove(fuse_req_t req,
+                           fuse_ino_t parent,
+                           const char *name,
+                           int rmdir)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct sfs_inode dir, inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, parent, &dir, 1);
+    if (!ret)
+        ret = sfs_dir_lookup(fs, &dir, name, &ino);
+    if (!ret)
+        ret = sfs_read_inode(fs, ino, &inode);
+    if (ret)
+        goto unlock;
+
+    if (rmdir) {
+        if (!S_ISDIR(inode.mode)) {
+            ret = -ENOTDIR;
+            goto unlock;
+        }
+        ret = sfs_dir_iterate(fs, &inode, sfs_fuse_dir_entry, NULL);
+        if (ret < 0)
+            goto unlock;
+        if (inode.nlink > 2 || ret) {
+            ret = -ENOTEMPTY;
+            goto unlock;
+        }
+    } else if (S_ISDIR(inode.mode)) {
+        ret = -EISDIR;
+        goto unlock;
+    }
+
+    ret = sfs_dir_remove(fs, &dir, name);
+    if (ret)
+        goto unlock;
+    if (rmdir)
+        dir.nlink--;
+    sfs_fuse_now(&dir, 1, 1);
+    ret = sfs_write_inode(fs, SFS_INO(parent), &dir);
+    if (ret)
+        goto unlock;
+
+    if (!rmdir && inode.nlink > 1) {
+        inode.nlink--;
+        sfs_fuse_now(&inode, 1, 0);
+        ret = sfs_write_inode(fs, ino, &inode);
+    } else {
+        ret = sfs_release_inode(fs, ino, &inode);
+    }
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    return ret;
+}
+
+static void sfs_fuse_unlink(fuse_req_t req,
+                            fuse_ino_t parent,
+                            const char *name)
+{
+    fuse_reply_err(req, -sfs_fuse_remove(req, parent, name, 0));
+}
+
+static void sfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -sfs_fuse_remove(req, parent, name, 1));
+}
+
+/*
+ * Move name from parent to newname in newparent. As with the kernel module,
+ * newname must not exist.
+ */
+static void sfs_fuse_rename(fuse_req_t req,
+                            fuse_ino_t parent,
+                            const char *name,
+                            fuse_ino_t newparent,
+                            const char *newname,
+                            unsigned int flags)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct sfs_inode dir, newdir, inode;
+    uint32_t ino, newino;
+    int ret;
+
+    if (flags & ~RENAME_NOREPLACE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (strlen(newname) > SIMPLEFS_FILENAME_LEN) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, parent, &dir, 1);
+    if (!ret)
+        ret = sfs_fuse_read_inode(fs, newparent, &newdir, 1);
+    if (!ret)
+        ret = sfs_dir_lookup(fs, &dir, name, &ino);
+    if (!ret)
+        ret = sfs_read_inode(fs, ino, &inode);
+    if (ret)
+        goto unlock;
+    ret = sfs_dir_lookup(fs, &newdir, newname, &newino);
+    if (ret != -ENOENT) {
+        ret = ret ? ret : -EEXIST;
+        goto unlock;
+    }
+
+    /* Add the new entry first, so that a failure loses nothing */
+    ret = sfs_dir_add(fs, &newdir, newname, ino);
+    if (ret)
+        goto unlock;
+    ret = sfs_dir_remove(fs, &dir, name);
+    if (ret)
+        goto unlock;
+
+    if (parent == newparent) {
+        sfs_fuse_now(&dir, 1, 1);
+        ret = sfs_write_inode(fs, SFS_INO(parent), &dir);
+        goto unlock;
+    }
+    if (S_ISDIR(inode.mode)) {
+        dir.nlink--;
+        newdir.nlink++;
+    }
+    sfs_fuse_now(&dir, 1, 1);
+    sfs_fuse_now(&newdir, 1, 1);
+    ret = sfs_write_inode(fs, SFS_INO(parent), &dir);
+    if (!ret)
+        ret = sfs_write_inode(fs, SFS_INO(newparent), &newdir);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static void sfs_fuse_open(fuse_req_t req,
+                          fuse_ino_t fino,
+                          struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_inode inode;
+    int ret;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, fino, &inode, 0);
+    pthread_rwlock_unlock(&fuse->lock);
+    if (!ret && S_ISDIR(inode.mode))
+        ret = -EISDIR;
+    if (!ret && (fi->flags & O_ACCMODE) != O_RDONLY && !fuse->fs.writable)
+        ret = -EROFS;
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    /* Nobody else changes the image: keep the page cache across opens */
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+/*
+ * Reply with the data of the file as a list of ranges of the image, which
+ * libfuse splices to /dev/fuse without copying them, and of zeroes for
+ * holes. The lock is held until the data is sent so that the blocks are not
+ * freed meanwhile.
+ */
+static void sfs_fuse_read(fuse_req_t req,
+                          fuse_ino_t fino,
+                          size_t size,
+                          off_t off,
+                          struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct fuse_bufvec *bufv = NULL;
+    struct fuse_buf *buf;
+    struct sfs_inode inode;
+    uint64_t pos = off, end, bno;
+    uint32_t nr, boff;
+    size_t n, max_bufs;
+    int ret;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, fino, &inode, 0);
+    if (ret)
+        goto unlock;
+    if (pos >= inode.size) {
+        fuse_reply_buf(req, NULL, 0);
+        goto unlock;
+    }
+    end = pos + size < inode.size ? pos + size : inode.size;
+
+    if (inode.flags & SIMPLEFS_INODE_INLINE) {
+        fuse_reply_buf(req, inode.data + pos, end - pos);
+        goto unlock;
+    }
+
+    /* At most one range per block, and one more if off is not aligned */
+    max_bufs = ((end - pos) >> fs->blocksize_bits) + 2;
+    bufv = calloc(1, sizeof(*bufv) + max_bufs * sizeof(struct fuse_buf));
+    if (!bufv) {
+        ret = -ENOMEM;
+        goto unlock;
+    }
+
+    while (pos < end) {
+        ret = sfs_file_map(fs, &inode, pos >> fs->blocksize_bits, 0, &bno, &nr);
+        if (ret)
+            goto unlock;
+        boff = pos & (fs->block_size - 1);
+        n = ((uint64_t) nr << fs->blocksize_bits) - boff;
+        if (n > end - pos)
+            n = end - pos;
+
+        buf = &bufv->buf[bufv->count++];
+        buf->size = n;
+        if (bno) {
+            buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            buf->fd = fs->fd;
+            buf->pos = (bno << fs->blocksize_bits) + boff;
+        } else {
+            buf->mem = fuse->zero;
+        }
+        pos += n;
+    }
+
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    free(bufv);
+    if (ret)
+        fuse_reply_err(req, -ret);
+}
+
+/*
+ * Write the data of in_buf, which may be in a pipe spliced from /dev/fuse,
+ * straight to the blocks of the file, allocated as by the kernel module.
+ */
+static void sfs_fuse_write_buf(fuse_req_t req,
+                               fuse_ino_t fino,
+                               struct fuse_bufvec *in_buf,
+                               off_t off,
+                               struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct fuse_bufvec out_buf;
+    struct sfs_inode inode;
+    size_t size = fuse_buf_size(in_buf), n;
+    uint64_t pos = off, end = off + size, bno;
+    uint32_t nr, boff;
+    ssize_t copied;
+    int ret;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(fs, fino, &inode, 0);
+    if (ret)
+        goto unlock;
+    if (end > SIMPLEFS_MAX_FILESIZE(fs->block_size)) {
+        ret = -EFBIG;
+        goto unlock;
+    }
+
+    /* Small files keep their data in the inode */
+    if (inode.flags & SIMPLEFS_INODE_INLINE && end <= fs->inline_len) {
+        out_buf = (struct fuse_bufvec) FUSE_BUFVEC_INIT(size);
+        out_buf.buf[0].mem = inode.data + pos;
+        copied = fuse_buf_copy(&out_buf, in_buf, 0);
+        if (copied < 0) {
+            ret = copied;
+            goto unlock;
+        }
+        pos += copied;
+    } else {
+        /* Blocks left past the end of file by the module may be stale */
+        ret = sfs_file_extend(fs, &inode, pos, end);
+        if (ret)
+            goto unlock;
+    }
+
+    while (pos < end) {
+        ret = sfs_file_map(fs, &inode, pos >> fs->blocksize_bits, 1, &bno, &nr);
+        if (ret)
+            break;
+        boff = pos & (fs->block_size - 1);
+        n = ((uint64_t) nr << fs->blocksize_bits) - boff;
+        if (n > end - pos)
+            n = end - pos;
+
+        out_buf = (struct fuse_bufvec) FUSE_BUFVEC_INIT(n);
+        out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        out_buf.buf[0].fd = fs->fd;
+        out_buf.buf[0].pos = (bno << fs->blocksize_bits) + boff;
+        copied = fuse_buf_copy(&out_buf, in_buf, 0);
+        if (copied <= 0) {
+            ret = copied ? copied : -EIO;
+            break;
+        }
+        pos += copied;
+    }
+
+    /* Report what was written, if anything, as write(2) would */
+    if (pos == (uint64_t) off)
+        goto unlock;
+    if (pos > inode.size)
+        inode.size = pos;
+    if (!(inode.flags & SIMPLEFS_INODE_INLINE))
+        inode.blocks = (inode.size >> fs->blocksize_bits) + 2;
+    sfs_fuse_now(&inode, 1, 1);
+    ret = sfs_write_inode(fs, SFS_INO(fino), &inode);
+
+unlock:
+    pthread_rwlock_unlock(&fuse->lock);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, pos - off);
+}
+
+struct sfs_fuse_readdir {
+    fuse_req_t req;
+    char *buf;
+    size_t size, len;
+    off_t off; /* Offset of the next entry */
+};
+
+/* Add an entry to the reply, stop when it is full */
+static int sfs_fuse_add_entry(const char *name, uint32_t ino, void *arg)
+{
+    struct sfs_fuse_readdir *rd = arg;
+    struct stat st = {.st_ino = SFS_FUSE_INO(ino)};
+    size_t len;
+
+    len = fuse_add_direntry(rd->req, rd->buf + rd->len, rd->size - rd->len,
+                            name, &st, rd->off + 1);
+    if (len > rd->size - rd->len)
+        return 1;
+    rd->len += len;
+    rd->off++;
+    return 0;
+}
+
+/*
+ * List a directory. Offsets are positions in the packed entries, after . and
+ * .., and the types are left unknown as by the kernel module: they would
+ * take reading each inode.
+ */
+static void sfs_fuse_readdir(fuse_req_t req,
+                             fuse_ino_t fino,
+                             size_t size,
+                             off_t off,
+                             struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fuse_readdir rd = {.req = req, .size = size, .off = off};
+    struct sfs_inode dir;
+    int ret;
+
+    rd.buf = malloc(size);
+    if (!rd.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* .. is only used by the kernel for its inode number, unknown here */
+    if (rd.off == 0)
+        sfs_fuse_add_entry(".", SFS_INO(fino), &rd);
+    if (rd.off == 1)
+        sfs_fuse_add_entry("..", SFS_INO(fino), &rd);
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    ret = sfs_fuse_read_inode(&fuse->fs, fino, &dir, 1);
+    if (!ret && rd.off >= 2)
+        ret = sfs_dir_iterate_from(&fuse->fs, &dir, rd.off - 2,
+                                   sfs_fuse_add_entry, &rd);
+    pthread_rwlock_unlock(&fuse->lock);
+
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, rd.buf, rd.len);
+    free(rd.buf);
+}
+
+static void sfs_fuse_statfs(fuse_req_t req, fuse_ino_t fino)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    struct sfs_fs *fs = &fuse->fs;
+    struct statvfs st = {0};
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    st.f_bsize = fs->block_size;
+    st.f_frsize = fs->block_size;
+    st.f_blocks = fs->nr_blocks;
+    st.f_bfree = fs->nr_free_blocks;
+    st.f_bavail = fs->nr_free_blocks;
+    st.f_files = fs->nr_inodes;
+    st.f_ffree = fs->nr_free_inodes;
+    st.f_favail = fs->nr_free_inodes;
+    st.f_namemax = SIMPLEFS_FILENAME_LEN;
+    pthread_rwlock_unlock(&fuse->lock);
+
+    fuse_reply_statfs(req, &st);
+}
+
+/* Data and inodes are written through, only the bitmaps are held back */
+static void sfs_fuse_fsync(fuse_req_t req,
+                           fuse_ino_t fino,
+                           int datasync,
+                           struct fuse_file_info *fi)
+{
+    struct sfs_fuse *fuse = sfs_fuse(req);
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    if (fuse->fs.writable)
+        ret = sfs_flush(&fuse->fs);
+    pthread_rwlock_unlock(&fuse->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static const struct fuse_lowlevel_ops sfs_fuse_ops = {
+    .init = sfs_fuse_init,
+    .lookup = sfs_fuse_lookup,
+    .getattr = sfs_fuse_getattr,
+    .setattr = sfs_fuse_setattr,
+    .readlink = sfs_fuse_readlink,
+    .mknod = sfs_fuse_mknod_op,
+    .mkdir = sfs_fuse_mkdir,
+    .unlink = sfs_fuse_unlink,
+    .rmdir = sfs_fuse_rmdir,
+    .symlink = sfs_fuse_symlink,
+    .rename = sfs_fuse_rename,
+    .link = sfs_fuse_link,
+    .open = sfs_fuse_open,
+    .read = sfs_fuse_read,
+    .write_buf = sfs_fuse_write_buf,
+    .fsync = sfs_fuse_fsync,
+    .readdir = sfs_fuse_readdir,
+    .fsyncdir = sfs_fuse_fsync,
+    .statfs = sfs_fuse_statfs,
+    .create = sfs_fuse_create,
+};
+
+/* The first argument which is not an option is the image */
+static int sfs_fuse_opt_proc(void *data,
+                             const char *arg,
+                             int key,
+                             struct fuse_args *outargs)
+{
+    struct sfs_fuse *fuse = data;
+
+    if (key == FUSE_OPT_KEY_NONOPT && !fuse->image) {
+        fuse->image = arg;
+        return 0;
+    }
+    return 1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] image mountpoint\n\n", prog);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts = {0};
+    struct fuse_loop_config config;
+    struct fuse_session *se;
+    struct sfs_fuse fuse = {0};
+    int ret = 1;
+
+    if (fuse_opt_parse(&args, &fuse, NULL, sfs_fuse_opt_proc) == -1)
+        return 1;
+    if (fuse_parse_cmdline(&args, &opts))
+        goto free_args;
+    if (opts.show_help) {
+        usage(argv[0]);
+        ret = 0;
+        goto free_args;
+    }
+    if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto free_args;
+    }
+    if (!fuse.image || !opts.mountpoint) {
+        usage(argv[0]);
+        goto free_args;
+    }
+
+    /* A read-only image is served read-only */
+    ret = sfs_open(&fuse.fs, fuse.image, 1);
+    if (ret == -EACCES || ret == -EROFS)
+        ret = sfs_open(&fuse.fs, fuse.image, 0);
+    if (!ret)
+        ret = sfs_load_bitmaps(&fuse.fs);
+    if (ret) {
+        fprintf(stderr, "%s: cannot open simplefs image: %s\n", fuse.image,
+                strerror(-ret));
+        ret = 1;
+        goto free_args;
+    }
+    ret = 1;
+    fuse.zero = calloc(1, fuse.fs.block_size);
+    if (!fuse.zero)
+        goto close_fs;
+    pthread_rwlock_init(&fuse.lock, NULL);
+    srand(time(NULL));
+
+    se = fuse_session_new(&args, &sfs_fuse_ops, sizeof(sfs_fuse_ops), &fuse);
+    if (!se)
+        goto close_fs;
+    if (fuse_set_signal_handlers(se))
+        goto destroy_session;
+    if (fuse_session_mount(se, opts.mountpoint))
+        goto remove_handlers;
+
+    fuse_daemonize(opts.foreground);
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    fuse_session_unmount(se);
+remove_handlers:
+    fuse_remove_signal_handlers(se);
+destroy_session:
+    fuse_session_destroy(se);
+close_fs:
+    free(fuse.zero);
+    if (sfs_close(&fuse.fs)) {
+        fprintf(stderr, "%s: cannot write back the bitmaps\n", fuse.image);
+        ret = 1;
+    }
+free_args:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? 1 : 0;
+}
@@ -1,9 +1,11 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/random.h>
 
 #include "bitmap.h"
 #include "simplefs.h"
@@ -17,12 +19,60 @@ static const struct inode_operations simplefs_inode_ops = {
     .rename = simplefs_rename,
     .link = simplefs_link,
     .symlink = simplefs_symlink,
+    .setattr = simplefs_setattr,
+    .fiemap = simplefs_fiemap,
 };
 
 static const struct inode_operations symlink_inode_ops = {
     .get_link = simplefs_get_link,
 };
 
+/* Return the timestamp made of on-disk low and high 32-bit words */
+static inline time64_t simplefs_decode_time(uint32_t lo, uint32_t hi)
+{
+    return (time64_t) ((uint64_t) le32_to_cpu(hi) << 32 | le32_to_cpu(lo));
+}
+
+/* Return the index block of an on-disk inode */
+static inline uint64_t simplefs_disk_ei_block(struct simplefs_sb_info *sbi,
+                                              struct simplefs_inode *cinode)
+{
+    uint64_t bno = le32_to_cpu(cinode->ei_block);
+
+    if (simplefs_has_feature(sbi, 64BIT))
+        bno |= (uint64_t) le32_to_cpu(cinode->ei_block_hi) << 32;
+    return bno;
+}
+
+/*
+ * Start reading the inode store block holding inode ino and the following
+ * ones, unless it is cached already. Inodes created together are close in the
+ * inode store, so a stat storm on a directory mostly hits blocks read here.
+ */
+static void simplefs_inode_readahead(struct super_block *sb, unsigned long ino)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t block = ino / sbi->inodes_per_block + 1;
+    uint32_t end = min_t(uint32_t, block + SIMPLEFS_INODE_RA_BLOCKS,
+                         sbi->nr_istore_blocks + 1);
+    struct buffer_head *bh;
+    struct blk_plug plug;
+
+    bh = sb_find_get_block(sb, block);
+    if (bh) {
+        bool uptodate = buffer_uptodate(bh);
+
+        brelse(bh);
+        if (uptodate)
+            return;
+    }
+
+    blk_start_plug(&plug);
+    for (; block < end; block++)
+        sb_breadahead(sb, block);
+    blk_finish_plug(&plug);
+}
+
 /**
  * @brief Get inode ino from disk. Used to get the inode of a given number, after the VFS inode is obtained by the VFS iget_locked:
  * If the inode already exists in the cache, return without modification.
@@ -41,10 +91,8 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
     struct buffer_head *bh = NULL;
 
     /* Number of block */
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
+    uint32_t inode_block = (ino / sbi->inodes_per_block) + 1;
 
-    /* Remainder */
-    uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
     int ret;
 
     /* Fail if ino is out of range */
@@ -75,13 +123,13 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
 
     ci = SIMPLEFS_INODE(inode);
     /* Read inode from disk and initialize */
+    simplefs_inode_readahead(sb, ino);
     bh = sb_bread(sb, inode_block);
     if (!bh) {
         ret = -EIO;
         goto failed;
     }
-    cinode = (struct simplefs_inode *) bh->b_data;
-    cinode += inode_shift;
+    cinode = simplefs_raw_inode(sbi, bh->b_data, ino);
 
     inode->i_ino = ino;
     inode->i_sb = sb;
@@ -97,20 +145,48 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
     inode->i_atime.tv_nsec = 0;
     inode->i_mtime.tv_sec = (time64_t) le32_to_cpu(cinode->i_mtime);
     inode->i_mtime.tv_nsec = 0;
+
+    /* 64-bit seconds and nanoseconds with LARGE_INODE */
+    if (simplefs_has_feature(sbi, LARGE_INODE)) {
+        struct simplefs_inode_extra *extra = simplefs_inode_extra(cinode);
+
+        inode->i_ctime.tv_sec = simplefs_decode_time(cinode->i_ctime,
+                                                     extra->i_ctime_hi);
+        inode->i_ctime.tv_nsec = le32_to_cpu(extra->i_ctime_nsec);
+        inode->i_atime.tv_sec = simplefs_decode_time(cinode->i_atime,
+                                                     extra->i_atime_hi);
+        inode->i_atime.tv_nsec = le32_to_cpu(extra->i_atime_nsec);
+        inode->i_mtime.tv_sec = simplefs_decode_time(cinode->i_mtime,
+                                                     extra->i_mtime_hi);
+        inode->i_mtime.tv_nsec = le32_to_cpu(extra->i_mtime_nsec);
+    }
     inode->i_blocks = le32_to_cpu(cinode->i_blocks);
 
     /* Directly set an inode's link count */
     set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
+    ci->i_flags = le32_to_cpu(cinode->i_flags);
+
+    /* Symlink target or inline file data */
+    memcpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
+
+    /* High words, stored at the end of i_data with the 64BIT feature */
+    if (simplefs_has_feature(sbi, 64BIT)) {
+        inode->i_size |= (loff_t) le32_to_cpu(cinode->i_size_hi) << 32;
+        memset(ci->i_data + SIMPLEFS_INLINE_DATA_LEN_64, 0,
+               sizeof(ci->i_data) - SIMPLEFS_INLINE_DATA_LEN_64);
+    }
+
     if (S_ISDIR(inode->i_mode)) {
-        ci->ei_block = le32_to_cpu(cinode->ei_block);
+        ci->ei_block = simplefs_disk_ei_block(sbi, cinode);
         inode->i_fop = &simplefs_dir_ops;
     } else if (S_ISREG(inode->i_mode)) {
-        ci->ei_block = le32_to_cpu(cinode->ei_block);
+        ci->ei_block = simplefs_disk_ei_block(sbi, cinode);
+        ci->i_valid_blocks = (inode->i_size + sb->s_blocksize - 1) >>
+                             sb->s_blocksize_bits;
         inode->i_fop = &simplefs_file_ops;
         inode->i_mapping->a_ops = &simplefs_aops;
     } else if (S_ISLNK(inode->i_mode)) {
-        strncpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
         inode->i_link = ci->i_data;
         inode->i_op = &symlink_inode_ops;
     }
@@ -138,6 +214,7 @@ static struct dentry *simplefs_lookup(struct inode *dir,
 {
     /* Superblock of directory */
     struct super_block *sb = dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
 
     /* Dir on VFS */
     struct simplefs_inode_info *ci_dir = SIMPLEFS_INODE(dir);
@@ -151,11 +228,22 @@ static struct dentry *simplefs_lookup(struct inode *dir,
     /* Contain inode and file name */
     struct simplefs_file *f = NULL;
     int ei, bi, fi;
+    uint32_t ino;
 
     /* Check filename length */
     if (dentry->d_name.len > SIMPLEFS_FILENAME_LEN)
         return ERR_PTR(-ENAMETOOLONG);
 
+    /* Use the name index of dir, built on the first lookup, if enabled */
+    if (simplefs_test_opt(sbi, DIRCACHE) &&
+        (simplefs_dindex_lookup(dir, &dentry->d_name, &ino) ||
+         (!simplefs_dindex_build(dir) &&
+          simplefs_dindex_lookup(dir, &dentry->d_name, &ino)))) {
+        if (ino)
+            inode = simplefs_iget(sb, ino);
+        goto search_end;
+    }
+
     /* Read the directory block on disk */
     bh = sb_bread(sb, ci_dir->ei_block); /* Block with list of extents for this file */
     if (!bh)
@@ -165,22 +253,24 @@ static struct dentry *simplefs_lookup(struct inode *dir,
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
     /* Search for the file in directory */
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
-        if (!eblock->extents[ei].ee_start)
+    for (ei = 0; ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&eblock->extents[ei]))
             break;
 
         /* Iterate blocks in extent */
         for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
             /* Read each block in extent */
-            bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
-            if (!bh2)
+            bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
+            if (!bh2) {
+                brelse(bh);
                 return ERR_PTR(-EIO);
+            }
             
             /* Get this information */
             dblock = (struct simplefs_dir_block *) bh2->b_data;
 
             /* Search file in ei_block */
-            for (fi = 0; fi < SIMPLEFS_FILES_PER_BLOCK; fi++) {
+            for (fi = 0; fi < sbi->files_per_block; fi++) {
                 f = &dblock->files[fi];
                 if (!f->inode) {
                     brelse(bh2);
@@ -203,18 +293,189 @@ static struct dentry *simplefs_lookup(struct inode *dir,
 search_end:
     brelse(bh);
 
-    /* Update directory access time */
-    dir->i_atime = current_time(dir);
-
-    /* Put the inode on the super block's dirty list. */
-    mark_inode_dirty(dir);
+    if (IS_ERR(inode))
+        return ERR_CAST(inode);
 
-    /* Fill the dentry with the inode. This adds the entry to the hash queues and initializes @inode. */
+    /*
+     * Fill the dentry with the inode. This adds the entry to the hash queues
+     * and initializes @inode. A name which does not exist gets a negative
+     * dentry, so the next lookups of it do not come here. dir is not
+     * modified: its access time is updated by readdir, through
+     * file_accessed(), which honours noatime and relatime.
+     */
     d_add(dentry, inode);
 
     return NULL;
 }
 
+/*
+ * Clear `len` blocks starting at bno through the buffer cache, without reading
+ * them. Freed blocks are not scrubbed, so a new index block or directory
+ * extent must not expose stale entries.
+ */
+void simplefs_zero_blocks(struct super_block *sb, uint64_t bno, uint32_t len)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        bh = sb_getblk(sb, bno + i);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+}
+
+/*
+ * LAZY_ITABLE feature: zero the inode store region holding inode ino if mkfs
+ * left it uninitialized, before the inode is read or written. The zeroes are
+ * written to the device before the region is marked initialized in block 0,
+ * so that a crash never exposes stale inode store blocks. Cached copies of
+ * the region, brought in by inode readahead, are cleared as well.
+ * Return 0 on success, a negative error code otherwise.
+ */
+int simplefs_itable_init(struct super_block *sb, uint32_t ino)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t region = (ino / sbi->inodes_per_block) >> sbi->itable_region_bits;
+    uint32_t start, len, i;
+    struct buffer_head *bh;
+    int ret = 0;
+
+    /* Regions are only ever initialized, no need to lock to see it */
+    if (!simplefs_has_feature(sbi, LAZY_ITABLE) ||
+        !test_bit(region, sbi->itable_uninit))
+        return 0;
+
+    mutex_lock(&sbi->itable_lock);
+    if (!test_bit(region, sbi->itable_uninit))
+        goto unlock;
+
+    start = region << sbi->itable_region_bits;
+    len = min_t(uint32_t, 1U << sbi->itable_region_bits,
+                sbi->nr_istore_blocks - start);
+    ret = sb_issue_zeroout(sb, start + 1, len, GFP_NOFS);
+    if (ret)
+        goto unlock;
+
+    for (i = 0; i < len; i++) {
+        bh = sb_find_get_block(sb, start + 1 + i);
+        if (!bh)
+            continue;
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        clear_buffer_dirty(bh);
+        unlock_buffer(bh);
+        brelse(bh);
+    }
+
+    bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+    if (!bh) {
+        ret = -EIO;
+        goto unlock;
+    }
+    clear_bit(region, sbi->itable_uninit);
+    lock_buffer(bh);
+    memcpy(bh->b_data + SIMPLEFS_ITABLE_MAP_OFFSET, sbi->itable_uninit,
+           DIV_ROUND_UP(sbi->nr_itable_regions, 8));
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+unlock:
+    mutex_unlock(&sbi->itable_lock);
+
+    return ret;
+}
+
+/*
+ * Change the attributes of an inode. Size changes of regular files go through
+ * simplefs_truncate() so that blocks past the new end of file are freed.
+ */
+#if USER_NS_REQUIRED()
+static int simplefs_setattr(struct user_namespace *ns,
+                            struct dentry *dentry,
+                            struct iattr *iattr)
+#else
+static int simplefs_setattr(struct dentry *dentry, struct iattr *iattr)
+#endif
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    /* Check permissions and size limits before changing anything */
+#if USER_NS_REQUIRED()
+    ret = setattr_prepare(ns, dentry, iattr);
+#else
+    ret = setattr_prepare(dentry, iattr);
+#endif
+    if (ret)
+        return ret;
+
+    if ((iattr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+        iattr->ia_size != i_size_read(inode)) {
+        ret = simplefs_truncate(inode, iattr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+#if USER_NS_REQUIRED()
+    setattr_copy(ns, inode, iattr);
+#else
+    setattr_copy(inode, iattr);
+#endif
+    mark_inode_dirty(inode);
+
+    return 0;
+}
+
+/*
+ * Return the inode number from which to look for a free inode for a new
+ * inode of type mode in dir, in the spirit of the ext2 Orlov allocator:
+ * directories created in the root start at a random inode block, which
+ * spreads them over the inode store and leaves room for their content; other
+ * inodes start at the inode block of their parent, so the inodes of one
+ * directory share inode store blocks and listing it reads few of them.
+ *
+ * With LAZY_ITABLE, a random block in a region not zeroed yet would cost the
+ * zeroing of the whole region for one directory. The goal moves to a random
+ * block of the next zeroed region instead; the other regions are zeroed as
+ * the allocation reaches them, once the zeroed ones are full.
+ */
+static uint32_t simplefs_inode_goal(struct inode *dir, mode_t mode)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(dir->i_sb);
+    uint32_t ipb = sbi->inodes_per_block;
+    uint32_t block, region, start, len;
+
+    if (!S_ISDIR(mode) || dir != d_inode(dir->i_sb->s_root))
+        return dir->i_ino - dir->i_ino % ipb;
+
+    block = get_random_u32() % sbi->nr_istore_blocks;
+    if (!simplefs_has_feature(sbi, LAZY_ITABLE))
+        return block * ipb;
+
+    region = block >> sbi->itable_region_bits;
+    if (!test_bit(region, sbi->itable_uninit))
+        return block * ipb;
+    region = find_next_zero_bit(sbi->itable_uninit, sbi->nr_itable_regions,
+                                region);
+    if (region >= sbi->nr_itable_regions)
+        region = find_first_zero_bit(sbi->itable_uninit,
+                                     sbi->nr_itable_regions);
+    if (region >= sbi->nr_itable_regions)
+        return block * ipb;
+
+    start = region << sbi->itable_region_bits;
+    len = min_t(uint32_t, 1U << sbi->itable_region_bits,
+                sbi->nr_istore_blocks - start);
+    return (start + block % len) * ipb;
+}
+
 /* Create a new inode in dir */
 static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
 {
@@ -222,7 +483,8 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     struct simplefs_inode_info *ci;
     struct super_block *sb;
     struct simplefs_sb_info *sbi;
-    uint32_t ino, bno;
+    uint32_t ino;
+    uint64_t bno = 0;
     int ret;
 
     /* Check mode before doing anything to avoid undoing everything */
@@ -242,9 +504,14 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
         return ERR_PTR(-ENOSPC);
 
     /* Get a new free inode */
-    ino = get_free_inode(sbi);
+    ino = get_free_inode(sbi, simplefs_inode_goal(dir, mode), &ret);
     if (!ino)
-        return ERR_PTR(-ENOSPC);
+        return ERR_PTR(ret);
+
+    /* Zero its part of the inode store first if mkfs left it out */
+    ret = simplefs_itable_init(sb, ino);
+    if (ret)
+        goto put_ino;
 
     /* Get inode ino from disk */
     inode = simplefs_iget(sb, ino);
@@ -253,6 +520,10 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
         goto put_ino;
     }
 
+    ci = SIMPLEFS_INODE(inode);
+    ci->i_flags = 0;
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+
     if (S_ISLNK(mode)) {
 #if USER_NS_REQUIRED()
         inode_init_owner(&init_user_ns, inode, dir, mode);
@@ -266,13 +537,14 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
         return inode;
     }
 
-    ci = SIMPLEFS_INODE(inode);
-
-    /* Get a free block for this new inode's index */
-    bno = get_free_blocks(sbi, 1);
-    if (!bno) {
-        ret = -ENOSPC;
-        goto put_inode;
+    /*
+     * Get a free block for this new inode's index. Regular files start with
+     * their data inline, the index block is allocated when they outgrow it.
+     */
+    if (!S_ISREG(mode)) {
+        bno = get_free_blocks(sbi, 1, &ret);
+        if (!bno)
+            goto put_inode;
     }
 
     /* Initialize inode */
@@ -286,7 +558,7 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     /* Directory */
     if (S_ISDIR(mode)) {
         ci->ei_block = bno;
-        inode->i_size = SIMPLEFS_BLOCK_SIZE;
+        inode->i_size = sb->s_blocksize;
         inode->i_fop = &simplefs_dir_ops;
 
         /* Directly set an inode's link count, . and .. */
@@ -294,7 +566,9 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     
     /* File type */
     } else if (S_ISREG(mode)) {
-        ci->ei_block = bno;
+        ci->ei_block = 0;
+        ci->i_flags = SIMPLEFS_INODE_INLINE;
+        inode->i_blocks = 0;
         inode->i_size = 0;
         inode->i_fop = &simplefs_file_ops;
         inode->i_mapping->a_ops = &simplefs_aops;
@@ -336,13 +610,14 @@ static int simplefs_create(struct inode *dir,
 #endif
 {
     struct super_block *sb;
+    struct simplefs_sb_info *sbi;
     struct inode *inode;
     struct simplefs_inode_info *ci_dir;
     struct simplefs_file_ei_block *eblock;
     struct simplefs_dir_block *dblock;
-    char *fblock;
     struct buffer_head *bh, *bh2;
-    int ret = 0, alloc = false, bno = 0;
+    int ret = 0, alloc = false;
+    uint64_t bno = 0;
     int ei = 0, bi = 0, fi = 0;
 
     /* Check filename length */
@@ -354,6 +629,7 @@ static int simplefs_create(struct inode *dir,
 
     /* Get superblock of dir */
     sb = dir->i_sb;
+    sbi = SIMPLEFS_SB(sb);
 
     /* Read parent directory index from store device (map) into memory */
     bh = sb_bread(sb, ci_dir->ei_block);
@@ -364,7 +640,7 @@ static int simplefs_create(struct inode *dir,
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
     /* Check if parent directory is full */
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == sbi->max_subfiles) {
         ret = -EMLINK;
         goto end;
     }
@@ -377,32 +653,24 @@ static int simplefs_create(struct inode *dir,
     }
 
     /*
-     * Scrub ei_block for new file/directory to avoid previous data
-     * messing with new file/directory.
+     * Scrub ei_block for new directory to avoid previous data messing with
+     * new directory. New files have their data inline and no ei_block yet.
      */
-    bh2 = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    if (!bh2) {
-        ret = -EIO;
-        goto iput;
-    }
-    fblock = (char *) bh2->b_data;
-    memset(fblock, 0, SIMPLEFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh2);
-    brelse(bh2);
+    if (SIMPLEFS_INODE(inode)->ei_block)
+        simplefs_zero_blocks(sb, SIMPLEFS_INODE(inode)->ei_block, 1);
 
     /* Find first free slot in parent index and register new inode */
-    ei = eblock->nr_files / SIMPLEFS_FILES_PER_EXT; // Number of extent
-    bi = eblock->nr_files % SIMPLEFS_FILES_PER_EXT
-         / SIMPLEFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % SIMPLEFS_FILES_PER_BLOCK; // Remainder
-
-    if (!eblock->extents[ei].ee_start) {
-        bno = get_free_blocks(SIMPLEFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
+    ei = eblock->nr_files / sbi->files_per_ext; // Number of extent
+    bi = eblock->nr_files % sbi->files_per_ext
+         / sbi->files_per_block;
+    fi = eblock->nr_files % sbi->files_per_block; // Remainder
+
+    if (!simplefs_ext_start(&eblock->extents[ei])) {
+        bno = get_free_blocks(SIMPLEFS_SB(sb), 8, &ret);
+        if (!bno)
             goto iput;
-        }
-        eblock->extents[ei].ee_start = bno;
+        simplefs_zero_blocks(sb, bno, 8);
+        simplefs_ext_set_start(&eblock->extents[ei], bno);
         eblock->extents[ei].ee_len = 8;
         eblock->extents[ei].ee_block =
             ei ? eblock->extents[ei - 1].ee_block +
@@ -410,7 +678,7 @@ static int simplefs_create(struct inode *dir,
                : 0;
         alloc = true;
     }
-    bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+    bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
     if (!bh2) {
         ret = -EIO;
         goto put_block;
@@ -420,6 +688,7 @@ static int simplefs_create(struct inode *dir,
     dblock->files[fi].inode = inode->i_ino;
     strncpy(dblock->files[fi].filename, dentry->d_name.name,
             SIMPLEFS_FILENAME_LEN);
+    simplefs_dindex_add(dir, &dentry->d_name, inode->i_ino);
 
     /* Done create file, increse number of files in eblock or directory files */
     eblock->nr_files++;
@@ -442,13 +711,14 @@ static int simplefs_create(struct inode *dir,
     return 0;
 
 put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[ei].ee_start,
+    if (alloc && simplefs_ext_start(&eblock->extents[ei])) {
+        put_blocks(SIMPLEFS_SB(sb), simplefs_ext_start(&eblock->extents[ei]),
                    eblock->extents[ei].ee_len);
         memset(&eblock->extents[ei], 0, sizeof(struct simplefs_extent));
     }
 iput:
-    put_blocks(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode)->ei_block, 1);
+    if (SIMPLEFS_INODE(inode)->ei_block)
+        put_blocks(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode)->ei_block, 1);
     put_inode(SIMPLEFS_SB(sb), inode->i_ino);
     iput(inode);
 end:
@@ -460,6 +730,7 @@ end:
 static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
 {
     struct super_block *sb = dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct inode *inode = d_inode(dentry);
     struct buffer_head *bh = NULL, *bh2 = NULL, *bh_prev = NULL;
     struct simplefs_file_ei_block *eblock = NULL;
@@ -474,12 +745,12 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
 
     /* Get this info */
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
-        if (!eblock->extents[ei].ee_start)
+    for (ei = 0; ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&eblock->extents[ei]))
             break;
 
         for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+            bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
             if (!bh2) {
                 ret = -EIO;
                 goto release_bh;
@@ -490,13 +761,13 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
 
             if (found) {
                 /* Similar to strcpy */
-                memmove(dblock_prev->files + SIMPLEFS_FILES_PER_BLOCK - 1,
+                memmove(dblock_prev->files + sbi->files_per_block - 1,
                         dblock->files, sizeof(struct simplefs_file));
                 brelse(bh_prev);
 
                 memmove(dblock->files, dblock->files + 1,
-                        (SIMPLEFS_FILES_PER_BLOCK - 1) * sizeof(struct simplefs_file));
-                memset(dblock->files + SIMPLEFS_FILES_PER_BLOCK - 1,
+                        (sbi->files_per_block - 1) * sizeof(struct simplefs_file));
+                memset(dblock->files + sbi->files_per_block - 1,
                        0, sizeof(struct simplefs_file));
                 mark_buffer_dirty(bh2);
 
@@ -506,14 +777,16 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
             }
 
             /* Remove file from parent directory */
-            for (fi = 0; fi < SIMPLEFS_FILES_PER_BLOCK; fi++) {
-                if (dblock->files[fi].inode == inode->i_ino) {
+            for (fi = 0; fi < sbi->files_per_block; fi++) {
+                if (dblock->files[fi].inode == inode->i_ino &&
+                    !strncmp(dblock->files[fi].filename, dentry->d_name.name,
+                             SIMPLEFS_FILENAME_LEN)) {
                     found = true;
-                    if (fi != SIMPLEFS_FILES_PER_BLOCK - 1) {
+                    if (fi != sbi->files_per_block - 1) {
                         memmove(dblock->files + fi, dblock->files + fi + 1,
-                                (SIMPLEFS_FILES_PER_BLOCK - fi - 1) * sizeof(struct simplefs_file));
+                                (sbi->files_per_block - fi - 1) * sizeof(struct simplefs_file));
                     }
-                    memset(dblock->files + SIMPLEFS_FILES_PER_BLOCK - 1,
+                    memset(dblock->files + sbi->files_per_block - 1,
                            0, sizeof(struct simplefs_file));
                     mark_buffer_dirty(bh2);
                     bh_prev = bh2;
@@ -531,6 +804,7 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
         }
         eblock->nr_files--;
         mark_buffer_dirty(bh);
+        simplefs_dindex_del(dir, &dentry->d_name);
     }
 release_bh:
     brelse(bh);
@@ -540,8 +814,7 @@ release_bh:
  * Remove a link for a file including the reference in the parent directory.
  * If link count is 0, destroy file in this way:
  *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
+ *   - free blocks containing data and the file index block
  *   - cleanup inode
  */
 static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
@@ -549,13 +822,13 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
     struct super_block *sb = dir->i_sb;
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh = NULL, *bh2 = NULL;
+    struct buffer_head *bh = NULL;
     struct simplefs_file_ei_block *file_block = NULL;
-    int ei = 0, bi = 0;
+    int ei = 0;
     int ret = 0;
 
     uint32_t ino = inode->i_ino;
-    uint32_t bno = 0;
+    uint64_t bno = 0;
 
     ret = simplefs_remove_from_dir(dir, dentry);
     if (ret != 0)
@@ -578,49 +851,34 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
     }
 
     /*
-     * Cleanup pointed blocks if unlinking a file. If we fail to read the
-     * index block, cleanup inode anyway and lose this file's blocks
-     * forever. If we fail to scrub a data block, don't fail (too late
-     * anyway), just put the block and continue.
+     * Free the blocks pointed by the index block. They are not scrubbed:
+     * directory extents are zeroed when allocated, and file blocks before
+     * they can be read, see simplefs_file_get_block(). With -o discard,
+     * put_blocks() discards them before they can be allocated again. If we
+     * fail to read the index block, cleanup inode anyway and lose this
+     * file's blocks forever. Files with inline data have no block at all.
      */
     bno = SIMPLEFS_INODE(inode)->ei_block;
+    if (!bno)
+        goto clean_inode;
     bh = sb_bread(sb, bno);
     if (!bh)
         goto clean_inode;
     file_block = (struct simplefs_file_ei_block *) bh->b_data;
-    if (S_ISDIR(inode->i_mode))
-        goto scrub;
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
-        char *block;
-
-        if (!file_block->extents[ei].ee_start)
+    for (ei = 0; ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&file_block->extents[ei]))
             break;
 
-        put_blocks(sbi, file_block->extents[ei].ee_start,
+        put_blocks(sbi, simplefs_ext_start(&file_block->extents[ei]),
                    file_block->extents[ei].ee_len);
-
-        /* Scrub the extent */
-        for (bi = 0; bi < file_block->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, file_block->extents[ei].ee_start + bi);
-            if (!bh2)
-                continue;
-            block = (char *) bh2->b_data;
-            memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-            mark_buffer_dirty(bh2);
-            brelse(bh2);
-        }
     }
-
-scrub:
-    /* Scrub index block */
-    memset(file_block, 0, SIMPLEFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh);
     brelse(bh);
 
 clean_inode:
     /* Cleanup inode and mark dirty */
     inode->i_blocks = 0;
     SIMPLEFS_INODE(inode)->ei_block = 0;
+    SIMPLEFS_INODE(inode)->i_flags = 0;
     inode->i_size = 0;
     i_uid_write(inode, 0);
     i_gid_write(inode, 0);
@@ -630,7 +888,8 @@ clean_inode:
     mark_inode_dirty(inode);
 
     /* Free inode and index block from bitmap */
-    put_blocks(sbi, bno, 1);
+    if (bno)
+        put_blocks(sbi, bno, 1);
     put_inode(sbi, ino);
 
     return ret;
@@ -652,13 +911,15 @@ static int simplefs_rename(struct inode *old_dir,
 #endif
 {
     struct super_block *sb = old_dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct simplefs_inode_info *ci_new = SIMPLEFS_INODE(new_dir);
     struct inode *src = d_inode(old_dentry);
     struct buffer_head *bh_new = NULL, *bh2 = NULL;
     struct simplefs_file_ei_block *eblock_new = NULL;
     struct simplefs_dir_block *dblock = NULL;
     int new_pos = -1, ret = 0;
-    int ei = 0 , bi = 0, fi = 0, bno = 0;
+    int ei = 0 , bi = 0, fi = 0;
+    uint64_t bno = 0;
 
     /* fail with these unsupported flags */
     if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
@@ -674,19 +935,20 @@ static int simplefs_rename(struct inode *old_dir,
         return -EIO;
 
     eblock_new = (struct simplefs_file_ei_block *) bh_new->b_data;
-    for (ei = 0; new_pos < 0 && ei < SIMPLEFS_MAX_EXTENTS; ei++) {
-        if (!eblock_new->extents[ei].ee_start)
+    for (ei = 0; new_pos < 0 && ei < sbi->max_extents; ei++) {
+        if (!simplefs_ext_start(&eblock_new->extents[ei]))
             break;
 
         for (bi = 0; new_pos < 0 && bi < eblock_new->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblock_new->extents[ei].ee_start + bi);
+            bh2 = sb_bread(sb,
+                           simplefs_ext_start(&eblock_new->extents[ei]) + bi);
             if (!bh2) {
                 ret = -EIO;
                 goto release_new;
             }
 
             dblock = (struct simplefs_dir_block *) bh2->b_data;
-            for (fi = 0; fi < SIMPLEFS_FILES_PER_BLOCK; fi++) {
+            for (fi = 0; fi < sbi->files_per_block; fi++) {
                 if (new_dir == old_dir) {
                     if (!strncmp(dblock->files[fi].filename, old_dentry->d_name.name,
                                 SIMPLEFS_FILENAME_LEN)) {
@@ -694,6 +956,9 @@ static int simplefs_rename(struct inode *old_dir,
                                 SIMPLEFS_FILENAME_LEN);
                         mark_buffer_dirty(bh2);
                         brelse(bh2);
+                        simplefs_dindex_del(old_dir, &old_dentry->d_name);
+                        simplefs_dindex_add(new_dir, &new_dentry->d_name,
+                                            src->i_ino);
                         goto release_new;
                     }
                 }
@@ -714,7 +979,7 @@ static int simplefs_rename(struct inode *old_dir,
     }
 
     /* If new directory is full, fail */
-    if (new_pos < 0 && eblock_new->nr_files == SIMPLEFS_FILES_PER_EXT) {
+    if (new_pos < 0 && eblock_new->nr_files == sbi->files_per_ext) {
         ret = -EMLINK;
         goto release_new;
     }
@@ -722,18 +987,17 @@ static int simplefs_rename(struct inode *old_dir,
     /* Insert in new parent directory */
     /* Get new freeblocks for extent if needed*/
     if (new_pos < 0) {
-        bno = get_free_blocks(SIMPLEFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
+        bno = get_free_blocks(SIMPLEFS_SB(sb), 8, &ret);
+        if (!bno)
             goto release_new;
-        }
-        eblock_new->extents[ei].ee_start = bno;
+        simplefs_zero_blocks(sb, bno, 8);
+        simplefs_ext_set_start(&eblock_new->extents[ei], bno);
         eblock_new->extents[ei].ee_len = 8;
         eblock_new->extents[ei].ee_block =
             ei ? eblock_new->extents[ei - 1].ee_block +
                      eblock_new->extents[ei - 1].ee_len
                : 0;
-        bh2 = sb_bread(sb, eblock_new->extents[ei].ee_start + 0);
+        bh2 = sb_bread(sb, simplefs_ext_start(&eblock_new->extents[ei]) + 0);
         if (!bh2) {
             ret = -EIO;
             goto put_block;
@@ -747,6 +1011,7 @@ static int simplefs_rename(struct inode *old_dir,
             SIMPLEFS_FILENAME_LEN);
     mark_buffer_dirty(bh2);
     brelse(bh2);
+    simplefs_dindex_add(new_dir, &new_dentry->d_name, src->i_ino);
 
     /* Update new parent inode metadata */
     new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
@@ -770,8 +1035,9 @@ static int simplefs_rename(struct inode *old_dir,
     return ret;
 
 put_block:
-    if (eblock_new->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock_new->extents[ei].ee_start,
+    if (simplefs_ext_start(&eblock_new->extents[ei])) {
+        put_blocks(SIMPLEFS_SB(sb),
+                   simplefs_ext_start(&eblock_new->extents[ei]),
                    eblock_new->extents[ei].ee_len);
         memset(&eblock_new->extents[ei], 0, sizeof(struct simplefs_extent));
     }
@@ -827,11 +1093,13 @@ static int simplefs_link(struct dentry *old_dentry,
 {
     struct inode *inode = d_inode(old_dentry);
     struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct simplefs_inode_info *ci_dir = SIMPLEFS_INODE(dir);
     struct simplefs_file_ei_block *eblock = NULL;
     struct simplefs_dir_block *dblock;
     struct buffer_head *bh = NULL, *bh2 = NULL;
-    int ret = 0, alloc = false, bno = 0;
+    int ret = 0, alloc = false;
+    uint64_t bno = 0;
     int ei = 0, bi = 0, fi = 0;
 
     bh = sb_bread(sb, ci_dir->ei_block);
@@ -839,24 +1107,23 @@ static int simplefs_link(struct dentry *old_dentry,
         return -EIO;
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == sbi->max_subfiles) {
         ret = -EMLINK;
         printk(KERN_INFO "directory is full");
         goto end;
     }
 
-    ei = eblock->nr_files / SIMPLEFS_FILES_PER_EXT;
-    bi = eblock->nr_files % SIMPLEFS_FILES_PER_EXT
-         / SIMPLEFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % SIMPLEFS_FILES_PER_BLOCK;
+    ei = eblock->nr_files / sbi->files_per_ext;
+    bi = eblock->nr_files % sbi->files_per_ext
+         / sbi->files_per_block;
+    fi = eblock->nr_files % sbi->files_per_block;
 
-    if (eblock->extents[ei].ee_start == 0) {
-        bno = get_free_blocks(SIMPLEFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
+    if (!simplefs_ext_start(&eblock->extents[ei])) {
+        bno = get_free_blocks(SIMPLEFS_SB(sb), 8, &ret);
+        if (!bno)
             goto end;
-        }
-        eblock->extents[ei].ee_start = bno;
+        simplefs_zero_blocks(sb, bno, 8);
+        simplefs_ext_set_start(&eblock->extents[ei], bno);
         eblock->extents[ei].ee_len = 8;
         eblock->extents[ei].ee_block =
             ei ? eblock->extents[ei - 1].ee_block +
@@ -864,7 +1131,7 @@ static int simplefs_link(struct dentry *old_dentry,
                : 0;
         alloc = true;
     }
-    bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+    bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
     if (!bh2) {
         ret = -EIO;
         goto put_block;
@@ -874,6 +1141,7 @@ static int simplefs_link(struct dentry *old_dentry,
     dblock->files[fi].inode = inode->i_ino;
     strncpy(dblock->files[fi].filename, dentry->d_name.name,
             SIMPLEFS_FILENAME_LEN);
+    simplefs_dindex_add(dir, &dentry->d_name, inode->i_ino);
 
     eblock->nr_files++;
     mark_buffer_dirty(bh2);
@@ -886,8 +1154,8 @@ static int simplefs_link(struct dentry *old_dentry,
     return ret;
 
 put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[ei].ee_start,
+    if (alloc && simplefs_ext_start(&eblock->extents[ei])) {
+        put_blocks(SIMPLEFS_SB(sb), simplefs_ext_start(&eblock->extents[ei]),
                    eblock->extents[ei].ee_len);
         memset(&eblock->extents[ei], 0, sizeof(struct simplefs_extent));
     }
@@ -908,6 +1176,7 @@ static int simplefs_symlink(struct inode *dir,
 #endif
 {
     struct super_block *sb = dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     unsigned int l = strlen(symname) + 1;
     struct inode *inode = simplefs_new_inode(dir, S_IFLNK | S_IRWXUGO);
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
@@ -915,11 +1184,12 @@ static int simplefs_symlink(struct inode *dir,
     struct simplefs_file_ei_block *eblock = NULL;
     struct simplefs_dir_block *dblock = NULL;
     struct buffer_head *bh = NULL, *bh2 = NULL;
-    int ret= 0, alloc = false, bno = 0;
+    int ret= 0, alloc = false;
+    uint64_t bno = 0;
     int ei = 0, bi = 0, fi = 0;
 
     /* Check if symlink content is not too long */
-    if (l > sizeof(ci->i_data))
+    if (l > simplefs_inline_len(sb))
         return -ENAMETOOLONG;
 
     /* Fill directory data block */
@@ -928,24 +1198,23 @@ static int simplefs_symlink(struct inode *dir,
         return -EIO;
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == sbi->max_subfiles) {
         ret = -EMLINK;
         printk(KERN_INFO "directory is full");
         goto end;
     }
 
-    ei = eblock->nr_files / SIMPLEFS_FILES_PER_EXT;
-    bi = eblock->nr_files % SIMPLEFS_FILES_PER_EXT
-         / SIMPLEFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % SIMPLEFS_FILES_PER_BLOCK;
+    ei = eblock->nr_files / sbi->files_per_ext;
+    bi = eblock->nr_files % sbi->files_per_ext
+         / sbi->files_per_block;
+    fi = eblock->nr_files % sbi->files_per_block;
 
-    if (eblock->extents[ei].ee_start == 0) {
-        bno = get_free_blocks(SIMPLEFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
+    if (!simplefs_ext_start(&eblock->extents[ei])) {
+        bno = get_free_blocks(SIMPLEFS_SB(sb), 8, &ret);
+        if (!bno)
             goto end;
-        }
-        eblock->extents[ei].ee_start = bno;
+        simplefs_zero_blocks(sb, bno, 8);
+        simplefs_ext_set_start(&eblock->extents[ei], bno);
         eblock->extents[ei].ee_len = 8;
         eblock->extents[ei].ee_block =
             ei ? eblock->extents[ei - 1].ee_block +
@@ -953,7 +1222,7 @@ static int simplefs_symlink(struct inode *dir,
                : 0;
         alloc = true;
     }
-    bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+    bh2 = sb_bread(sb, simplefs_ext_start(&eblock->extents[ei]) + bi);
     if (!bh2) {
         ret = -EIO;
         goto put_block;
@@ -963,6 +1232,7 @@ static int simplefs_symlink(struct inode *dir,
     dblock->files[fi].inode = inode->i_ino;
     strncpy(dblock->files[fi].filename, dentry->d_name.name,
             SIMPLEFS_FILENAME_LEN);
+    simplefs_dindex_add(dir, &dentry->d_name, inode->i_ino);
 
     eblock->nr_files++;
     mark_buffer_dirty(bh2);
@@ -978,8 +1248,8 @@ static int simplefs_symlink(struct inode *dir,
     return 0;
 
 put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[ei].ee_start,
+    if (alloc && simplefs_ext_start(&eblock->extents[ei])) {
+        put_blocks(SIMPLEFS_SB(sb), simplefs_ext_start(&eblock->extents[ei]),
                    eblock->extents[ei].ee_len);
         memset(&eblock->extents[ei], 0, sizeof(struct simplefs_extent));
     }
@@ -0,0 +1,1314 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+static int sfs_pread(struct sfs_fs *fs, void *buf, size_t len, uint64_t off)
+{
+    ssize_t ret = pread(fs->fd, buf, len, off);
+
+    if (ret < 0)
+        return -errno;
+    if ((size_t) ret != len)
+        return -EIO;
+    return 0;
+}
+
+static int sfs_pwrite(struct sfs_fs *fs,
+                      const void *buf,
+                      size_t len,
+                      uint64_t off)
+{
+    ssize_t ret;
+
+    if (!fs->writable)
+        return -EROFS;
+    ret = pwrite(fs->fd, buf, len, off);
+    if (ret < 0)
+        return -errno;
+    if ((size_t) ret != len)
+        return -EIO;
+    return 0;
+}
+
+int sfs_read_block(struct sfs_fs *fs, uint64_t bno, void *buf)
+{
+    if (bno >= fs->nr_blocks)
+        return -EINVAL;
+    return sfs_pread(fs, buf, fs->block_size, bno << fs->blocksize_bits);
+}
+
+int sfs_write_block(struct sfs_fs *fs, uint64_t bno, const void *buf)
+{
+    if (bno >= fs->nr_blocks)
+        return -EINVAL;
+    return sfs_pwrite(fs, buf, fs->block_size, bno << fs->blocksize_bits);
+}
+
+int sfs_open(struct sfs_fs *fs, const char *path, int writable)
+{
+    struct simplefs_super_block *sb = &fs->sb;
+    int ret;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fs->fd < 0)
+        return -errno;
+    fs->writable = writable;
+
+    ret = sfs_pread(fs, sb, sizeof(*sb), 0);
+    if (ret)
+        goto close_fd;
+
+    ret = -EINVAL;
+    if (le32toh(sb->magic) != SIMPLEFS_MAGIC)
+        goto close_fd;
+    fs->feature_incompat = le32toh(sb->feature_incompat);
+    if (fs->feature_incompat & ~SIMPLEFS_FEATURE_INCOMPAT_SUPP)
+        goto close_fd;
+    fs->blocksize_bits = le32toh(sb->blocksize_bits);
+    if (!fs->blocksize_bits)
+        fs->blocksize_bits = SIMPLEFS_BLOCK_SIZE_BITS;
+    if (fs->blocksize_bits < SIMPLEFS_MIN_BLOCK_SIZE_BITS ||
+        fs->blocksize_bits > SIMPLEFS_MAX_BLOCK_SIZE_BITS)
+        goto close_fd;
+
+    fs->nr_blocks = le32toh(sb->nr_blocks);
+    fs->nr_inodes = le32toh(sb->nr_inodes);
+    fs->nr_istore_blocks = le32toh(sb->nr_istore_blocks);
+    fs->nr_ifree_blocks = le32toh(sb->nr_ifree_blocks);
+    fs->nr_bfree_blocks = le32toh(sb->nr_bfree_blocks);
+    fs->nr_free_inodes = le32toh(sb->nr_free_inodes);
+    fs->nr_free_blocks = le32toh(sb->nr_free_blocks);
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT) {
+        fs->nr_blocks |= (uint64_t) le32toh(sb->nr_blocks_hi) << 32;
+        fs->nr_free_blocks |= (uint64_t) le32toh(sb->nr_free_blocks_hi) << 32;
+    }
+
+    fs->block_size = 1U << fs->blocksize_bits;
+    fs->inode_size = fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE
+                         ? SIMPLEFS_LARGE_INODE_SIZE
+                         : sizeof(struct simplefs_inode);
+    fs->inodes_per_block =
+        SIMPLEFS_INODES_PER_BLOCK(fs->block_size, fs->inode_size);
+    fs->max_extents = SIMPLEFS_MAX_EXTENTS(fs->block_size);
+    fs->files_per_block = SIMPLEFS_FILES_PER_BLOCK(fs->block_size);
+    fs->inline_len = fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT
+                         ? SIMPLEFS_INLINE_DATA_LEN_64
+                         : SIMPLEFS_INLINE_DATA_LEN;
+
+    /* The metadata must fit in the volume */
+    if ((uint64_t) fs->nr_istore_blocks * fs->inodes_per_block <
+            fs->nr_inodes ||
+        sfs_data_start(fs) >= fs->nr_blocks)
+        goto close_fd;
+
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE) {
+        fs->itable_region_bits = le32toh(sb->itable_region_bits);
+        if (fs->itable_region_bits >= 32)
+            goto close_fd;
+        fs->nr_itable_regions =
+            ((fs->nr_istore_blocks - 1) >> fs->itable_region_bits) + 1;
+        if (fs->nr_itable_regions >
+            SIMPLEFS_ITABLE_MAX_REGIONS(fs->block_size))
+            goto close_fd;
+
+        fs->itable_uninit = malloc((fs->nr_itable_regions + 7) / 8);
+        if (!fs->itable_uninit) {
+            ret = -ENOMEM;
+            goto close_fd;
+        }
+        ret = sfs_pread(fs, fs->itable_uninit,
+                        (fs->nr_itable_regions + 7) / 8,
+                        SIMPLEFS_ITABLE_MAP_OFFSET);
+        if (ret)
+            goto free_map;
+    }
+
+    return 0;
+
+free_map:
+    free(fs->itable_uninit);
+    fs->itable_uninit = NULL;
+close_fd:
+    close(fs->fd);
+    fs->fd = -1;
+    return ret;
+}
+
+int sfs_close(struct sfs_fs *fs)
+{
+    int ret = 0;
+
+    if (fs->writable)
+        ret = sfs_flush(fs);
+    free(fs->ifree);
+    free(fs->bfree);
+    free(fs->itable_uninit);
+    fs->ifree = fs->bfree = fs->itable_uninit = NULL;
+    if (close(fs->fd) && !ret)
+        ret = -errno;
+    fs->fd = -1;
+
+    return ret;
+}
+
+uint64_t sfs_inode_offset(const struct sfs_fs *fs, uint32_t ino)
+{
+    return ((uint64_t) (ino / fs->inodes_per_block) + 1)
+               << fs->blocksize_bits |
+           (uint64_t) (ino % fs->inodes_per_block) * fs->inode_size;
+}
+
+static int64_t sfs_decode_time(uint32_t lo, uint32_t hi)
+{
+    return (int64_t) ((uint64_t) le32toh(hi) << 32 | le32toh(lo));
+}
+
+void sfs_decode_inode(const struct sfs_fs *fs,
+                      const void *raw,
+                      struct sfs_inode *inode)
+{
+    const struct simplefs_inode *cinode = raw;
+    const struct simplefs_inode_extra *extra =
+        (const struct simplefs_inode_extra *) (cinode + 1);
+
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = le32toh(cinode->i_mode);
+    inode->uid = le32toh(cinode->i_uid);
+    inode->gid = le32toh(cinode->i_gid);
+    inode->nlink = le32toh(cinode->i_nlink);
+    inode->flags = le32toh(cinode->i_flags);
+    inode->size = le32toh(cinode->i_size);
+    inode->blocks = le32toh(cinode->i_blocks);
+    inode->ei_block = le32toh(cinode->ei_block);
+    inode->ctime = le32toh(cinode->i_ctime);
+    inode->atime = le32toh(cinode->i_atime);
+    inode->mtime = le32toh(cinode->i_mtime);
+    memcpy(inode->data, cinode->i_data, fs->inline_len);
+
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT) {
+        inode->size |= (uint64_t) le32toh(cinode->i_size_hi) << 32;
+        inode->ei_block |= (uint64_t) le32toh(cinode->ei_block_hi) << 32;
+    }
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE) {
+        inode->ctime = sfs_decode_time(cinode->i_ctime, extra->i_ctime_hi);
+        inode->atime = sfs_decode_time(cinode->i_atime, extra->i_atime_hi);
+        inode->mtime = sfs_decode_time(cinode->i_mtime, extra->i_mtime_hi);
+        inode->ctime_nsec = le32toh(extra->i_ctime_nsec);
+        inode->atime_nsec = le32toh(extra->i_atime_nsec);
+        inode->mtime_nsec = le32toh(extra->i_mtime_nsec);
+    }
+}
+
+int sfs_read_inode(struct sfs_fs *fs, uint32_t ino, struct sfs_inode *inode)
+{
+    char raw[SIMPLEFS_LARGE_INODE_SIZE];
+    int ret;
+
+    if (ino >= fs->nr_inodes)
+        return -EINVAL;
+    if (sfs_itable_uninit(fs, ino)) {
+        memset(inode, 0, sizeof(*inode));
+        return 0;
+    }
+    ret = sfs_pread(fs, raw, fs->inode_size, sfs_inode_offset(fs, ino));
+    if (ret)
+        return ret;
+
+    sfs_decode_inode(fs, raw, inode);
+    return 0;
+}
+
+void sfs_encode_inode(const struct sfs_fs *fs,
+                      const struct sfs_inode *inode,
+                      void *raw)
+{
+    struct simplefs_inode *cinode = raw;
+    struct simplefs_inode_extra *extra =
+        (struct simplefs_inode_extra *) (cinode + 1);
+
+    memset(raw, 0, fs->inode_size);
+    cinode->i_mode = htole32(inode->mode);
+    cinode->i_uid = htole32(inode->uid);
+    cinode->i_gid = htole32(inode->gid);
+    cinode->i_nlink = htole32(inode->nlink);
+    cinode->i_flags = htole32(inode->flags);
+    cinode->i_size = htole32((uint32_t) inode->size);
+    cinode->i_blocks = htole32((uint32_t) inode->blocks);
+    cinode->ei_block = htole32((uint32_t) inode->ei_block);
+    cinode->i_ctime = htole32((uint32_t) inode->ctime);
+    cinode->i_atime = htole32((uint32_t) inode->atime);
+    cinode->i_mtime = htole32((uint32_t) inode->mtime);
+    memcpy(cinode->i_data, inode->data, fs->inline_len);
+
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT) {
+        cinode->i_size_hi = htole32(inode->size >> 32);
+        cinode->ei_block_hi = htole32(inode->ei_block >> 32);
+    }
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE) {
+        extra->i_ctime_hi = htole32((uint64_t) inode->ctime >> 32);
+        extra->i_atime_hi = htole32((uint64_t) inode->atime >> 32);
+        extra->i_mtime_hi = htole32((uint64_t) inode->mtime >> 32);
+        extra->i_ctime_nsec = htole32(inode->ctime_nsec);
+        extra->i_atime_nsec = htole32(inode->atime_nsec);
+        extra->i_mtime_nsec = htole32(inode->mtime_nsec);
+    }
+}
+
+int sfs_write_inode(struct sfs_fs *fs,
+                    uint32_t ino,
+                    const struct sfs_inode *inode)
+{
+    char raw[SIMPLEFS_LARGE_INODE_SIZE];
+
+    if (ino >= fs->nr_inodes)
+        return -EINVAL;
+
+    sfs_encode_inode(fs, inode, raw);
+    return sfs_pwrite(fs, raw, fs->inode_size, sfs_inode_offset(fs, ino));
+}
+
+uint64_t sfs_ext_start(const struct simplefs_extent *ext)
+{
+    return (uint64_t) le16toh(ext->ee_start_hi) << 32 | le32toh(ext->ee_start);
+}
+
+int sfs_extent_iterate(struct sfs_fs *fs,
+                       const struct sfs_inode *inode,
+                       sfs_extent_fn fn,
+                       void *arg)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent ext;
+    uint32_t i;
+    int ret;
+
+    if (!inode->ei_block)
+        return 0;
+
+    index = malloc(fs->block_size);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_block(fs, inode->ei_block, index);
+    if (ret)
+        goto end;
+
+    for (i = 0; i < fs->max_extents; i++) {
+        if (!sfs_ext_start(&index->extents[i]))
+            break;
+
+        /* Hand out the extent in host byte order */
+        ext.ee_block = le32toh(index->extents[i].ee_block);
+        ext.ee_len = le16toh(index->extents[i].ee_len);
+        simplefs_ext_set_start(&ext, sfs_ext_start(&index->extents[i]));
+        ret = fn(fs, &ext, arg);
+        if (ret)
+            break;
+    }
+
+end:
+    free(index);
+    return ret;
+}
+
+struct sfs_bmap_arg {
+    uint32_t iblock;
+    uint64_t bno;
+};
+
+static int sfs_bmap_fn(struct sfs_fs *fs,
+                       const struct simplefs_extent *ext,
+                       void *arg)
+{
+    struct sfs_bmap_arg *bmap = arg;
+
+    if (bmap->iblock < ext->ee_block ||
+        bmap->iblock >= ext->ee_block + ext->ee_len)
+        return 0;
+    bmap->bno = simplefs_ext_start(ext) + bmap->iblock - ext->ee_block;
+    return 1;
+}
+
+int sfs_bmap(struct sfs_fs *fs,
+             const struct sfs_inode *inode,
+             uint32_t iblock,
+             uint64_t *bno)
+{
+    struct sfs_bmap_arg bmap = {.iblock = iblock};
+    int ret;
+
+    ret = sfs_extent_iterate(fs, inode, sfs_bmap_fn, &bmap);
+    if (ret < 0)
+        return ret;
+    *bno = bmap.bno;
+    return 0;
+}
+
+struct sfs_dir_arg {
+    sfs_dir_fn fn;
+    void *arg;
+    struct simplefs_dir_block *dblock;
+    uint64_t skip; /* Entries left to skip before calling fn */
+    int end;       /* An empty entry was found */
+};
+
+/* Entries are packed: the first empty one ends the directory */
+static int sfs_dir_extent_fn(struct sfs_fs *fs,
+                             const struct simplefs_extent *ext,
+                             void *arg)
+{
+    struct sfs_dir_arg *dir = arg;
+    char name[SIMPLEFS_FILENAME_LEN + 1];
+    struct simplefs_file *f;
+    uint32_t bi, fi;
+    int ret;
+
+    for (bi = 0; bi < ext->ee_len; bi++) {
+        /* Entries are packed, blocks before the start are full */
+        if (dir->skip >= fs->files_per_block) {
+            dir->skip -= fs->files_per_block;
+            continue;
+        }
+        ret = sfs_read_block(fs, simplefs_ext_start(ext) + bi, dir->dblock);
+        if (ret)
+            return ret;
+
+        for (fi = dir->skip, dir->skip = 0; fi < fs->files_per_block; fi++) {
+            f = &dir->dblock->files[fi];
+            if (!f->inode) {
+                dir->end = 1;
+                return 1;
+            }
+            memcpy(name, f->filename, SIMPLEFS_FILENAME_LEN);
+            name[SIMPLEFS_FILENAME_LEN] = '\0';
+            ret = dir->fn(name, le32toh(f->inode), dir->arg);
+            if (ret)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+int sfs_dir_iterate(struct sfs_fs *fs,
+                    const struct sfs_inode *dir,
+                    sfs_dir_fn fn,
+                    void *arg)
+{
+    return sfs_dir_iterate_from(fs, dir, 0, fn, arg);
+}
+
+int sfs_dir_iterate_from(struct sfs_fs *fs,
+                         const struct sfs_inode *dir,
+                         uint64_t pos,
+                         sfs_dir_fn fn,
+                         void *arg)
+{
+    struct sfs_dir_arg dir_arg = {.fn = fn, .arg = arg, .skip = pos};
+    int ret;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+
+    dir_arg.dblock = malloc(fs->block_size);
+    if (!dir_arg.dblock)
+        return -ENOMEM;
+    ret = sfs_extent_iterate(fs, dir, sfs_dir_extent_fn, &dir_arg);
+    free(dir_arg.dblock);
+
+    /* Reaching the end is not a stop requested by fn */
+    if (dir_arg.end && ret == 1)
+        ret = 0;
+    return ret;
+}
+
+struct sfs_lookup_arg {
+    const char *name;
+    uint32_t ino;
+};
+
+static int sfs_lookup_fn(const char *name, uint32_t ino, void *arg)
+{
+    struct sfs_lookup_arg *lookup = arg;
+
+    if (strcmp(name, lookup->name))
+        return 0;
+    lookup->ino = ino;
+    return 2;
+}
+
+int sfs_dir_lookup(struct sfs_fs *fs,
+                   const struct sfs_inode *dir,
+                   const char *name,
+                   uint32_t *ino)
+{
+    struct sfs_lookup_arg lookup = {.name = name};
+    int ret;
+
+    ret = sfs_dir_iterate(fs, dir, sfs_lookup_fn, &lookup);
+    if (ret < 0)
+        return ret;
+    if (ret != 2)
+        return -ENOENT;
+    *ino = lookup.ino;
+    return 0;
+}
+
+/* Read nr_blocks bitmap blocks from start in a new buffer */
+static int sfs_read_bitmap(struct sfs_fs *fs,
+                           uint64_t start,
+                           uint32_t nr_blocks,
+                           uint8_t **map)
+{
+    size_t len = (size_t) nr_blocks << fs->blocksize_bits;
+    int ret;
+
+    *map = malloc(len);
+    if (!*map)
+        return -ENOMEM;
+    ret = sfs_pread(fs, *map, len, start << fs->blocksize_bits);
+    if (ret) {
+        free(*map);
+        *map = NULL;
+    }
+    return ret;
+}
+
+int sfs_load_bitmaps(struct sfs_fs *fs)
+{
+    int ret;
+
+    if (fs->ifree)
+        return 0;
+
+    ret = sfs_read_bitmap(fs, sfs_ifree_start(fs), fs->nr_ifree_blocks,
+                          &fs->ifree);
+    if (ret)
+        return ret;
+    ret = sfs_read_bitmap(fs, sfs_bfree_start(fs), fs->nr_bfree_blocks,
+                          &fs->bfree);
+    if (ret) {
+        free(fs->ifree);
+        fs->ifree = NULL;
+    }
+    return ret;
+}
+
+/*
+ * Return the first of `len` consecutive free bits of map (nr_bits bits),
+ * searching from goal and wrapping around, or 0 if there are none.
+ */
+static uint64_t sfs_bitmap_find(const uint8_t *map,
+                                uint64_t nr_bits,
+                                uint32_t len,
+                                uint64_t goal)
+{
+    uint64_t i, start, end, run;
+    int pass;
+
+    if (goal >= nr_bits)
+        goal = 0;
+
+    for (pass = 0; pass < 2; pass++) {
+        start = pass ? 0 : goal;
+        end = pass ? goal + len - 1 : nr_bits;
+        if (end > nr_bits)
+            end = nr_bits;
+        for (i = start, run = 0; i < end; i++) {
+            /* Skip bytes without any free bit */
+            if (!(i % 8) && !map[i / 8] && i + 8 <= end) {
+                i += 7;
+                run = 0;
+                continue;
+            }
+            if (!sfs_test_bit(map, i)) {
+                run = 0;
+                continue;
+            }
+            if (++run == len)
+                return i - len + 1;
+        }
+        if (!goal)
+            break;
+    }
+    return 0;
+}
+
+static void sfs_bitmap_set(uint8_t *map, uint64_t i, uint64_t len, int free)
+{
+    for (; len; i++, len--) {
+        if (free)
+            map[i / 8] |= 1 << (i % 8);
+        else
+            map[i / 8] &= ~(1 << (i % 8));
+    }
+}
+
+uint32_t sfs_alloc_inode(struct sfs_fs *fs, uint32_t goal)
+{
+    uint32_t ino;
+
+    if (sfs_load_bitmaps(fs) || !fs->nr_free_inodes)
+        return 0;
+    ino = sfs_bitmap_find(fs->ifree, fs->nr_inodes, 1, goal);
+    if (!ino)
+        return 0;
+    sfs_bitmap_set(fs->ifree, ino, 1, 0);
+    fs->nr_free_inodes--;
+    fs->bitmaps_dirty = 1;
+    return ino;
+}
+
+uint64_t sfs_alloc_blocks(struct sfs_fs *fs, uint32_t len, uint64_t goal)
+{
+    uint64_t bno;
+
+    if (!len || sfs_load_bitmaps(fs) || fs->nr_free_blocks < len)
+        return 0;
+    bno = sfs_bitmap_find(fs->bfree, fs->nr_blocks, len, goal);
+    if (!bno)
+        return 0;
+    sfs_bitmap_set(fs->bfree, bno, len, 0);
+    fs->nr_free_blocks -= len;
+    fs->bitmaps_dirty = 1;
+    return bno;
+}
+
+int sfs_free_inode(struct sfs_fs *fs, uint32_t ino)
+{
+    int ret = sfs_load_bitmaps(fs);
+
+    if (ret)
+        return ret;
+    if (!ino || ino >= fs->nr_inodes || sfs_test_bit(fs->ifree, ino))
+        return -EINVAL;
+    sfs_bitmap_set(fs->ifree, ino, 1, 1);
+    fs->nr_free_inodes++;
+    fs->bitmaps_dirty = 1;
+    return 0;
+}
+
+int sfs_free_blocks(struct sfs_fs *fs, uint64_t bno, uint32_t len)
+{
+    int ret = sfs_load_bitmaps(fs);
+
+    if (ret)
+        return ret;
+    if (bno < sfs_data_start(fs) || bno + len > fs->nr_blocks)
+        return -EINVAL;
+    sfs_bitmap_set(fs->bfree, bno, len, 1);
+    fs->nr_free_blocks += len;
+    fs->bitmaps_dirty = 1;
+    return 0;
+}
+
+int sfs_flush(struct sfs_fs *fs)
+{
+    struct simplefs_super_block *sb = &fs->sb;
+    int ret;
+
+    if (!fs->bitmaps_dirty)
+        return 0;
+
+    ret = sfs_pwrite(fs, fs->ifree, (size_t) fs->nr_ifree_blocks
+                                        << fs->blocksize_bits,
+                     sfs_ifree_start(fs) << fs->blocksize_bits);
+    if (ret)
+        return ret;
+    ret = sfs_pwrite(fs, fs->bfree, (size_t) fs->nr_bfree_blocks
+                                        << fs->blocksize_bits,
+                     sfs_bfree_start(fs) << fs->blocksize_bits);
+    if (ret)
+        return ret;
+
+    sb->nr_free_inodes = htole32(fs->nr_free_inodes);
+    sb->nr_free_blocks = htole32((uint32_t) fs->nr_free_blocks);
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT)
+        sb->nr_free_blocks_hi = htole32(fs->nr_free_blocks >> 32);
+    ret = sfs_pwrite(fs, sb, sizeof(*sb), 0);
+    if (ret)
+        return ret;
+
+    fs->bitmaps_dirty = 0;
+    return fsync(fs->fd) ? -errno : 0;
+}
+
+/* Zero `len` blocks from bno */
+static int sfs_zero_blocks(struct sfs_fs *fs, uint64_t bno, uint32_t len)
+{
+    size_t size = (size_t) len << fs->blocksize_bits;
+    void *zero = calloc(1, size);
+    int ret;
+
+    if (!zero)
+        return -ENOMEM;
+    ret = sfs_pwrite(fs, zero, size, bno << fs->blocksize_bits);
+    free(zero);
+    return ret;
+}
+
+/*
+ * Zero the inode store region of inode ino if it is not zeroed yet, then mark
+ * it zeroed in block 0, once the zeroes are on disk, as the kernel module does
+ * before using an inode of the region.
+ */
+static int sfs_itable_init(struct sfs_fs *fs, uint32_t ino)
+{
+    uint32_t region, start, len;
+    uint8_t *byte;
+    int ret;
+
+    if (!sfs_itable_uninit(fs, ino))
+        return 0;
+
+    region = (ino / fs->inodes_per_block) >> fs->itable_region_bits;
+    start = region << fs->itable_region_bits;
+    len = fs->nr_istore_blocks - start;
+    if (len > 1U << fs->itable_region_bits)
+        len = 1U << fs->itable_region_bits;
+    ret = sfs_zero_blocks(fs, sfs_istore_start(fs) + start, len);
+    if (ret)
+        return ret;
+    if (fdatasync(fs->fd))
+        return -errno;
+
+    byte = &fs->itable_uninit[region / 8];
+    *byte &= ~(1 << (region % 8));
+    ret = sfs_pwrite(fs, byte, 1, SIMPLEFS_ITABLE_MAP_OFFSET + region / 8);
+    if (ret)
+        *byte |= 1 << (region % 8);
+    return ret;
+}
+
+/*
+ * Allocate a zeroed extent of SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks in the
+ * i-th slot of index, following the previous one in logical blocks, as the
+ * kernel module does for files and directories.
+ */
+static int sfs_alloc_extent(struct sfs_fs *fs,
+                            struct simplefs_file_ei_block *index,
+                            uint32_t i,
+                            uint64_t goal)
+{
+    struct simplefs_extent *ext = &index->extents[i];
+    uint32_t len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    uint64_t bno;
+    int ret;
+
+    if (i)
+        goal = sfs_ext_start(ext - 1) + le16toh(ext[-1].ee_len);
+    bno = sfs_alloc_blocks(fs, len, goal);
+    if (!bno)
+        return -ENOSPC;
+    ret = sfs_zero_blocks(fs, bno, len);
+    if (ret) {
+        sfs_free_blocks(fs, bno, len);
+        return ret;
+    }
+
+    ext->ee_start = htole32((uint32_t) bno);
+    ext->ee_start_hi = htole16(bno >> 32);
+    ext->ee_len = htole16(len);
+    ext->ee_block = i ? htole32(le32toh(ext[-1].ee_block) +
+                                le16toh(ext[-1].ee_len))
+                      : 0;
+    return 0;
+}
+
+int sfs_new_inode(struct sfs_fs *fs,
+                  uint32_t goal,
+                  uint32_t mode,
+                  struct sfs_inode *inode,
+                  uint32_t *ino)
+{
+    int ret;
+
+    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode))
+        return -EINVAL;
+
+    *ino = sfs_alloc_inode(fs, goal);
+    if (!*ino)
+        return -ENOSPC;
+    ret = sfs_itable_init(fs, *ino);
+    if (ret)
+        goto put_ino;
+
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = mode;
+    inode->nlink = 1;
+
+    if (S_ISREG(mode)) {
+        inode->flags = SIMPLEFS_INODE_INLINE;
+    } else if (S_ISDIR(mode)) {
+        /* Directories start with an empty index block, . and .. */
+        inode->ei_block = sfs_alloc_blocks(fs, 1, 0);
+        if (!inode->ei_block) {
+            ret = -ENOSPC;
+            goto put_ino;
+        }
+        ret = sfs_zero_blocks(fs, inode->ei_block, 1);
+        if (ret) {
+            sfs_free_blocks(fs, inode->ei_block, 1);
+            goto put_ino;
+        }
+        inode->size = fs->block_size;
+        inode->blocks = 1;
+        inode->nlink = 2;
+    }
+
+    return 0;
+
+put_ino:
+    sfs_free_inode(fs, *ino);
+    return ret;
+}
+
+int sfs_release_inode(struct sfs_fs *fs, uint32_t ino, struct sfs_inode *inode)
+{
+    struct simplefs_file_ei_block *index;
+    uint32_t i;
+    int ret;
+
+    /* Symlinks and inline files have no block */
+    if (inode->ei_block && !S_ISLNK(inode->mode) &&
+        !(inode->flags & SIMPLEFS_INODE_INLINE)) {
+        index = malloc(fs->block_size);
+        if (!index)
+            return -ENOMEM;
+        ret = sfs_read_block(fs, inode->ei_block, index);
+        for (i = 0; !ret && i < fs->max_extents; i++) {
+            if (!sfs_ext_start(&index->extents[i]))
+                break;
+            sfs_free_blocks(fs, sfs_ext_start(&index->extents[i]),
+                            le16toh(index->extents[i].ee_len));
+        }
+        free(index);
+        sfs_free_blocks(fs, inode->ei_block, 1);
+    }
+
+    memset(inode, 0, sizeof(*inode));
+    ret = sfs_write_inode(fs, ino, inode);
+    if (ret)
+        return ret;
+    return sfs_free_inode(fs, ino);
+}
+
+int sfs_dir_add(struct sfs_fs *fs,
+                const struct sfs_inode *dir,
+                const char *name,
+                uint32_t ino)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_dir_block *dblock = NULL;
+    uint32_t files_per_ext = fs->files_per_block * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    uint32_t nr_files, ei, bi, fi;
+    uint64_t bno;
+    int ret, alloc = 0;
+
+    if (strlen(name) > SIMPLEFS_FILENAME_LEN)
+        return -ENAMETOOLONG;
+
+    index = malloc(fs->block_size);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_block(fs, dir->ei_block, index);
+    if (ret)
+        goto end;
+
+    /* Entries are packed: the new one goes right after the last one */
+    nr_files = le32toh(index->nr_files);
+    if (nr_files >= files_per_ext * fs->max_extents) {
+        ret = -EMLINK;
+        goto end;
+    }
+    ei = nr_files / files_per_ext;
+    bi = nr_files % files_per_ext / fs->files_per_block;
+    fi = nr_files % fs->files_per_block;
+
+    if (!sfs_ext_start(&index->extents[ei])) {
+        ret = sfs_alloc_extent(fs, index, ei, dir->ei_block);
+        if (ret)
+            goto end;
+        alloc = 1;
+    }
+
+    dblock = malloc(fs->block_size);
+    if (!dblock) {
+        ret = -ENOMEM;
+        goto put_extent;
+    }
+    bno = sfs_ext_start(&index->extents[ei]) + bi;
+    ret = sfs_read_block(fs, bno, dblock);
+    if (ret)
+        goto put_extent;
+    dblock->files[fi].inode = htole32(ino);
+    strncpy(dblock->files[fi].filename, name, SIMPLEFS_FILENAME_LEN);
+    ret = sfs_write_block(fs, bno, dblock);
+    if (ret)
+        goto put_extent;
+
+    index->nr_files = htole32(nr_files + 1);
+    ret = sfs_write_block(fs, dir->ei_block, index);
+    goto end;
+
+put_extent:
+    if (alloc) {
+        sfs_free_blocks(fs, sfs_ext_start(&index->extents[ei]),
+                        le16toh(index->extents[ei].ee_len));
+    }
+end:
+    free(dblock);
+    free(index);
+    return ret;
+}
+
+int sfs_dir_remove(struct sfs_fs *fs,
+                   const struct sfs_inode *dir,
+                   const char *name)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_dir_block *cur, *next;
+    uint32_t files_per_ext = fs->files_per_block * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    uint32_t fpb = fs->files_per_block;
+    uint32_t nr_files, pos, fi;
+    uint64_t bno, next_bno;
+    void *tmp;
+    int ret;
+
+    index = malloc(fs->block_size);
+    cur = malloc(fs->block_size);
+    next = malloc(fs->block_size);
+    if (!index || !cur || !next) {
+        ret = -ENOMEM;
+        goto end;
+    }
+    ret = sfs_read_block(fs, dir->ei_block, index);
+    if (ret)
+        goto end;
+    nr_files = le32toh(index->nr_files);
+
+#define SFS_DIR_BLOCK(n)                                        \
+    (sfs_ext_start(&index->extents[(n) / files_per_ext]) +      \
+     (n) % files_per_ext / fpb)
+
+    /* Find the entry, one directory block at a time */
+    ret = -ENOENT;
+    for (pos = 0; pos < nr_files; pos += fpb) {
+        bno = SFS_DIR_BLOCK(pos);
+        ret = sfs_read_block(fs, bno, cur);
+        if (ret)
+            goto end;
+        ret = -ENOENT;
+        for (fi = 0; fi < fpb && pos + fi < nr_files; fi++) {
+            if (!strncmp(cur->files[fi].filename, name,
+                         SIMPLEFS_FILENAME_LEN)) {
+                ret = 0;
+                break;
+            }
+        }
+        if (!ret)
+            break;
+    }
+    if (ret)
+        goto end;
+
+    /*
+     * Keep the entries packed, as the kernel module does: shift the ones
+     * after the removed entry down by one, moving the first entry of each
+     * following block to the end of the previous one.
+     */
+    memmove(cur->files + fi, cur->files + fi + 1,
+            (fpb - fi - 1) * sizeof(struct simplefs_file));
+    for (pos += fpb; pos < nr_files; pos += fpb) {
+        next_bno = SFS_DIR_BLOCK(pos);
+        ret = sfs_read_block(fs, next_bno, next);
+        if (ret)
+            goto end;
+        cur->files[fpb - 1] = next->files[0];
+        ret = sfs_write_block(fs, bno, cur);
+        if (ret)
+            goto end;
+        memmove(next->files, next->files + 1,
+                (fpb - 1) * sizeof(struct simplefs_file));
+        tmp = cur;
+        cur = next;
+        next = tmp;
+        bno = next_bno;
+    }
+    memset(cur->files + fpb - 1, 0, sizeof(struct simplefs_file));
+    ret = sfs_write_block(fs, bno, cur);
+    if (ret)
+        goto end;
+
+#undef SFS_DIR_BLOCK
+
+    index->nr_files = htole32(nr_files - 1);
+    ret = sfs_write_block(fs, dir->ei_block, index);
+
+end:
+    free(next);
+    free(cur);
+    free(index);
+    return ret;
+}
+
+/* Move the inline data of inode to the first block of a new index */
+static int sfs_convert_inline(struct sfs_fs *fs, struct sfs_inode *inode)
+{
+    char data[SIMPLEFS_INLINE_DATA_LEN];
+    uint64_t size = inode->size, bno;
+    uint32_t len;
+    int ret;
+
+    inode->ei_block = sfs_alloc_blocks(fs, 1, 0);
+    if (!inode->ei_block)
+        return -ENOSPC;
+    ret = sfs_zero_blocks(fs, inode->ei_block, 1);
+    if (ret)
+        goto put_index;
+
+    memcpy(data, inode->data, fs->inline_len);
+    memset(inode->data, 0, sizeof(inode->data));
+    inode->flags &= ~SIMPLEFS_INODE_INLINE;
+    inode->blocks = 1;
+    if (!size)
+        return 0;
+
+    ret = sfs_file_map(fs, inode, 0, 1, &bno, &len);
+    if (!ret)
+        ret = sfs_pwrite(fs, data, size, bno << fs->blocksize_bits);
+    if (!ret)
+        return 0;
+
+    memcpy(inode->data, data, fs->inline_len);
+    inode->flags |= SIMPLEFS_INODE_INLINE;
+put_index:
+    sfs_free_blocks(fs, inode->ei_block, 1);
+    inode->ei_block = 0;
+    return ret;
+}
+
+int sfs_file_map(struct sfs_fs *fs,
+                 struct sfs_inode *inode,
+                 uint32_t iblock,
+                 int create,
+                 uint64_t *bno,
+                 uint32_t *len)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint32_t i, start;
+    int ret, dirty = 0;
+
+    *bno = 0;
+    *len = 1;
+    if (iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * fs->max_extents)
+        return -EFBIG;
+
+    if (inode->flags & SIMPLEFS_INODE_INLINE || !inode->ei_block) {
+        if (!create)
+            return 0;
+        ret = sfs_convert_inline(fs, inode);
+        if (ret)
+            return ret;
+    }
+
+    index = malloc(fs->block_size);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_block(fs, inode->ei_block, index);
+    if (ret)
+        goto end;
+
+    /* Extent holding iblock, or the first unused one */
+    for (i = 0; i < fs->max_extents; i++) {
+        ext = &index->extents[i];
+        start = le32toh(ext->ee_block);
+        if (!sfs_ext_start(ext) ||
+            (iblock >= start && iblock < start + le16toh(ext->ee_len)))
+            break;
+    }
+    if (i == fs->max_extents) {
+        ret = -EFBIG;
+        goto end;
+    }
+
+    /* Allocate extents until one covers iblock, like the kernel module */
+    while (!sfs_ext_start(&index->extents[i])) {
+        if (!create)
+            goto end;
+        ret = sfs_alloc_extent(fs, index, i, inode->ei_block);
+        if (ret)
+            goto end;
+        dirty = 1;
+        ext = &index->extents[i];
+        if (iblock >= le32toh(ext->ee_block) + le16toh(ext->ee_len) &&
+            ++i == fs->max_extents) {
+            ret = -EFBIG;
+            goto end;
+        }
+    }
+
+    ext = &index->extents[i];
+    start = le32toh(ext->ee_block);
+    *bno = sfs_ext_start(ext) + iblock - start;
+    *len = start + le16toh(ext->ee_len) - iblock;
+
+end:
+    if (dirty) {
+        int err = sfs_write_block(fs, inode->ei_block, index);
+
+        if (!ret)
+            ret = err;
+    }
+    free(index);
+    return ret;
+}
+
+ssize_t sfs_file_read(struct sfs_fs *fs,
+                      struct sfs_inode *inode,
+                      void *buf,
+                      size_t len,
+                      uint64_t off)
+{
+    uint64_t bno, pos = off, end;
+    uint32_t nr, boff;
+    size_t n;
+    int ret;
+
+    if (off >= inode->size)
+        return 0;
+    end = off + len < inode->size ? off + len : inode->size;
+
+    if (inode->flags & SIMPLEFS_INODE_INLINE) {
+        memcpy(buf, inode->data + off, end - off);
+        return end - off;
+    }
+
+    while (pos < end) {
+        ret = sfs_file_map(fs, inode, pos >> fs->blocksize_bits, 0, &bno, &nr);
+        if (ret)
+            return ret;
+        boff = pos & (fs->block_size - 1);
+        n = ((uint64_t) nr << fs->blocksize_bits) - boff;
+        if (n > end - pos)
+            n = end - pos;
+
+        if (bno) {
+            ret = sfs_pread(fs, (char *) buf + (pos - off), n,
+                            (bno << fs->blocksize_bits) + boff);
+            if (ret)
+                return ret;
+        } else {
+            memset((char *) buf + (pos - off), 0, n);
+        }
+        pos += n;
+    }
+    return end - off;
+}
+
+/*
+ * Zero the bytes of inode in [from, to) which lie in allocated blocks. Blocks
+ * past the end of file may hold stale data: the kernel module only zeroes them
+ * when the file grows over them, and so must a write or truncate here.
+ */
+static int sfs_zero_range(struct sfs_fs *fs,
+                          struct sfs_inode *inode,
+                          uint64_t from,
+                          uint64_t to)
+{
+    uint64_t bno;
+    uint32_t nr, boff;
+    size_t n;
+    char *zero;
+    int ret = 0;
+
+    if (from >= to)
+        return 0;
+    zero = calloc(1, fs->block_size);
+    if (!zero)
+        return -ENOMEM;
+
+    while (from < to) {
+        ret = sfs_file_map(fs, inode, from >> fs->blocksize_bits, 0, &bno, &nr);
+        if (ret)
+            break;
+        boff = from & (fs->block_size - 1);
+        n = fs->block_size - boff;
+        if (n > to - from)
+            n = to - from;
+        if (bno) {
+            ret = sfs_pwrite(fs, zero, n, (bno << fs->blocksize_bits) + boff);
+            if (ret)
+                break;
+        }
+        from += n;
+    }
+
+    free(zero);
+    return ret;
+}
+
+/* End of the block holding the byte before size */
+static inline uint64_t sfs_block_end(const struct sfs_fs *fs, uint64_t size)
+{
+    return (size + fs->block_size - 1) & ~((uint64_t) fs->block_size - 1);
+}
+
+int sfs_file_extend(struct sfs_fs *fs,
+                    struct sfs_inode *inode,
+                    uint64_t off,
+                    uint64_t end)
+{
+    int ret;
+
+    if (end <= inode->size)
+        return 0;
+    ret = sfs_zero_range(fs, inode, inode->size, off);
+    if (!ret)
+        ret = sfs_zero_range(fs, inode, end, sfs_block_end(fs, end));
+    return ret;
+}
+
+ssize_t sfs_file_write(struct sfs_fs *fs,
+                       struct sfs_inode *inode,
+                       const void *buf,
+                       size_t len,
+                       uint64_t off)
+{
+    uint64_t bno, pos = off, end = off + len;
+    uint32_t nr, boff;
+    size_t n;
+    int ret;
+
+    if (end > SIMPLEFS_MAX_FILESIZE(fs->block_size))
+        return -EFBIG;
+
+    /* Small files keep their data in the inode */
+    if (inode->flags & SIMPLEFS_INODE_INLINE && end <= fs->inline_len) {
+        memcpy(inode->data + off, buf, len);
+        if (end > inode->size)
+            inode->size = end;
+        return len;
+    }
+
+    ret = sfs_file_extend(fs, inode, off, end);
+    if (ret)
+        return ret;
+
+    while (pos < end) {
+        ret = sfs_file_map(fs, inode, pos >> fs->blocksize_bits, 1, &bno, &nr);
+        if (ret)
+            return ret;
+        boff = pos & (fs->block_size - 1);
+        n = ((uint64_t) nr << fs->blocksize_bits) - boff;
+        if (n > end - pos)
+            n = end - pos;
+
+        ret = sfs_pwrite(fs, (const char *) buf + (pos - off), n,
+                         (bno << fs->blocksize_bits) + boff);
+        if (ret)
+            return ret;
+        pos += n;
+    }
+
+    if (end > inode->size)
+        inode->size = end;
+    inode->blocks = (inode->size >> fs->blocksize_bits) + 2;
+    return len;
+}
+
+int sfs_truncate(struct sfs_fs *fs, struct sfs_inode *inode, uint64_t size)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint64_t bno;
+    uint32_t nr_blocks, start, len, keep, i, tail;
+    char *zero;
+    int ret;
+
+    if (size > SIMPLEFS_MAX_FILESIZE(fs->block_size))
+        return -EFBIG;
+
+    /* Inline data only needs its tail cleared, unless it grows too big */
+    if (inode->flags & SIMPLEFS_INODE_INLINE) {
+        if (size <= fs->inline_len) {
+            if (size < inode->size)
+                memset(inode->data + size, 0, inode->size - size);
+            inode->size = size;
+            return 0;
+        }
+        ret = sfs_convert_inline(fs, inode);
+        if (ret)
+            return ret;
+    }
+
+    /* Blocks allocated past the end of file are stale, zero those grown over */
+    if (size > inode->size) {
+        ret = sfs_zero_range(fs, inode, inode->size, sfs_block_end(fs, size));
+        if (ret)
+            return ret;
+    }
+
+    /* Zero the tail of the last block so that it reads back as a hole */
+    tail = size & (fs->block_size - 1);
+    if (tail && size < inode->size) {
+        ret = sfs_file_map(fs, inode, size >> fs->blocksize_bits, 0, &bno,
+                           &len);
+        if (ret)
+            return ret;
+        if (bno) {
+            zero = calloc(1, fs->block_size - tail);
+            if (!zero)
+                return -ENOMEM;
+            ret = sfs_pwrite(fs, zero, fs->block_size - tail,
+                             (bno << fs->blocksize_bits) + tail);
+            free(zero);
+            if (ret)
+                return ret;
+        }
+    }
+
+    inode->size = size;
+    inode->blocks = (size >> fs->blocksize_bits) + 2;
+
+    /* Give back the blocks past the new end of file */
+    index = malloc(fs->block_size);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_block(fs, inode->ei_block, index);
+    if (ret)
+        goto end;
+
+    nr_blocks = (size + fs->block_size - 1) >> fs->blocksize_bits;
+    for (i = 0; i < fs->max_extents; i++) {
+        ext = &index->extents[i];
+        if (!sfs_ext_start(ext))
+            break;
+        start = le32toh(ext->ee_block);
+        len = le16toh(ext->ee_len);
+        if (start + len <= nr_blocks)
+            continue;
+
+        /* Extent still in use, give back the blocks past size only */
+        if (start < nr_blocks) {
+            keep = nr_blocks - start;
+            sfs_free_blocks(fs, sfs_ext_start(ext) + keep, len - keep);
+            ext->ee_len = htole16(keep);
+            continue;
+        }
+        sfs_free_blocks(fs, sfs_ext_start(ext), len);
+        memset(ext, 0, sizeof(*ext));
+    }
+    ret = sfs_write_block(fs, inode->ei_block, index);
+
+end:
+    free(index);
+    return ret;
+}
@@ -0,0 +1,244 @@
+#ifndef LIBSIMPLEFS_H
+#define LIBSIMPLEFS_H
+
+/*
+ * libsimplefs: access to a simplefs image from userspace, for the tools
+ * (fsck, image builders, ...) and benchmarks which do not want to go through
+ * the kernel module. It reuses the on-disk structures of simplefs.h.
+ *
+ * Unless stated otherwise, functions return 0 or a positive value on success
+ * and a negative error code (-errno) on failure.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "simplefs.h"
+
+/* An open image */
+struct sfs_fs {
+    int fd;
+    int writable;
+
+    struct simplefs_super_block sb; /* Superblock, as read from the image */
+
+    /* Superblock fields, decoded */
+    uint32_t feature_incompat;
+    uint64_t nr_blocks;
+    uint32_t nr_inodes;
+    uint32_t nr_istore_blocks;
+    uint32_t nr_ifree_blocks;
+    uint32_t nr_bfree_blocks;
+    uint64_t nr_free_inodes;
+    uint64_t nr_free_blocks;
+
+    /* Geometry */
+    uint32_t block_size;
+    uint32_t blocksize_bits;
+    uint32_t inode_size;
+    uint32_t inodes_per_block;
+    uint32_t max_extents;
+    uint32_t files_per_block;
+    uint32_t inline_len;
+
+    /* LAZY_ITABLE feature: inode store regions not zeroed yet (1 bit each) */
+    uint8_t *itable_uninit;
+    uint32_t itable_region_bits;
+    uint32_t nr_itable_regions;
+
+    /* Free inodes and free blocks bitmaps (1 means free), see sfs_load_bitmaps() */
+    uint8_t *ifree;
+    uint8_t *bfree;
+    int bitmaps_dirty;
+};
+
+/* An inode, decoded */
+struct sfs_inode {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t flags; /* SIMPLEFS_INODE_* */
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t ei_block; /* Index block, 0 for inline data */
+    int64_t ctime, atime, mtime;
+    uint32_t ctime_nsec, atime_nsec, mtime_nsec;
+    char data[SIMPLEFS_INLINE_DATA_LEN]; /* Symlink target or inline data */
+};
+
+#define SFS_ROOT_INO 0
+
+/* Open the image at path, read-only unless writable is set */
+int sfs_open(struct sfs_fs *fs, const char *path, int writable);
+/* Write back what changed if the image is writable, then close it */
+int sfs_close(struct sfs_fs *fs);
+
+/* Block I/O, buf is fs->block_size bytes */
+int sfs_read_block(struct sfs_fs *fs, uint64_t bno, void *buf);
+int sfs_write_block(struct sfs_fs *fs, uint64_t bno, const void *buf);
+
+/* First block of the inode store, ifree bitmap, bfree bitmap and data */
+static inline uint64_t sfs_istore_start(const struct sfs_fs *fs)
+{
+    return 1;
+}
+static inline uint64_t sfs_ifree_start(const struct sfs_fs *fs)
+{
+    return 1 + (uint64_t) fs->nr_istore_blocks;
+}
+static inline uint64_t sfs_bfree_start(const struct sfs_fs *fs)
+{
+    return sfs_ifree_start(fs) + fs->nr_ifree_blocks;
+}
+static inline uint64_t sfs_data_start(const struct sfs_fs *fs)
+{
+    return sfs_bfree_start(fs) + fs->nr_bfree_blocks;
+}
+
+/*
+ * Inodes. sfs_decode_inode() decodes on-disk inode raw, found at byte
+ * sfs_inode_offset() of the image, for callers reading the image themselves;
+ * they must check sfs_itable_uninit() first. Inodes of inode store regions
+ * not zeroed yet are free, sfs_read_inode() returns them zeroed.
+ * sfs_encode_inode() is the reverse, filling fs->inode_size bytes at raw; it
+ * only needs the geometry and features of fs, not an open image.
+ */
+uint64_t sfs_inode_offset(const struct sfs_fs *fs, uint32_t ino);
+void sfs_decode_inode(const struct sfs_fs *fs,
+                      const void *raw,
+                      struct sfs_inode *inode);
+void sfs_encode_inode(const struct sfs_fs *fs,
+                      const struct sfs_inode *inode,
+                      void *raw);
+int sfs_read_inode(struct sfs_fs *fs, uint32_t ino, struct sfs_inode *inode);
+int sfs_write_inode(struct sfs_fs *fs,
+                    uint32_t ino,
+                    const struct sfs_inode *inode);
+
+/*
+ * Extents. sfs_extent_iterate() calls fn on each used extent of the index
+ * block of inode and stops early if fn returns non-zero, which it returns.
+ * sfs_bmap() sets *bno to the physical block of logical block iblock, or 0
+ * if it is not mapped.
+ */
+uint64_t sfs_ext_start(const struct simplefs_extent *ext); /* On-disk ext */
+typedef int (*sfs_extent_fn)(struct sfs_fs *fs,
+                             const struct simplefs_extent *ext,
+                             void *arg);
+int sfs_extent_iterate(struct sfs_fs *fs,
+                       const struct sfs_inode *inode,
+                       sfs_extent_fn fn,
+                       void *arg);
+int sfs_bmap(struct sfs_fs *fs,
+             const struct sfs_inode *inode,
+             uint32_t iblock,
+             uint64_t *bno);
+
+/*
+ * Directories. sfs_dir_iterate() calls fn on each entry of dir, in order,
+ * and stops early if fn returns non-zero, which it returns. sfs_dir_lookup()
+ * sets *ino to the inode of name in dir and returns -ENOENT if not found.
+ */
+typedef int (*sfs_dir_fn)(const char *name, uint32_t ino, void *arg);
+int sfs_dir_iterate(struct sfs_fs *fs,
+                    const struct sfs_inode *dir,
+                    sfs_dir_fn fn,
+                    void *arg);
+/* Same, starting at the pos-th entry */
+int sfs_dir_iterate_from(struct sfs_fs *fs,
+                         const struct sfs_inode *dir,
+                         uint64_t pos,
+                         sfs_dir_fn fn,
+                         void *arg);
+int sfs_dir_lookup(struct sfs_fs *fs,
+                   const struct sfs_inode *dir,
+                   const char *name,
+                   uint32_t *ino);
+
+/*
+ * Bitmaps. They are read in memory by sfs_load_bitmaps() and written back,
+ * with the free counters of the superblock, by sfs_flush().
+ * sfs_alloc_inode() and sfs_alloc_blocks() search from goal, wrapping around,
+ * and return the inode or first block allocated, 0 if there is no room.
+ */
+int sfs_load_bitmaps(struct sfs_fs *fs);
+uint32_t sfs_alloc_inode(struct sfs_fs *fs, uint32_t goal);
+uint64_t sfs_alloc_blocks(struct sfs_fs *fs, uint32_t len, uint64_t goal);
+int sfs_free_inode(struct sfs_fs *fs, uint32_t ino);
+int sfs_free_blocks(struct sfs_fs *fs, uint64_t bno, uint32_t len);
+int sfs_flush(struct sfs_fs *fs);
+
+/*
+ * Modifications, laid out on disk as the kernel module does. They need the
+ * bitmaps, written back by sfs_flush(), and leave writing the inodes they
+ * change to the caller.
+ *
+ * sfs_new_inode() allocates an inode near goal and sets up *inode for mode:
+ * regular files start with inline data, directories with an empty index
+ * block. sfs_release_inode() frees inode ino, its blocks, and clears it on
+ * disk. sfs_dir_add() appends an entry to dir, sfs_dir_remove() removes the
+ * entry name from dir (-ENOENT if not found), keeping the entries packed.
+ * Neither changes link counts.
+ */
+int sfs_new_inode(struct sfs_fs *fs,
+                  uint32_t goal,
+                  uint32_t mode,
+                  struct sfs_inode *inode,
+                  uint32_t *ino);
+int sfs_release_inode(struct sfs_fs *fs, uint32_t ino, struct sfs_inode *inode);
+int sfs_dir_add(struct sfs_fs *fs,
+                const struct sfs_inode *dir,
+                const char *name,
+                uint32_t ino);
+int sfs_dir_remove(struct sfs_fs *fs,
+                   const struct sfs_inode *dir,
+                   const char *name);
+
+/*
+ * File data. sfs_file_map() sets *bno to the physical block of logical block
+ * iblock and *len to the number of blocks mapped contiguously from it. If
+ * iblock is not mapped, *bno is 0 unless create is set: inline data is moved
+ * to a block and extents are allocated until one covers iblock. Reads past
+ * the end of file return 0 bytes, holes read as zeroes. Before writing
+ * [off, end) past the end of file, sfs_file_extend() zeroes what the write
+ * leaves of the allocated blocks it grows the file over, which may hold stale
+ * data; sfs_file_write() does so itself.
+ */
+int sfs_file_map(struct sfs_fs *fs,
+                 struct sfs_inode *inode,
+                 uint32_t iblock,
+                 int create,
+                 uint64_t *bno,
+                 uint32_t *len);
+ssize_t sfs_file_read(struct sfs_fs *fs,
+                      struct sfs_inode *inode,
+                      void *buf,
+                      size_t len,
+                      uint64_t off);
+ssize_t sfs_file_write(struct sfs_fs *fs,
+                       struct sfs_inode *inode,
+                       const void *buf,
+                       size_t len,
+                       uint64_t off);
+int sfs_file_extend(struct sfs_fs *fs,
+                    struct sfs_inode *inode,
+                    uint64_t off,
+                    uint64_t end);
+int sfs_truncate(struct sfs_fs *fs, struct sfs_inode *inode, uint64_t size);
+
+/* Bit i of bitmap map (1 means free) */
+static inline int sfs_test_bit(const uint8_t *map, uint64_t i)
+{
+    return (map[i / 8] >> (i % 8)) & 1;
+}
+
+/* Whether inode ino lies in an inode store region not zeroed yet */
+static inline int sfs_itable_uninit(const struct sfs_fs *fs, uint32_t ino)
+{
+    return fs->itable_uninit &&
+           sfs_test_bit(fs->itable_uninit,
+                        (ino / fs->inodes_per_block) >> fs->itable_region_bits);
+}
+
+#endif /* LIBSIMPLEFS_H */
@@ -1,29 +1,164 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <unistd.h>
 
+#include "libsimplefs.h"
 #include "simplefs.h"
 
+/* Superblock, followed by padding up to block_size bytes */
 struct superblock {
-    struct simplefs_sb_info info;
-    char padding[4064]; /* Padding to match block size */
+    struct simplefs_super_block info;
 };
 
+/* Features requested on the command line (-O) */
+static uint32_t feature_incompat;
+
+/* Block size requested on the command line (-b) */
+static uint32_t block_size = SIMPLEFS_BLOCK_SIZE;
+static uint32_t block_size_bits = SIMPLEFS_BLOCK_SIZE_BITS;
+
+/* Number of inodes (-N), or bytes of the volume per inode (-i), 0 if unset */
+static uint64_t nr_inodes_req;
+static uint64_t bytes_per_inode;
+
+/* Directory to copy into the new file system (-d) */
+static const char *src_dir;
+
+/* Discard the data blocks, unless -K is given */
+static int discard = 1;
+
+/* The disk is a block device, not an image file */
+static int is_blkdev;
+
+/* Metadata is written in batches of this size */
+#define MKFS_BATCH_SIZE (8 << 20)
+
 /* Returns ceil(a/b) */
-static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
+static inline uint64_t idiv_ceil(uint64_t a, uint64_t b)
 {
-    uint32_t ret = a / b;
+    uint64_t ret = a / b;
     if (a % b)
         return ret + 1;
     return ret;
 }
 
+/* Write the `len` bytes of buf at byte off of fd, return 0 or -1 */
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (const char *) buf + ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+/*
+ * Zero `len` bytes at byte off of fd without writing them if possible: image
+ * files get a hole (or unwritten extents), block devices a write-zeroes
+ * request, which thin and SSD devices serve without touching the media.
+ * Otherwise zeroes are written MKFS_BATCH_SIZE bytes at a time.
+ * Return 0 or -1.
+ */
+static int zero_range(int fd, uint64_t off, uint64_t len)
+{
+    uint64_t range[2] = {off, len};
+    size_t n;
+    char *zero;
+    int ret = 0;
+
+    if (!len)
+        return 0;
+    if (is_blkdev) {
+        if (!ioctl(fd, BLKZEROOUT, range))
+            return 0;
+    } else {
+        if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                       len) ||
+            !fallocate(fd, FALLOC_FL_ZERO_RANGE, off, len))
+            return 0;
+    }
+
+    zero = calloc(1, MKFS_BATCH_SIZE);
+    if (!zero)
+        return -1;
+    for (; !ret && len; off += n, len -= n) {
+        n = len < MKFS_BATCH_SIZE ? len : MKFS_BATCH_SIZE;
+        ret = pwrite_full(fd, zero, n, off);
+    }
+    free(zero);
+    return ret;
+}
+
+/*
+ * Tell the storage that `len` bytes at byte off are unused: holes in image
+ * files, discard requests on block devices. Errors are ignored, the blocks
+ * are only unused.
+ */
+static void discard_range(int fd, uint64_t off, uint64_t len)
+{
+    uint64_t range[2] = {off, len};
+
+    if (!len)
+        return;
+    if (is_blkdev)
+        ioctl(fd, BLKDISCARD, range);
+    else
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+}
+
+/*
+ * Write a bitmap of nr_blocks blocks at block start, with the first nr_used
+ * bits cleared (used) and all the others set (free), in batches of
+ * MKFS_BATCH_SIZE bytes. Return 0 or -1.
+ */
+static int write_bitmap(int fd,
+                        uint64_t start,
+                        uint64_t nr_blocks,
+                        uint64_t nr_used)
+{
+    uint64_t len = nr_blocks * block_size, off = 0, used, n;
+    uint8_t *buf = malloc(MKFS_BATCH_SIZE);
+    int ret = 0;
+
+    if (!buf)
+        return -1;
+
+    for (; !ret && off < len; off += n) {
+        n = len - off < MKFS_BATCH_SIZE ? len - off : MKFS_BATCH_SIZE;
+        used = nr_used > off * 8 ? nr_used - off * 8 : 0;
+        if (used > n * 8)
+            used = n * 8;
+
+        memset(buf, 0xff, n);
+        memset(buf, 0, used / 8);
+        if (used % 8)
+            buf[used / 8] = 0xff << (used % 8);
+        ret = pwrite_full(fd, buf, n, start * block_size + off);
+    }
+
+    free(buf);
+    return ret;
+}
+
 /**
  * @brief Initialize Superblock partition, calculate boundary of each partition and metadata information like nr_blocks, nr_inodes etc. 
  * according to the size of the storage device and the size of the various components in the file system.
@@ -37,83 +172,144 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 static struct superblock *write_superblock(int fd, struct stat *fstats)
 {
     /* Allocates a memory area equal in size to the superblock size. */
-    struct superblock *sb = malloc(sizeof(struct superblock));
+    struct superblock *sb = malloc(block_size);
 
     /* If fail */
     if (!sb)
         return NULL;
 
     /* Total number of blocks */
-    uint32_t nr_blocks = fstats->st_size / SIMPLEFS_BLOCK_SIZE;
+    uint64_t nr_blocks = fstats->st_size / block_size;
+
+    /* Block numbers do not fit in 32 bits anymore, switch to 64-bit format */
+    if (nr_blocks > UINT32_MAX &&
+        !(feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT)) {
+        printf("Volume has more than 2^32 blocks, enabling 64bit feature\n");
+        feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_64BIT;
+    }
+    if (nr_blocks > SIMPLEFS_MAX_BLOCKS_64)
+        nr_blocks = SIMPLEFS_MAX_BLOCKS_64;
 
-    /* Total number of inodes */
-    uint32_t nr_inodes = nr_blocks;
+    /* Number of inodes per inode store block */
+    uint32_t inode_size = feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE
+                              ? SIMPLEFS_LARGE_INODE_SIZE
+                              : sizeof(struct simplefs_inode);
+    uint32_t inodes_per_block = SIMPLEFS_INODES_PER_BLOCK(block_size, inode_size);
+
+    /*
+     * Total number of inodes: as requested with -N or -i, one per block by
+     * default. Inode numbers are 32-bit.
+     */
+    uint64_t nr_inodes_want = nr_blocks;
+    if (nr_inodes_req)
+        nr_inodes_want = nr_inodes_req;
+    else if (bytes_per_inode)
+        nr_inodes_want = nr_blocks * block_size / bytes_per_inode;
+    if (nr_inodes_want > UINT32_MAX - UINT32_MAX % inodes_per_block)
+        nr_inodes_want = UINT32_MAX - UINT32_MAX % inodes_per_block;
+    uint32_t nr_inodes = nr_inodes_want ? nr_inodes_want : 1;
 
     /* Remainder of the total number of inodes divided by the number of inodes per block */
-    uint32_t mod = nr_inodes % SIMPLEFS_INODES_PER_BLOCK;
+    uint32_t mod = nr_inodes % inodes_per_block;
 
     /* Rounding the total number of inodes */
     if (mod)
-        nr_inodes += SIMPLEFS_INODES_PER_BLOCK - mod;
+        nr_inodes += inodes_per_block - mod;
 
     /* Number of inode store blocks */    
-    uint32_t nr_istore_blocks = idiv_ceil(nr_inodes, SIMPLEFS_INODES_PER_BLOCK);
+    uint32_t nr_istore_blocks = idiv_ceil(nr_inodes, inodes_per_block);
 
     /* Number of inode free bitmap blocks
-     * Assuming a block size of 1024 bytes, the maximum number of blocks the bitmap can represent: 8 * 1024 = 8192 blocks.  
+     * A bitmap block holds block_size * 8 bits, e.g. 8192 with 1 KiB blocks.
      */
-    uint32_t nr_ifree_blocks = idiv_ceil(nr_inodes, SIMPLEFS_BLOCK_SIZE * 8 ); 
+    uint32_t nr_ifree_blocks = idiv_ceil(nr_inodes, block_size * 8);
 
     /* Number of block free bitmap blocks  */
-    uint32_t nr_bfree_blocks = idiv_ceil(nr_blocks, SIMPLEFS_BLOCK_SIZE * 8); // Assuming a block size of 1024 bytes, the maximum number of blocks the bitmap can represent: 8 * 1024 = 8192 blocks.
+    uint32_t nr_bfree_blocks = idiv_ceil(nr_blocks, block_size * 8);
     
-    /* The block number for the data block is the number of blocks remaining. */
-    uint32_t nr_data_blocks =
-        nr_blocks - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+    /* The metadata must leave room for the root directory at least */
+    if ((uint64_t) nr_istore_blocks + nr_ifree_blocks + nr_bfree_blocks + 2 >=
+        nr_blocks) {
+        fprintf(stderr, "Too many inodes (%u) for %" PRIu64 " blocks\n",
+                nr_inodes, nr_blocks);
+        free(sb);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* The data blocks are the ones remaining after the sb and the metadata */
+    uint64_t nr_data_blocks =
+        nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+
+    /*
+     * Inode store regions left unzeroed with lazy_itable: as small as the
+     * bitmap of regions in block 0 allows. Zeroing the inode store of a block
+     * device is real I/O, proportional to its size, so it is the default
+     * there.
+     */
+    if (is_blkdev)
+        feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE;
+    uint32_t region_bits = 0;
+    while (feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE &&
+           ((nr_istore_blocks - 1) >> region_bits) >=
+               SIMPLEFS_ITABLE_MAX_REGIONS(block_size))
+        region_bits++;
+    uint32_t nr_regions = ((nr_istore_blocks - 1) >> region_bits) + 1;
 
     /* Set all bit of sb to 0 */
-    memset(sb, 0, sizeof(struct superblock));
+    memset(sb, 0, block_size);
 
-    sb->info = (struct simplefs_sb_info){
+    sb->info = (struct simplefs_super_block){
         .magic = htole32(SIMPLEFS_MAGIC), // htole32 convert from host byte order to little-endian order - Little-endian byte ordering places the least significant byte first.
-        .nr_blocks = htole32(nr_blocks),
+        .nr_blocks = htole32((uint32_t) nr_blocks),
         .nr_inodes = htole32(nr_inodes),
         .nr_istore_blocks = htole32(nr_istore_blocks),
         .nr_ifree_blocks = htole32(nr_ifree_blocks),
         .nr_bfree_blocks = htole32(nr_bfree_blocks),
         .nr_free_inodes = htole32(nr_inodes - 1),
-        .nr_free_blocks = htole32(nr_data_blocks - 1),
+        .nr_free_blocks = htole32((uint32_t) (nr_data_blocks - 1)),
+        .feature_incompat = htole32(feature_incompat),
+        .blocksize_bits = htole32(block_size_bits),
     };
+    if (feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT) {
+        sb->info.nr_blocks_hi = htole32(nr_blocks >> 32);
+        sb->info.nr_free_blocks_hi = htole32((nr_data_blocks - 1) >> 32);
+    }
 
-    /**
-     * @brief This function writes length bytes from buffer to the file specified by file descriptor fd. 
-     * This binary-only operation is not buffered. 
-     * Data is written, starting at the current position of the file pointer associated with the given file.
-     * If the file is open for appending, data is written at the end of the file. After the write operation,
-     * the file pointer is increased by the number of bytes written.
-     * @return The number of bytes written. If an error occurs, -1 is returned and errno is set to EBADF (invalid file handle) or ENOSPC (no space left on device).
-     */
-    int ret = write(fd, sb, sizeof(struct superblock));
+    /* Every region but the first one, holding the root inode, is not zeroed */
+    if (feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE) {
+        uint8_t *map = (uint8_t *) sb + SIMPLEFS_ITABLE_MAP_OFFSET;
+        uint32_t i;
+
+        sb->info.itable_region_bits = htole32(region_bits);
+        for (i = 1; i < nr_regions; i++)
+            map[i / 8] |= 1 << (i % 8);
+    }
+
+    /* Write the superblock at block 0 */
+    int ret = pwrite_full(fd, sb, block_size, 0);
 
     /* If fail */
-    if (ret != sizeof(struct superblock)) {
+    if (ret) {
         free(sb);
         return NULL;
     }
 
     printf(
-        "Superblock: (%ld)\n"
+        "Superblock: (%u)\n"
         "\tmagic=%#x\n"
-        "\tnr_blocks=%u\n"
+        "\tblock_size=%u\n"
+        "\tfeature_incompat=%#x\n"
+        "\tnr_blocks=%" PRIu64 "\n"
         "\tnr_inodes=%u (istore=%u blocks)\n"
         "\tnr_ifree_blocks=%u\n"
         "\tnr_bfree_blocks=%u\n"
         "\tnr_free_inodes=%u\n"
-        "\tnr_free_blocks=%u\n",
-        sizeof(struct superblock), sb->info.magic, sb->info.nr_blocks,
-        sb->info.nr_inodes, sb->info.nr_istore_blocks, sb->info.nr_ifree_blocks,
-        sb->info.nr_bfree_blocks, sb->info.nr_free_inodes,
-        sb->info.nr_free_blocks);
+        "\tnr_free_blocks=%" PRIu64 "\n",
+        block_size, sb->info.magic, block_size, sb->info.feature_incompat,
+        nr_blocks, sb->info.nr_inodes, sb->info.nr_istore_blocks,
+        sb->info.nr_ifree_blocks, sb->info.nr_bfree_blocks,
+        sb->info.nr_free_inodes, nr_data_blocks - 1);
 
     return sb;
 }
@@ -129,20 +325,20 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
 static int write_inode_store(int fd, struct superblock *sb)
 {
     /* Allocate a zeroed block for inode store */
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
+    char *block = malloc(block_size);
 
     /* If fail */
     if (!block)
         return -1;
 
     /* Set all bit to 0 */
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
+    memset(block, 0, block_size);
 
     /* Root inode (inode 0) */
     struct simplefs_inode *inode = (struct simplefs_inode *) block;
 
     /* Order of first data block */
-    uint32_t first_data_block = 1 + le32toh(sb->info.nr_bfree_blocks) +
+    uint64_t first_data_block = 1 + (uint64_t) le32toh(sb->info.nr_bfree_blocks) +
                                 le32toh(sb->info.nr_ifree_blocks) +
                                 le32toh(sb->info.nr_istore_blocks); // le32toh convert from little-endian order to host byte order
 
@@ -152,50 +348,43 @@ static int write_inode_store(int fd, struct superblock *sb)
 
     inode->i_uid = 0;
     inode->i_gid = 0;
-    inode->i_size = htole32(SIMPLEFS_BLOCK_SIZE);
+    inode->i_size = htole32(block_size);
     inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
     inode->i_blocks = htole32(1);
     inode->i_nlink = htole32(2); // The first Unix filesystem created two entries in every directory: . pointing to the directory itself, and .. pointing to its parent.
-    inode->ei_block = htole32(first_data_block);
-
-    /**
-     * @brief This function writes length bytes from buffer to the file specified by file descriptor fd. 
-     * This binary-only operation is not buffered. 
-     * Data is written, starting at the current position of the file pointer associated with the given file.
-     * If the file is open for appending, data is written at the end of the file. After the write operation,
-     * the file pointer is increased by the number of bytes written.
-     * @return The number of bytes written. If an error occurs, -1 is returned and errno is set to EBADF (invalid file handle) or ENOSPC (no space left on device).
-     */
-    int ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
+    inode->ei_block = htole32((uint32_t) first_data_block);
+    if (le32toh(sb->info.feature_incompat) & SIMPLEFS_FEATURE_INCOMPAT_64BIT)
+        inode->ei_block_hi = htole32(first_data_block >> 32);
+
+    /* The first block holds the root inode */
+    int ret = pwrite_full(fd, block, block_size, (uint64_t) block_size);
+    if (ret)
         goto end;
-    }
 
-    /* Reset inode store blocks to zero */
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-    uint32_t i;
-    for (i = 1; i < sb->info.nr_istore_blocks; i++) {
-        /**
-         * @brief This function writes length bytes from buffer to the file specified by file descriptor fd. 
-         * This binary-only operation is not buffered. 
-         * Data is written, starting at the current position of the file pointer associated with the given file.
-         * If the file is open for appending, data is written at the end of the file. After the write operation,
-         * the file pointer is increased by the number of bytes written.
-         * @return The number of bytes written. If an error occurs, -1 is returned and errno is set to EBADF (invalid file handle) or ENOSPC (no space left on device).
-         */
-        ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
-        }
-    }
-    ret = 0;
+    /*
+     * All the other inodes are free, zero their blocks in one request. Only
+     * the inode store is zeroed: data blocks are zeroed when allocated. With
+     * lazy_itable, only the first region is, the module zeroes the other ones
+     * when it first allocates an inode there.
+     */
+    uint32_t nr_istore_blocks = le32toh(sb->info.nr_istore_blocks);
+    uint32_t nr_zeroed = nr_istore_blocks;
+    if (le32toh(sb->info.feature_incompat) &
+            SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE &&
+        nr_zeroed >> le32toh(sb->info.itable_region_bits))
+        nr_zeroed = 1U << le32toh(sb->info.itable_region_bits);
+    ret = zero_range(fd, 2 * (uint64_t) block_size,
+                     (uint64_t) (nr_zeroed - 1) * block_size);
+    if (ret)
+        goto end;
 
     printf(
-        "Inode store: wrote %d blocks\n"
-        "\tinode size = %ld B\n",
-        i, sizeof(struct simplefs_inode));
+        "Inode store: wrote %u blocks, %u left to the module\n"
+        "\tinode size = %u B\n",
+        nr_zeroed, nr_istore_blocks - nr_zeroed, le32toh(sb->info.feature_incompat) &
+                   SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE
+               ? SIMPLEFS_LARGE_INODE_SIZE
+               : (unsigned int) sizeof(struct simplefs_inode));
 
 end:
     free(block);
@@ -212,53 +401,16 @@ end:
  */
 static int write_ifree_blocks(int fd, struct superblock *sb)
 {
-    /* Allocate a zeroed block for ifree blocks */
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
+    uint32_t nr_ifree_blocks = le32toh(sb->info.nr_ifree_blocks);
+    uint64_t start = 1 + (uint64_t) le32toh(sb->info.nr_istore_blocks);
 
-    /* If fail */
-    if (!block)
-        return -1;
-
-    uint64_t *ifree = (uint64_t *) block;
-
-    /* Set all bits to 1 */
-    memset(ifree, 0xff, SIMPLEFS_BLOCK_SIZE);
-
-    /* First ifree block, containing first used inode */
-    ifree[0] = htole64(0xfffffffffffffffe);
-
-    /**
-     * @brief This function writes length bytes from buffer to the file specified by file descriptor fd. 
-     * This binary-only operation is not buffered. 
-     * Data is written, starting at the current position of the file pointer associated with the given file.
-     * If the file is open for appending, data is written at the end of the file. After the write operation,
-     * the file pointer is increased by the number of bytes written.
-     * @return The number of bytes written. If an error occurs, -1 is returned and errno is set to EBADF (invalid file handle) or ENOSPC (no space left on device).
-     */
-    int ret = write(fd, ifree, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
-    }
+    int ret = write_bitmap(fd, start, nr_ifree_blocks, 1);
+    if (ret)
+        return ret;
 
-    /* All ifree blocks except the one containing 2 first inodes */
-    ifree[0] = 0xffffffffffffffff;
-    uint32_t i;
-    for (i = 1; i < le32toh(sb->info.nr_ifree_blocks); i++) {
-        ret = write(fd, ifree, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
-        }
-    }
-    ret = 0;
-
-    printf("Ifree blocks: wrote %d blocks\n", i);
-
-end:
-    free(block);
+    printf("Ifree blocks: wrote %u blocks\n", nr_ifree_blocks);
 
-    return ret;
+    return 0;
 }
 
 /**
@@ -270,84 +422,403 @@ end:
  */
 static int write_bfree_blocks(int fd, struct superblock *sb)
 {
-    /* Number of used blocks */
-    uint32_t nr_used = le32toh(sb->info.nr_istore_blocks) +
-                       le32toh(sb->info.nr_ifree_blocks) +
-                       le32toh(sb->info.nr_bfree_blocks) + 2;
-
-    /* Allocate a zeroed block for bfree blocks */
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
-
-    /* If fail */
-    if (!block)
-        return -1;
-    uint64_t *bfree = (uint64_t *) block;
+    uint32_t nr_bfree_blocks = le32toh(sb->info.nr_bfree_blocks);
+    uint64_t start = 1 + (uint64_t) le32toh(sb->info.nr_istore_blocks) +
+                     le32toh(sb->info.nr_ifree_blocks);
 
     /*
-     * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
-     * we suppose it won't go further than the first block
+     * First blocks (incl. sb + istore + ifree + bfree + 1 used block) are
+     * marked used. On large volumes they span several bitmap blocks.
      */
-    memset(bfree, 0xff, SIMPLEFS_BLOCK_SIZE);
-    uint32_t i = 0;
-    while (nr_used) {
-        uint64_t line = 0xffffffffffffffff;
-        for (uint64_t mask = 0x1; mask; mask <<= 1) {
-            line &= ~mask;
-            nr_used--;
-            if (!nr_used)
-                break;
-        }
-        bfree[i] = htole64(line);
-        i++; // i from 0 to nr_bfree_blocks
+    uint64_t nr_used = start + nr_bfree_blocks + 1;
+
+    int ret = write_bitmap(fd, start, nr_bfree_blocks, nr_used);
+    if (ret)
+        return ret;
+
+    printf("Bfree blocks: wrote %u blocks\n", nr_bfree_blocks);
+
+    return 0;
+}
+
+/*
+ * Write the index block of the root directory, the first data block, empty.
+ * The other data blocks are not written at all: the module zeroes blocks when
+ * it allocates them. They are discarded first, unless -K was given.
+ */
+static int write_data_blocks(int fd, struct superblock *sb)
+{
+    uint64_t nr_blocks = le32toh(sb->info.nr_blocks);
+    uint64_t first_data_block = 1 + (uint64_t) le32toh(sb->info.nr_istore_blocks) +
+                                le32toh(sb->info.nr_ifree_blocks) +
+                                le32toh(sb->info.nr_bfree_blocks);
+
+    if (le32toh(sb->info.feature_incompat) & SIMPLEFS_FEATURE_INCOMPAT_64BIT)
+        nr_blocks |= (uint64_t) le32toh(sb->info.nr_blocks_hi) << 32;
+
+    if (discard)
+        discard_range(fd, (first_data_block + 1) * block_size,
+                      (nr_blocks - first_data_block - 1) * block_size);
+
+    return zero_range(fd, first_data_block * block_size, block_size);
+}
+
+/* Files with several links already copied, to link them again (-d) */
+struct populate_link {
+    dev_t dev;
+    ino_t ino;
+    uint32_t sfs_ino;
+};
+
+struct populate {
+    struct sfs_fs fs;
+    struct populate_link *links;
+    size_t nr_links, max_links;
+    char *buf; /* File copy buffer, MKFS_BATCH_SIZE bytes */
+};
+
+/* Copy the attributes of st to inode */
+static void populate_attr(struct sfs_fs *fs,
+                          struct sfs_inode *inode,
+                          const struct stat *st)
+{
+    inode->mode = (inode->mode & S_IFMT) | (st->st_mode & 07777);
+    inode->uid = st->st_uid;
+    inode->gid = st->st_gid;
+    inode->atime = st->st_atim.tv_sec;
+    inode->mtime = st->st_mtim.tv_sec;
+    inode->ctime = st->st_ctim.tv_sec;
+    if (fs->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE) {
+        inode->atime_nsec = st->st_atim.tv_nsec;
+        inode->mtime_nsec = st->st_mtim.tv_nsec;
+        inode->ctime_nsec = st->st_ctim.tv_nsec;
     }
+}
 
-    /**
-     * @brief This function writes length bytes from buffer to the file specified by file descriptor fd. 
-     * This binary-only operation is not buffered. 
-     * Data is written, starting at the current position of the file pointer associated with the given file.
-     * If the file is open for appending, data is written at the end of the file. After the write operation,
-     * the file pointer is increased by the number of bytes written.
-     * @return The number of bytes written. If an error occurs, -1 is returned and errno is set to EBADF (invalid file handle) or ENOSPC (no space left on device).
-     */
-    int ret = write(fd, bfree, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
+/* Copy the content of regular file path to inode, in large sequential writes */
+static int populate_file(struct populate *p,
+                         struct sfs_inode *inode,
+                         const char *path)
+{
+    uint64_t off = 0;
+    ssize_t n, ret = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -errno;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while ((n = read(fd, p->buf, MKFS_BATCH_SIZE)) > 0) {
+        ret = sfs_file_write(&p->fs, inode, p->buf, n, off);
+        if (ret < 0)
+            break;
+        off += n;
     }
+    if (n < 0)
+        ret = -errno;
+    close(fd);
+    return ret < 0 ? ret : 0;
+}
 
-    /* Other blocks */
-    memset(bfree, 0xff, SIMPLEFS_BLOCK_SIZE);
-    for (i = 1; i < le32toh(sb->info.nr_bfree_blocks); i++) {
-        ret = write(fd, bfree, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
-        }
+/*
+ * Copy the entries of directory path into directory dir (inode dino). All the
+ * entries are created first, so that the inodes of a directory are next to
+ * each other and the data of its files follow each other, then the
+ * subdirectories are copied. Entries are copied in name order, so that the
+ * same tree always gives the same image.
+ */
+static int populate_dir(struct populate *p,
+                        struct sfs_inode *dir,
+                        uint32_t dino,
+                        const char *path)
+{
+    struct sfs_fs *fs = &p->fs;
+    struct dirent **names;
+    struct sfs_inode inode;
+    struct stat st;
+    uint32_t ino, *subdirs;
+    char *child = NULL;
+    size_t i, j, nr_subdirs = 0;
+    int n, ret = 0;
+
+    n = scandir(path, &names, NULL, alphasort);
+    if (n < 0)
+        return -errno;
+    subdirs = calloc(n ? n : 1, sizeof(uint32_t));
+    if (!subdirs) {
+        ret = -ENOMEM;
+        goto free_names;
     }
-    ret = 0;
 
-    printf("Bfree blocks: wrote %d blocks\n", i);
-end:
-    free(block);
+    for (i = 0; i < (size_t) n && !ret; i++) {
+        const char *name = names[i]->d_name;
+
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if (strlen(name) >= SIMPLEFS_FILENAME_LEN) {
+            fprintf(stderr, "%s/%s: name too long, skipped\n", path, name);
+            continue;
+        }
+        free(child);
+        if (asprintf(&child, "%s/%s", path, name) < 0) {
+            child = NULL;
+            ret = -ENOMEM;
+            break;
+        }
+        if (lstat(child, &st)) {
+            ret = -errno;
+            break;
+        }
+
+        /* Another link to a file copied already */
+        if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+            for (j = 0; j < p->nr_links; j++) {
+                if (p->links[j].dev == st.st_dev &&
+                    p->links[j].ino == st.st_ino)
+                    break;
+            }
+            if (j < p->nr_links) {
+                ino = p->links[j].sfs_ino;
+                ret = sfs_read_inode(fs, ino, &inode);
+                if (!ret)
+                    ret = sfs_dir_add(fs, dir, name, ino);
+                if (ret)
+                    break;
+                inode.nlink++;
+                ret = sfs_write_inode(fs, ino, &inode);
+                continue;
+            }
+        }
 
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) &&
+            !S_ISLNK(st.st_mode)) {
+            fprintf(stderr, "%s: file type not supported, skipped\n", child);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode) && st.st_size >= fs->inline_len) {
+            fprintf(stderr, "%s: symlink target too long, skipped\n", child);
+            continue;
+        }
+
+        ret = sfs_new_inode(fs, dino, st.st_mode & S_IFMT, &inode, &ino);
+        if (ret)
+            break;
+        populate_attr(fs, &inode, &st);
+
+        if (S_ISREG(st.st_mode)) {
+            ret = populate_file(p, &inode, child);
+        } else if (S_ISLNK(st.st_mode)) {
+            if (readlink(child, inode.data, fs->inline_len - 1) != st.st_size)
+                ret = -EIO;
+            inode.size = st.st_size;
+        }
+        if (!ret)
+            ret = sfs_write_inode(fs, ino, &inode);
+        if (!ret)
+            ret = sfs_dir_add(fs, dir, name, ino);
+        if (ret) {
+            sfs_release_inode(fs, ino, &inode);
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            dir->nlink++;
+            subdirs[nr_subdirs++] = i;
+        } else if (st.st_nlink > 1) {
+            if (p->nr_links == p->max_links) {
+                size_t max = p->max_links ? 2 * p->max_links : 64;
+                struct populate_link *links =
+                    realloc(p->links, max * sizeof(*links));
+
+                if (!links) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                p->links = links;
+                p->max_links = max;
+            }
+            p->links[p->nr_links++] =
+                (struct populate_link){st.st_dev, st.st_ino, ino};
+        }
+    }
+    if (ret)
+        fprintf(stderr, "%s: %s\n", child, strerror(-ret));
+    else
+        ret = sfs_write_inode(fs, dino, dir);
+
+    /* Then the subdirectories, depth first */
+    for (j = 0; j < nr_subdirs && !ret; j++) {
+        const char *name = names[subdirs[j]]->d_name;
+
+        free(child);
+        if (asprintf(&child, "%s/%s", path, name) < 0) {
+            child = NULL;
+            ret = -ENOMEM;
+            break;
+        }
+        ret = sfs_dir_lookup(fs, dir, name, &ino);
+        if (!ret)
+            ret = sfs_read_inode(fs, ino, &inode);
+        if (!ret)
+            ret = populate_dir(p, &inode, ino, child);
+    }
+
+    free(child);
+    free(subdirs);
+free_names:
+    for (i = 0; i < (size_t) n; i++)
+        free(names[i]);
+    free(names);
     return ret;
 }
 
-static int write_data_blocks(int fd, struct superblock *sb)
+/*
+ * Copy the tree under directory src into the file system just created on
+ * disk, in one pass. The root directory takes the attributes of src.
+ * Return 0 or -1.
+ */
+static int populate(const char *disk, const char *src)
 {
-    /* FIXME: unimplemented */
+    struct populate p = {0};
+    struct sfs_inode root;
+    struct stat st;
+    int ret;
+
+    if (stat(src, &st)) {
+        perror(src);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", src);
+        return -1;
+    }
+
+    ret = sfs_open(&p.fs, disk, 1);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", disk, strerror(-ret));
+        return -1;
+    }
+    p.buf = malloc(MKFS_BATCH_SIZE);
+    if (!p.buf)
+        ret = -ENOMEM;
+    if (!ret)
+        ret = sfs_load_bitmaps(&p.fs);
+    if (!ret)
+        ret = sfs_read_inode(&p.fs, SFS_ROOT_INO, &root);
+    if (!ret) {
+        populate_attr(&p.fs, &root, &st);
+        ret = populate_dir(&p, &root, SFS_ROOT_INO, src);
+    }
+
+    free(p.buf);
+    free(p.links);
+    if (!ret)
+        ret = sfs_close(&p.fs);
+    else
+        sfs_close(&p.fs);
+    if (ret) {
+        fprintf(stderr, "Cannot copy %s: %s\n", src, strerror(-ret));
+        return -1;
+    }
+
+    printf("Copied %s: %" PRIu64 " inodes, %" PRIu64 " blocks used\n", src,
+           p.fs.nr_inodes - p.fs.nr_free_inodes,
+           p.fs.nr_blocks - p.fs.nr_free_blocks);
     return 0;
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b block_size] [-i bytes_per_inode | -N inodes]\n"
+            "       [-O feature] [-K] [-d dir] disk\n"
+            "  -b size   block size in bytes, a power of two from %d to %d\n"
+            "            (default %d)\n"
+            "  -i bytes  create an inode for every `bytes` bytes of the volume\n"
+            "            (default: one per block)\n"
+            "  -N count  create `count` inodes\n"
+            "  -O 64bit  use 64-bit block numbers (default if the volume has\n"
+            "            more than 2^32 blocks)\n"
+            "  -O large_inode\n"
+            "            use 256-byte inodes, with 64-bit timestamps in\n"
+            "            nanoseconds\n"
+            "  -O lazy_itable\n"
+            "            leave the inode store to be zeroed by the module on\n"
+            "            first use (default on block devices)\n"
+            "  -K        do not discard the data blocks\n"
+            "  -d dir    copy the files under dir into the file system\n",
+            prog, SIMPLEFS_MIN_BLOCK_SIZE, 1 << SIMPLEFS_MAX_BLOCK_SIZE_BITS,
+            SIMPLEFS_BLOCK_SIZE);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s disk\n", argv[0]);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:N:O:Kd:")) != -1) {
+        switch (opt) {
+        case 'b':
+            for (block_size_bits = SIMPLEFS_MIN_BLOCK_SIZE_BITS;
+                 block_size_bits <= SIMPLEFS_MAX_BLOCK_SIZE_BITS;
+                 block_size_bits++) {
+                if (strtoul(optarg, NULL, 0) == 1UL << block_size_bits)
+                    break;
+            }
+            if (block_size_bits <= SIMPLEFS_MAX_BLOCK_SIZE_BITS) {
+                block_size = 1U << block_size_bits;
+                break;
+            }
+            fprintf(stderr, "Invalid block size: %s\n", optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 'O':
+            if (!strcmp(optarg, "64bit")) {
+                feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_64BIT;
+                break;
+            }
+            if (!strcmp(optarg, "large_inode")) {
+                feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE;
+                break;
+            }
+            if (!strcmp(optarg, "lazy_itable")) {
+                feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE;
+                break;
+            }
+            fprintf(stderr, "Unknown feature: %s\n", optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 'i':
+            bytes_per_inode = strtoull(optarg, NULL, 0);
+            if (bytes_per_inode >= SIMPLEFS_MIN_BLOCK_SIZE)
+                break;
+            fprintf(stderr, "Invalid bytes per inode: %s (min %d)\n", optarg,
+                    SIMPLEFS_MIN_BLOCK_SIZE);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 'N':
+            nr_inodes_req = strtoull(optarg, NULL, 0);
+            if (nr_inodes_req)
+                break;
+            fprintf(stderr, "Invalid number of inodes: %s\n", optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 'K':
+            discard = 0;
+            break;
+        case 'd':
+            src_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
     /* Open disk image */
-    int fd = open(argv[1], O_RDWR);
+    int fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("open():");
         return EXIT_FAILURE;
@@ -367,8 +838,9 @@ int main(int argc, char **argv)
     }
 
     /* Get block device size */
-    if ((stat_buf.st_mode & S_IFMT) == S_IFBLK) {
-        long int blk_size = 0;
+    is_blkdev = (stat_buf.st_mode & S_IFMT) == S_IFBLK;
+    if (is_blkdev) {
+        uint64_t blk_size = 0;
         /**
          * @brief The ioctl() system call manipulates the underlying device
          * parameters of special files.  In particular, many operating
@@ -388,7 +860,7 @@ int main(int argc, char **argv)
     }
 
     /* Check if image is large enough */
-    long int min_size = 100 * SIMPLEFS_BLOCK_SIZE;
+    long int min_size = 100 * (long int) block_size;
     if (stat_buf.st_size <= min_size) {
         fprintf(stderr, "File is not large enough (size=%ld, min size=%ld)\n",
                 stat_buf.st_size, min_size);
@@ -436,6 +908,10 @@ int main(int argc, char **argv)
         goto free_sb;
     }
 
+    /* Copy the source tree, through the image as written so far */
+    if (src_dir && (fsync(fd) || populate(argv[optind], src_dir)))
+        ret = EXIT_FAILURE;
+
 free_sb:
     free(sb);
 fclose:
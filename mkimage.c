@@ -0,0 +1,852 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+/*
+ * mkimage.simplefs: build a simplefs image from a directory tree, without the
+ * kernel module. The tree is scanned first and the whole layout is decided in
+ * memory; the image is then written from its first block to its last in
+ * large sequential writes:
+ *
+ *   superblock | inode store | ifree | bfree | dir, its files, next dir, ...
+ *
+ * Directories are laid out breadth first: the entries of a directory get
+ * consecutive inodes, and its index and entry blocks are followed by the
+ * data of its files, each file in one contiguous run of blocks.
+ */
+
+/* Size of the write buffers, one is filled while the other is written */
+#define MKIMAGE_BUF_SIZE (8 << 20)
+
+/* An entry of the source tree */
+struct node {
+    char *path;       /* Source path */
+    const char *name; /* Entry name, in path */
+    struct stat st;
+    uint32_t ino;      /* simplefs inode */
+    uint32_t nlink;    /* Entries pointing to it in the tree */
+    int64_t link;      /* Node this one is a hard link to, -1 otherwise */
+    uint64_t children; /* Directories: first entry in nodes[] */
+    uint32_t nr_children;
+    uint32_t nr_subdirs;
+    uint64_t ei_block;  /* Index block, 0 if none */
+    uint64_t nr_blocks; /* Blocks following the index block */
+};
+
+/* Image being written, sequentially */
+struct out {
+    int fd;
+    uint64_t off; /* Image offset of buf */
+    char *buf;    /* Buffer being filled */
+    size_t len;
+
+    /* Buffer being written by the writer thread */
+    char *wbuf;
+    size_t wlen;
+    uint64_t woff;
+    pthread_t writer;
+    int writing;
+    int err;
+};
+
+static struct sfs_fs fs; /* Geometry of the image */
+static struct node *nodes;
+static uint64_t nr_nodes, max_nodes;
+static uint32_t nr_used_inodes;
+static uint64_t data_end; /* First block after the data */
+
+/* Command line */
+static uint32_t block_size_bits = SIMPLEFS_BLOCK_SIZE_BITS;
+static uint32_t feature_incompat;
+static uint64_t nr_inodes_req;
+static uint64_t image_size;
+
+/* Append a node for path, return its index or -1 */
+static int64_t add_node(char *path, const char *name, const struct stat *st)
+{
+    if (nr_nodes == max_nodes) {
+        uint64_t max = max_nodes ? 2 * max_nodes : 1024;
+        struct node *n = realloc(nodes, max * sizeof(*n));
+
+        if (!n)
+            return -1;
+        nodes = n;
+        max_nodes = max;
+    }
+    nodes[nr_nodes] = (struct node){
+        .path = path,
+        .name = name,
+        .st = *st,
+        .nlink = 1,
+        .link = -1,
+    };
+    return nr_nodes++;
+}
+
+/*
+ * Return the node already seen for the file of st, which has several links,
+ * or -1. Hard links are rare enough for a linear search on the ones seen.
+ */
+static int64_t find_link(int64_t *links, uint64_t nr_links, const struct stat *st)
+{
+    uint64_t i;
+
+    for (i = 0; i < nr_links; i++) {
+        if (nodes[links[i]].st.st_dev == st->st_dev &&
+            nodes[links[i]].st.st_ino == st->st_ino)
+            return links[i];
+    }
+    return -1;
+}
+
+/*
+ * Scan the tree under src breadth first: nodes[] is the queue, the entries of
+ * each directory being appended together, in name order.
+ */
+static int scan(const char *src)
+{
+    int64_t *links = NULL, link;
+    uint64_t nr_links = 0, i;
+    struct dirent **names;
+    struct stat st;
+    char *path;
+    int n, j, ret = 0;
+
+    if (stat(src, &st) || !(path = strdup(src)))
+        return -errno;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+    if (add_node(path, "", &st) < 0)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_nodes && !ret; i++) {
+        if (!S_ISDIR(nodes[i].st.st_mode) || nodes[i].link >= 0)
+            continue;
+        n = scandir(nodes[i].path, &names, NULL, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "%s: %s\n", nodes[i].path, strerror(errno));
+            return -errno;
+        }
+        nodes[i].children = nr_nodes;
+
+        for (j = 0; j < n; j++) {
+            const char *name = names[j]->d_name;
+
+            if (ret || !strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+            if (asprintf(&path, "%s/%s", nodes[i].path, name) < 0) {
+                ret = -ENOMEM;
+                continue;
+            }
+            if (lstat(path, &st)) {
+                ret = -errno;
+                fprintf(stderr, "%s: %s\n", path, strerror(errno));
+                free(path);
+                continue;
+            }
+            if (strlen(name) >= SIMPLEFS_FILENAME_LEN) {
+                fprintf(stderr, "%s: name too long, skipped\n", path);
+                free(path);
+                continue;
+            }
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) &&
+                !S_ISLNK(st.st_mode)) {
+                fprintf(stderr, "%s: file type not supported, skipped\n",
+                        path);
+                free(path);
+                continue;
+            }
+            if (S_ISLNK(st.st_mode) && st.st_size >= fs.inline_len) {
+                fprintf(stderr, "%s: symlink target too long, skipped\n",
+                        path);
+                free(path);
+                continue;
+            }
+
+            link = -1;
+            if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+                link = find_link(links, nr_links, &st);
+            if (add_node(path, path + strlen(nodes[i].path) + 1, &st) < 0) {
+                free(path);
+                ret = -ENOMEM;
+                continue;
+            }
+            nodes[i].nr_children++;
+            if (S_ISDIR(st.st_mode))
+                nodes[i].nr_subdirs++;
+
+            if (link >= 0) {
+                nodes[nr_nodes - 1].link = link;
+                nodes[link].nlink++;
+            } else if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+                int64_t *l = realloc(links, (nr_links + 1) * sizeof(*l));
+
+                if (!l) {
+                    ret = -ENOMEM;
+                    continue;
+                }
+                links = l;
+                links[nr_links++] = nr_nodes - 1;
+            }
+        }
+
+        for (j = 0; j < n; j++)
+            free(names[j]);
+        free(names);
+
+        if (!ret && nodes[i].nr_children > SIMPLEFS_MAX_SUBFILES(fs.block_size)) {
+            fprintf(stderr, "%s: too many entries (max %zu)\n", nodes[i].path,
+                    SIMPLEFS_MAX_SUBFILES(fs.block_size));
+            ret = -EMLINK;
+        }
+    }
+
+    free(links);
+    return ret;
+}
+
+/* Whether node n is a regular file stored in its inode */
+static inline int is_inline(const struct node *n)
+{
+    return S_ISREG(n->st.st_mode) && (uint64_t) n->st.st_size <= fs.inline_len;
+}
+
+/* Whether node n gets blocks: directories and regular files past inline */
+static inline int has_blocks(const struct node *n)
+{
+    return n->link < 0 && (S_ISDIR(n->st.st_mode) ||
+                           (S_ISREG(n->st.st_mode) && !is_inline(n)));
+}
+
+/* Number of extents of SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks to hold nr */
+static inline uint64_t nr_extents(uint64_t nr)
+{
+    return (nr + SIMPLEFS_MAX_BLOCKS_PER_EXTENT - 1) /
+           SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+}
+
+/*
+ * Set the number of blocks following the index block of node n: entry blocks
+ * of a directory, in full extents as the module allocates them, or data
+ * blocks of a file, whose last extent is cut to its end.
+ */
+static int size_node(struct node *n)
+{
+    if (S_ISDIR(n->st.st_mode)) {
+        n->nr_blocks = nr_extents((n->nr_children + fs.files_per_block - 1) /
+                                  fs.files_per_block) *
+                       SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        return 0;
+    }
+
+    n->nr_blocks = ((uint64_t) n->st.st_size + fs.block_size - 1) >>
+                   fs.blocksize_bits;
+    if (nr_extents(n->nr_blocks) > fs.max_extents) {
+        fprintf(stderr, "%s: file too large (max %" PRIu64 " bytes)\n",
+                n->path, (uint64_t) SIMPLEFS_MAX_FILESIZE(fs.block_size));
+        return -EFBIG;
+    }
+    return 0;
+}
+
+/*
+ * Number the inodes in node order, then compute the geometry of the image
+ * and place the blocks of each directory followed by the ones of its files.
+ */
+static int layout(void)
+{
+    uint64_t i, c, nr_data = 0, next;
+    uint32_t ino = 0, max_inodes;
+    int ret;
+
+    for (i = 0; i < nr_nodes; i++) {
+        struct node *n = &nodes[i];
+
+        n->ino = n->link < 0 ? ino++ : nodes[n->link].ino;
+        if (!has_blocks(n))
+            continue;
+        ret = size_node(n);
+        if (ret)
+            return ret;
+        nr_data += 1 + n->nr_blocks;
+    }
+    nr_used_inodes = ino;
+
+    /* Inodes: the ones used and the number asked for, in full blocks */
+    max_inodes = UINT32_MAX - UINT32_MAX % fs.inodes_per_block;
+    if (nr_nodes > max_inodes) {
+        fprintf(stderr, "Too many files (%" PRIu64 ")\n", nr_nodes);
+        return -ENOSPC;
+    }
+    fs.nr_inodes = nr_inodes_req > max_inodes ? max_inodes : nr_inodes_req;
+    if (fs.nr_inodes < nr_used_inodes)
+        fs.nr_inodes = nr_used_inodes;
+    fs.nr_inodes += (fs.inodes_per_block - fs.nr_inodes % fs.inodes_per_block) %
+                    fs.inodes_per_block;
+    fs.nr_istore_blocks = fs.nr_inodes / fs.inodes_per_block;
+    fs.nr_ifree_blocks =
+        (fs.nr_inodes + fs.block_size * 8 - 1) / (fs.block_size * 8);
+
+    /* Blocks: the image size, or just what the tree needs */
+    next = 1 + (uint64_t) fs.nr_istore_blocks + fs.nr_ifree_blocks + nr_data;
+    if (image_size) {
+        fs.nr_blocks = image_size >> fs.blocksize_bits;
+        if (fs.nr_blocks > SIMPLEFS_MAX_BLOCKS_64)
+            fs.nr_blocks = SIMPLEFS_MAX_BLOCKS_64;
+    } else {
+        do {
+            fs.nr_blocks = next + fs.nr_bfree_blocks;
+            fs.nr_bfree_blocks = (fs.nr_blocks + fs.block_size * 8 - 1) /
+                                 (fs.block_size * 8);
+        } while (fs.nr_blocks != next + fs.nr_bfree_blocks);
+    }
+    fs.nr_bfree_blocks =
+        (fs.nr_blocks + fs.block_size * 8 - 1) / (fs.block_size * 8);
+    if (next + fs.nr_bfree_blocks > fs.nr_blocks) {
+        fprintf(stderr, "Image too small: %" PRIu64 " blocks needed\n",
+                next + fs.nr_bfree_blocks);
+        return -ENOSPC;
+    }
+    if (fs.nr_blocks > UINT32_MAX &&
+        !(fs.feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT)) {
+        fprintf(stderr, "More than 2^32 blocks, use -O 64bit\n");
+        return -EFBIG;
+    }
+
+    /* Directories breadth first, each followed by its files */
+    next = sfs_data_start(&fs);
+    for (i = 0; i < nr_nodes; i++) {
+        struct node *n = &nodes[i];
+
+        if (!S_ISDIR(n->st.st_mode) || n->link >= 0)
+            continue;
+        n->ei_block = next;
+        next += 1 + n->nr_blocks;
+        for (c = n->children; c < n->children + n->nr_children; c++) {
+            if (S_ISDIR(nodes[c].st.st_mode) || !has_blocks(&nodes[c]))
+                continue;
+            nodes[c].ei_block = next;
+            next += 1 + nodes[c].nr_blocks;
+        }
+    }
+    data_end = next;
+    fs.nr_free_inodes = fs.nr_inodes - nr_used_inodes;
+    fs.nr_free_blocks = fs.nr_blocks - data_end;
+
+    return 0;
+}
+
+/* Write `len` bytes of buf at byte off of fd, return 0 or -errno */
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret < 0 ? -errno : -EIO;
+        buf = (const char *) buf + ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static void *out_writer(void *arg)
+{
+    struct out *o = arg;
+
+    o->err = pwrite_full(o->fd, o->wbuf, o->wlen, o->woff);
+    return NULL;
+}
+
+/* Wait for the buffer being written, return 0 or -errno */
+static int out_wait(struct out *o)
+{
+    if (o->writing) {
+        pthread_join(o->writer, NULL);
+        o->writing = 0;
+    }
+    return o->err;
+}
+
+/*
+ * Hand the buffer filled so far to the writer thread, and go on with the
+ * other one. Return 0 or -errno from a previous write.
+ */
+static int out_flush(struct out *o)
+{
+    char *buf;
+    int ret = out_wait(o);
+
+    if (ret || !o->len)
+        return ret;
+
+    buf = o->wbuf;
+    o->wbuf = o->buf;
+    o->wlen = o->len;
+    o->woff = o->off;
+    o->buf = buf;
+    o->off += o->len;
+    o->len = 0;
+
+    if (pthread_create(&o->writer, NULL, out_writer, o))
+        out_writer(o);
+    else
+        o->writing = 1;
+    return 0;
+}
+
+/*
+ * Return room for `len` bytes (at most MKIMAGE_BUF_SIZE) at the current end
+ * of the image, zeroed if asked, and count them as written.
+ */
+static char *out_get(struct out *o, size_t len, int zero)
+{
+    char *p;
+
+    if (o->len + len > MKIMAGE_BUF_SIZE && out_flush(o))
+        return NULL;
+    p = o->buf + o->len;
+    o->len += len;
+    if (zero)
+        memset(p, 0, len);
+    return p;
+}
+
+/* Fill the on-disk inode of node n at raw */
+static int encode_node(struct node *n, void *raw)
+{
+    struct sfs_inode inode = {
+        .mode = n->st.st_mode & (S_IFMT | 07777),
+        .uid = n->st.st_uid,
+        .gid = n->st.st_gid,
+        .nlink = n->nlink,
+        .size = n->st.st_size,
+        .ei_block = n->ei_block,
+        .ctime = n->st.st_ctim.tv_sec,
+        .atime = n->st.st_atim.tv_sec,
+        .mtime = n->st.st_mtim.tv_sec,
+    };
+    int fd, ret = 0;
+
+    if (fs.feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE) {
+        inode.ctime_nsec = n->st.st_ctim.tv_nsec;
+        inode.atime_nsec = n->st.st_atim.tv_nsec;
+        inode.mtime_nsec = n->st.st_mtim.tv_nsec;
+    }
+
+    if (S_ISDIR(n->st.st_mode)) {
+        inode.nlink = 2 + n->nr_subdirs;
+        inode.size = fs.block_size;
+        inode.blocks = 1;
+    } else if (S_ISLNK(n->st.st_mode)) {
+        if (readlink(n->path, inode.data, fs.inline_len - 1) != n->st.st_size)
+            ret = -EIO;
+    } else if (is_inline(n)) {
+        inode.flags = SIMPLEFS_INODE_INLINE;
+        fd = open(n->path, O_RDONLY);
+        if (fd < 0 || read(fd, inode.data, n->st.st_size) < 0)
+            ret = -errno;
+        if (fd >= 0)
+            close(fd);
+    } else {
+        inode.blocks = (inode.size >> fs.blocksize_bits) + 2;
+    }
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", n->path, strerror(-ret));
+        return ret;
+    }
+
+    sfs_encode_inode(&fs, &inode, raw);
+    return 0;
+}
+
+/* Write the superblock, the inode store and both bitmaps */
+static int write_metadata(struct out *o)
+{
+    struct simplefs_super_block *sb;
+    uint64_t i, n = 0, b, nr_bits;
+    uint32_t j;
+    uint8_t *map;
+    char *block;
+    int ret;
+
+    sb = (struct simplefs_super_block *) out_get(o, fs.block_size, 1);
+    if (!sb)
+        return o->err;
+    sb->magic = htole32(SIMPLEFS_MAGIC);
+    sb->nr_blocks = htole32((uint32_t) fs.nr_blocks);
+    sb->nr_inodes = htole32(fs.nr_inodes);
+    sb->nr_istore_blocks = htole32(fs.nr_istore_blocks);
+    sb->nr_ifree_blocks = htole32(fs.nr_ifree_blocks);
+    sb->nr_bfree_blocks = htole32(fs.nr_bfree_blocks);
+    sb->nr_free_inodes = htole32((uint32_t) fs.nr_free_inodes);
+    sb->nr_free_blocks = htole32((uint32_t) fs.nr_free_blocks);
+    sb->feature_incompat = htole32(fs.feature_incompat);
+    sb->blocksize_bits = htole32(fs.blocksize_bits);
+    if (fs.feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT) {
+        sb->nr_blocks_hi = htole32(fs.nr_blocks >> 32);
+        sb->nr_free_blocks_hi = htole32(fs.nr_free_blocks >> 32);
+    }
+
+    /* Inode store, inode numbers follow the nodes which are not links */
+    for (b = 0; b < fs.nr_istore_blocks; b++) {
+        block = out_get(o, fs.block_size, 1);
+        if (!block)
+            return o->err;
+        for (j = 0; j < fs.inodes_per_block; j++) {
+            while (n < nr_nodes && nodes[n].link >= 0)
+                n++;
+            if (n == nr_nodes)
+                break;
+            ret = encode_node(&nodes[n++], block + j * fs.inode_size);
+            if (ret)
+                return ret;
+        }
+    }
+
+    /* Bitmaps, the used inodes and blocks are the first ones */
+    for (i = 0; i < fs.nr_ifree_blocks + fs.nr_bfree_blocks; i++) {
+        map = (uint8_t *) out_get(o, fs.block_size, 0);
+        if (!map)
+            return o->err;
+        memset(map, 0xff, fs.block_size);
+        b = i < fs.nr_ifree_blocks ? i : i - fs.nr_ifree_blocks;
+        nr_bits = i < fs.nr_ifree_blocks ? nr_used_inodes : data_end;
+        for (j = 0; j < fs.block_size * 8 &&
+                    b * fs.block_size * 8 + j < nr_bits;
+             j++)
+            map[j / 8] &= ~(1 << (j % 8));
+    }
+
+    return 0;
+}
+
+/* Write the index block of node n, mapping the blocks which follow it */
+static int write_index(struct out *o, const struct node *n)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint64_t e, start;
+
+    index = (struct simplefs_file_ei_block *) out_get(o, fs.block_size, 1);
+    if (!index)
+        return o->err;
+    if (S_ISDIR(n->st.st_mode))
+        index->nr_files = htole32(n->nr_children);
+    for (e = 0; e < nr_extents(n->nr_blocks); e++) {
+        ext = &index->extents[e];
+        start = n->ei_block + 1 + e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        ext->ee_block = htole32(e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+        ext->ee_len = htole16(n->nr_blocks - e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT <
+                                      SIMPLEFS_MAX_BLOCKS_PER_EXTENT
+                                  ? n->nr_blocks -
+                                        e * SIMPLEFS_MAX_BLOCKS_PER_EXTENT
+                                  : SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+        ext->ee_start = htole32((uint32_t) start);
+        ext->ee_start_hi = htole16(start >> 32);
+    }
+    return 0;
+}
+
+/* Write the entry blocks of directory n, packed */
+static int write_entries(struct out *o, const struct node *n)
+{
+    struct simplefs_dir_block *dblock;
+    uint64_t b, pos;
+    uint32_t f;
+
+    for (b = 0; b < n->nr_blocks; b++) {
+        dblock = (struct simplefs_dir_block *) out_get(o, fs.block_size, 1);
+        if (!dblock)
+            return o->err;
+        for (f = 0; f < fs.files_per_block; f++) {
+            pos = b * fs.files_per_block + f;
+            if (pos >= n->nr_children)
+                break;
+            dblock->files[f].inode = htole32(nodes[n->children + pos].ino);
+            strncpy(dblock->files[f].filename, nodes[n->children + pos].name,
+                    SIMPLEFS_FILENAME_LEN);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy the content of file n, read straight into the write buffer, and pad
+ * its last block with zeroes. A file which changed size since the scan is cut
+ * or padded to the size it had.
+ */
+static int write_data(struct out *o, const struct node *n)
+{
+    uint64_t left = n->st.st_size, len = n->nr_blocks << fs.blocksize_bits;
+    size_t room;
+    ssize_t ret = 0;
+    char *p;
+    int fd;
+
+    fd = open(n->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", n->path, strerror(errno));
+        return -errno;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (left) {
+        if (o->len == MKIMAGE_BUF_SIZE && out_flush(o))
+            break;
+        room = MKIMAGE_BUF_SIZE - o->len;
+        if (room > left)
+            room = left;
+        ret = read(fd, o->buf + o->len, room);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            ret = -errno;
+            fprintf(stderr, "%s: %s\n", n->path, strerror(errno));
+            break;
+        }
+        if (!ret) {
+            memset(o->buf + o->len, 0, room);
+            ret = room;
+        }
+        o->len += ret;
+        left -= ret;
+    }
+    close(fd);
+    if (ret < 0 || o->err)
+        return ret < 0 ? ret : o->err;
+
+    p = out_get(o, len - n->st.st_size, 1);
+    return p ? 0 : o->err;
+}
+
+/* Write the blocks of the directories and files, in the order of layout() */
+static int write_data_blocks(struct out *o)
+{
+    uint64_t i, c;
+    int ret;
+
+    for (i = 0; i < nr_nodes; i++) {
+        struct node *n = &nodes[i];
+
+        if (!S_ISDIR(n->st.st_mode) || n->link >= 0)
+            continue;
+        ret = write_index(o, n);
+        if (!ret)
+            ret = write_entries(o, n);
+        for (c = n->children; !ret && c < n->children + n->nr_children; c++) {
+            if (S_ISDIR(nodes[c].st.st_mode) || !has_blocks(&nodes[c]))
+                continue;
+            ret = write_index(o, &nodes[c]);
+            if (!ret)
+                ret = write_data(o, &nodes[c]);
+        }
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Parse a size in bytes, with an optional K, M, G or T suffix */
+static uint64_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+
+    switch (*end) {
+    case 'T':
+    case 't':
+        size <<= 10;
+        /* fallthrough */
+    case 'G':
+    case 'g':
+        size <<= 10;
+        /* fallthrough */
+    case 'M':
+    case 'm':
+        size <<= 10;
+        /* fallthrough */
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+    }
+    return *end ? 0 : size;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b block_size] [-N inodes] [-O feature] [-s size] "
+            "dir image\n"
+            "  -b size   block size in bytes, a power of two from %d to %d\n"
+            "            (default %d)\n"
+            "  -N count  create at least `count` inodes (default: just the\n"
+            "            ones used)\n"
+            "  -O 64bit  use 64-bit block numbers\n"
+            "  -O large_inode\n"
+            "            use 256-byte inodes, with 64-bit timestamps in\n"
+            "            nanoseconds\n"
+            "  -s size   size of the image, with an optional K, M, G or T\n"
+            "            suffix (default: the size of an existing image or\n"
+            "            device, else just what the tree needs)\n",
+            prog, SIMPLEFS_MIN_BLOCK_SIZE, 1 << SIMPLEFS_MAX_BLOCK_SIZE_BITS,
+            SIMPLEFS_BLOCK_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    struct out out = {.fd = -1};
+    struct stat st;
+    int opt, ret, is_blkdev;
+
+    while ((opt = getopt(argc, argv, "b:N:O:s:")) != -1) {
+        switch (opt) {
+        case 'b':
+            for (block_size_bits = SIMPLEFS_MIN_BLOCK_SIZE_BITS;
+                 block_size_bits <= SIMPLEFS_MAX_BLOCK_SIZE_BITS;
+                 block_size_bits++) {
+                if (strtoul(optarg, NULL, 0) == 1UL << block_size_bits)
+                    break;
+            }
+            if (block_size_bits <= SIMPLEFS_MAX_BLOCK_SIZE_BITS)
+                break;
+            fprintf(stderr, "Invalid block size: %s\n", optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 'N':
+            nr_inodes_req = strtoull(optarg, NULL, 0);
+            break;
+        case 'O':
+            if (!strcmp(optarg, "64bit")) {
+                feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_64BIT;
+                break;
+            }
+            if (!strcmp(optarg, "large_inode")) {
+                feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE;
+                break;
+            }
+            fprintf(stderr, "Unknown feature: %s\n", optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        case 's':
+            image_size = parse_size(optarg);
+            if (image_size)
+                break;
+            fprintf(stderr, "Invalid size: %s\n", optarg);
+            /* fallthrough */
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    out.fd = open(argv[optind + 1], O_RDWR | O_CREAT, 0644);
+    if (out.fd < 0 || fstat(out.fd, &st)) {
+        perror(argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    is_blkdev = S_ISBLK(st.st_mode);
+    if (is_blkdev) {
+        if (ioctl(out.fd, BLKGETSIZE64, &image_size)) {
+            perror("BLKGETSIZE64");
+            goto close_fd;
+        }
+    } else if (!image_size) {
+        image_size = st.st_size;
+    }
+
+    /* Geometry which does not depend on the tree, needed to scan it */
+    if (image_size >> block_size_bits > UINT32_MAX)
+        feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_64BIT;
+    fs.feature_incompat = feature_incompat;
+    fs.blocksize_bits = block_size_bits;
+    fs.block_size = 1U << block_size_bits;
+    fs.inode_size = feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE
+                        ? SIMPLEFS_LARGE_INODE_SIZE
+                        : sizeof(struct simplefs_inode);
+    fs.inodes_per_block = SIMPLEFS_INODES_PER_BLOCK(fs.block_size, fs.inode_size);
+    fs.max_extents = SIMPLEFS_MAX_EXTENTS(fs.block_size);
+    fs.files_per_block = SIMPLEFS_FILES_PER_BLOCK(fs.block_size);
+    fs.inline_len = feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_64BIT
+                        ? SIMPLEFS_INLINE_DATA_LEN_64
+                        : SIMPLEFS_INLINE_DATA_LEN;
+
+    ret = scan(argv[optind]);
+    if (ret) {
+        fprintf(stderr, "Cannot scan %s: %s\n", argv[optind], strerror(-ret));
+        goto close_fd;
+    }
+    if (layout())
+        goto close_fd;
+
+    /* Image files get their size, and a hole past the data */
+    if (!is_blkdev &&
+        (ftruncate(out.fd, fs.nr_blocks << fs.blocksize_bits) ||
+         (fs.nr_blocks > data_end &&
+          fallocate(out.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    data_end << fs.blocksize_bits,
+                    (fs.nr_blocks - data_end) << fs.blocksize_bits) &&
+          errno != EOPNOTSUPP))) {
+        perror(argv[optind + 1]);
+        goto close_fd;
+    }
+
+    out.buf = malloc(MKIMAGE_BUF_SIZE);
+    out.wbuf = malloc(MKIMAGE_BUF_SIZE);
+    if (!out.buf || !out.wbuf) {
+        fprintf(stderr, "Out of memory\n");
+        goto free_bufs;
+    }
+    ret = write_metadata(&out);
+    if (!ret)
+        ret = write_data_blocks(&out);
+    if (!ret)
+        ret = out_flush(&out);
+    if (!ret)
+        ret = out_wait(&out);
+    if (!ret && fsync(out.fd))
+        ret = -errno;
+    out_wait(&out);
+    if (ret) {
+        fprintf(stderr, "Cannot write %s: %s\n", argv[optind + 1],
+                strerror(-ret));
+        goto free_bufs;
+    }
+
+    printf("%s: %u/%u inodes, %" PRIu64 "/%" PRIu64 " blocks of %u bytes\n",
+           argv[optind + 1], nr_used_inodes, fs.nr_inodes, data_end,
+           fs.nr_blocks, fs.block_size);
+    free(out.buf);
+    free(out.wbuf);
+    close(out.fd);
+    return EXIT_SUCCESS;
+
+free_bufs:
+    free(out.buf);
+    free(out.wbuf);
+close_fd:
+    close(out.fd);
+    return EXIT_FAILURE;
+}
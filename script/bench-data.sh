@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+
+# Data path benchmark: sequential and random reads and writes, append+fsync,
+# mmap and O_DIRECT jobs run by bench-data on a simplefs loop image, then on
+# ext4 on an image of the same size as a baseline. Caches are dropped before
+# each read job. Results go to $OUT.csv and $OUT.json, one record per file
+# system and job; jobs a file system does not support are marked so.
+
+SIMPLEFS_MOD=simplefs.ko
+SIMPLEFS_IMAGE=$1
+IMAGESIZE=$2
+MKFS=$3
+BENCH=$4
+FUSE=$5 # FUSE frontend, to run without the kernel module
+
+BS=${BS:-"4096 65536 1048576"}
+FILES=${FILES:-8}
+FILESIZE=${FILESIZE:-8388608} # Below the 10.6 MiB file size limit
+OUT=${OUT:-bench-data}
+FS=${FS:-"simplefs ext4"}
+EXT4_IMAGE=${SIMPLEFS_IMAGE%.img}-ext4.img
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+. script/common.sh
+
+# Through FUSE, simplefs is served by a daemon of the user
+fs_sudo() {
+    [ $FSTYPE = simplefs ] && [ -n "$FUSE" ] || echo sudo
+}
+
+# run job bs [-d]: one job, with cold caches for the read jobs
+run() {
+    local job=$1 bs=$2 flags=$3 result status=ok
+
+    case $job in
+    *read) drop_caches || exit 1 ;;
+    esac
+    result=$(./$BENCH $flags -n $FILES -s $FILESIZE $job $bs test/bench)
+    case $? in
+    0) ;;
+    2) status=unsupported result=",,,,," ;;
+    *) exit 1 ;;
+    esac
+    echo "$fs,$job,$bs,$([ -n "$flags" ] && echo direct || echo buffered),$result,$status" \
+        >> $OUT.csv
+    printf "%-8s %-9s %8s %-8s %s\n" $fs $job $bs "${flags:-  }" \
+        "${result:-unsupported}"
+}
+
+mkdir -p test
+umount_fs 2>/dev/null
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs 2>/dev/null
+    (modinfo $SIMPLEFS_MOD >/dev/null || exit 1) && \
+    sudo insmod $SIMPLEFS_MOD || exit 1
+fi
+
+echo "fs,job,bs,io,bytes,seconds,mb_per_s,iops,p50_us,p99_us,status" > $OUT.csv
+for fs in $FS; do
+    # Both file systems on images of the same size
+    FSTYPE=$fs
+    if [ $fs = ext4 ]; then
+        IMAGE=$EXT4_IMAGE
+        rm -f $IMAGE && truncate -s ${IMAGESIZE}M $IMAGE && \
+        mkfs.ext4 -q -F $IMAGE || exit 1
+    else
+        IMAGE=$SIMPLEFS_IMAGE
+        rm -f $IMAGE && truncate -s ${IMAGESIZE}M $IMAGE && \
+        ./$MKFS $IMAGE >/dev/null || exit 1
+    fi
+    mount_fs && $(fs_sudo) mkdir test/bench && \
+        $(fs_sudo) chmod 777 test/bench || exit 1
+
+    for bs in $BS; do
+        run write $bs
+        run read $bs
+    done
+    run randwrite 4096
+    run randread 4096
+    run append 4096
+    run mmapwrite 4096
+    run mmapread 4096
+    run write 1048576 -d
+    run read 1048576 -d
+    run randread 4096 -d
+
+    umount_fs
+done
+rm -f $EXT4_IMAGE
+
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs
+fi
+
+# Same records as JSON
+awk -F, -f script/csv2json.awk $OUT.csv > $OUT.json
+echo "Results in $OUT.csv and $OUT.json"
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+
+# Metadata benchmark: create, stat, readdir, rename and unlink rates in one
+# directory of each size, with warm caches and with cold ones (the file
+# system is remounted and the page cache dropped before each operation).
+# Results go to $OUT.csv and $OUT.json, one record per size, cache and op.
+
+SIMPLEFS_MOD=simplefs.ko
+IMAGE=$1
+IMAGESIZE=$2
+MKFS=$3
+BENCH=$4
+FUSE=$5 # FUSE frontend, to run without the kernel module
+
+SIZES=${SIZES:-"100 1000 10000 40000"}
+OUT=${OUT:-bench-meta}
+OPS="create stat readdir rename unlink"
+
+# Through FUSE, the image is served by a daemon of the user
+SUDO=sudo
+test -n "$FUSE" && SUDO=
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+. script/common.sh
+
+mkdir -p test
+umount_fs 2>/dev/null
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs 2>/dev/null
+    (modinfo $SIMPLEFS_MOD >/dev/null || exit 1) && \
+    sudo insmod $SIMPLEFS_MOD || exit 1
+fi
+
+echo "fs,entries,cache,op,calls,seconds,ops_per_sec,p50_us,p99_us,sync_ms" \
+    > $OUT.csv
+for size in $SIZES; do
+    for cache in warm cold; do
+        # A fresh image for each run, the same starting point
+        rm -f $IMAGE && truncate -s ${IMAGESIZE}M $IMAGE && \
+        ./$MKFS $IMAGE >/dev/null && \
+        mount_fs && $SUDO mkdir test/bench && $SUDO chmod 777 test/bench || exit 1
+
+        for op in $OPS; do
+            if [ $cache = cold ]; then
+                drop_caches || exit 1
+            fi
+            result=$(./$BENCH $op test/bench $size) || exit 1
+            echo "simplefs,$size,$cache,$op,$result" >> $OUT.csv
+            printf "%6s entries %-4s %-8s %s\n" $size $cache $op "$result"
+        done
+        umount_fs
+    done
+done
+
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs
+fi
+
+# Same records as JSON
+awk -F, -f script/csv2json.awk $OUT.csv > $OUT.json
+echo "Results in $OUT.csv and $OUT.json"
@@ -0,0 +1,31 @@
+# Helpers sourced by test.sh and the benchmark scripts, run from the top of the
+# tree. The sourcing script sets IMAGE, the simplefs image, and FUSE, the FUSE
+# frontend serving it without the kernel module (empty to use the module).
+# The image is mounted on test. FSTYPE, simplefs by default, mounts IMAGE as
+# another file system through the kernel instead, such as the ext4 baseline of
+# bench-data.sh.
+
+mount_fs() {
+    if [ "${FSTYPE:-simplefs}" != simplefs ]; then
+        sudo mount -t $FSTYPE -o loop $IMAGE test
+    elif [ -n "$FUSE" ]; then
+        ./$FUSE $IMAGE test
+    else
+        sudo mount -t simplefs -o loop $IMAGE test
+    fi
+}
+
+umount_fs() {
+    if [ "${FSTYPE:-simplefs}" = simplefs ] && [ -n "$FUSE" ]; then
+        fusermount3 -u test
+    else
+        sudo umount test
+    fi
+}
+
+# Remount with cold caches, the page cache being dropped in between
+drop_caches() {
+    umount_fs && sync && \
+    sudo sh -c 'echo 3 > /proc/sys/vm/drop_caches' && \
+    mount_fs
+}
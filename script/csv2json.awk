@@ -0,0 +1,27 @@
+# Convert the CSV results of the benchmark scripts to a JSON array, one object
+# per line keyed by the header; numbers stay numbers, empty fields are null.
+# Usage: awk -F, -f script/csv2json.awk results.csv > results.json
+
+NR == 1 {
+    for (i = 1; i <= NF; i++)
+        key[i] = $i
+    next
+}
+
+{
+    printf "%s  {", (NR == 2 ? "[\n" : ",\n")
+    for (i = 1; i <= NF; i++) {
+        if ($i == "")
+            value = "null"
+        else if ($i ~ /^[0-9.]+$/)
+            value = $i
+        else
+            value = "\"" $i "\""
+        printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], value
+    }
+    printf "}"
+}
+
+END {
+    print (NR > 1 ? "\n]" : "[]")
+}
@@ -4,6 +4,11 @@ SIMPLEFS_MOD=simplefs.ko
 IMAGE=$1
 IMAGESIZE=$2
 MKFS=$3
+FUSE=$4 # FUSE frontend, to test without root nor the kernel module
+
+# Through FUSE, the image is served by a daemon of the user
+SUDO=sudo
+test -n "$FUSE" && SUDO=
 
 D_MOD="drwxr-xr-x"
 F_MOD="-rw-r--r--"
@@ -15,7 +20,7 @@ test_op() {
     local op=$1 
     echo
     echo -n "Testing cmd: $op..."
-    sudo sh -c "$op" >/dev/null && echo "Success"
+    $SUDO sh -c "$op" >/dev/null && echo "Success"
 }
 
 check_exist() {
@@ -24,7 +29,7 @@ check_exist() {
     local name=$3
     echo
     echo -n "Check if exist: $mode $nlink $name..."
-    sudo ls -lR  | grep -e "$mode $nlink".*$name >/dev/null && echo "Success" || \
+    $SUDO ls -lR  | grep -e "$mode $nlink".*$name >/dev/null && echo "Success" || \
     echo "Failed" 
 }
 
@@ -33,17 +38,21 @@ if [ "$EUID" -eq 0 ]
   exit
 fi
 
+. script/common.sh
+
 mkdir -p test  
-sudo umount test 2>/dev/null
+umount_fs 2>/dev/null
 sleep 1
-sudo rmmod simplefs 2>/dev/null
-sleep 1
-(modinfo $SIMPLEFS_MOD || exit 1) && \
-echo && \
-sudo insmod $SIMPLEFS_MOD  && \
-dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none && \
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs 2>/dev/null
+    sleep 1
+    (modinfo $SIMPLEFS_MOD || exit 1) && \
+    echo && \
+    sudo insmod $SIMPLEFS_MOD || exit 1
+fi
+rm -f $IMAGE && truncate -s ${IMAGESIZE}M $IMAGE && \
 ./$MKFS $IMAGE && \
-sudo mount -t simplefs -o loop $IMAGE test && \
+mount_fs && \
 pushd test >/dev/null
 
 # mkdir
@@ -60,7 +69,7 @@ do
 done
 filecnts=$(ls | wc -w)
 test $filecnts -eq $MAXFILES || echo "Failed, it should be $MAXFILES files"
-find . -name '[0-9]*.txt' | xargs -n 2000 sudo rm
+find . -name '[0-9]*.txt' | xargs -n 2000 $SUDO rm
 
 # hard link
 test_op 'ln file hdlink'
@@ -81,11 +90,46 @@ test_op 'ln -s dir len_of_name_of_the_link_is_29'
 test_op 'echo abc > file'
 test $(cat file) = "abc" || echo "Failed to write"
 
+# inline data: a small file, grown past the inline limit, then truncated back
+test_op 'head -c 60 /dev/zero | tr "\0" a > inline'
+test "$(cat inline)" = "$(head -c 60 /dev/zero | tr '\0' a)" || \
+    echo "Failed to write inline data"
+test_op 'head -c 200 /dev/zero | tr "\0" b >> inline'
+test $(stat -c %s inline) -eq 260 && \
+    test $(tr -d a < inline | wc -c) -eq 200 || echo "Failed to grow inline data"
+test_op 'truncate -s 50 inline'
+test "$(cat inline)" = "$(head -c 50 /dev/zero | tr '\0' a)" || \
+    echo "Failed to truncate back to inline size"
+
 # file too large
 test_op 'dd if=/dev/zero of=file bs=1M count=12 status=none'
-filesize=$(sudo ls -lR  | grep -e "$F_MOD 2".*file | awk '{print $5}')
+filesize=$($SUDO ls -lR  | grep -e "$F_MOD 2".*file | awk '{print $5}')
 test $filesize -le $MAXFILESIZE || echo "Failed, file size over the limit"
 
+# truncate
+test_op 'truncate -s 5000 file'
+test $(stat -c %s file) -eq 5000 || echo "Failed to truncate"
+
+# holes over reused blocks read back as zeroes
+test_op 'head -c 65536 /dev/urandom > stale && rm stale'
+test_op 'printf x | dd of=sparse bs=1 seek=40000 status=none'
+test $(tr -d '\0' < sparse | wc -c) -eq 1 || echo "Failed, stale data in a hole"
+test_op 'truncate -s 100 sparse && truncate -s 40000 sparse'
+test $(tr -d '\0' < sparse | wc -c) -eq 0 || echo "Failed, stale data after truncate"
+
+# write past the end of file, after a remount, into an extent whose blocks
+# past EOF were left stale on disk, as the module leaves them
+test_op 'head -c 65536 /dev/urandom > stale && rm stale'
+test_op 'echo abc > grown'
+popd >/dev/null
+umount_fs && mount_fs && pushd test >/dev/null
+test_op 'printf x | dd of=grown bs=1 seek=20000 conv=notrunc status=none'
+test $(tr -d '\0' < grown | wc -c) -eq 5 || \
+    echo "Failed, stale data before a write past EOF"
+test_op 'truncate -s 24576 grown'
+test $(tr -d '\0' < grown | wc -c) -eq 5 || \
+    echo "Failed, stale data after a write past EOF"
+
 # test if exist
 check_exist $D_MOD 3 dir 
 check_exist $F_MOD 2 file
@@ -95,5 +139,30 @@ check_exist $S_MOD 1 symlink
 
 sleep 1
 popd >/dev/null
-sudo umount test
-sudo rmmod simplefs
+umount_fs
+
+# non-4K block size: data spanning several bitmap and extent blocks survives
+# a remount of a volume with 1 KiB blocks
+DATA=$(mktemp)
+head -c 300000 /dev/urandom > $DATA
+rm -f $IMAGE && truncate -s ${IMAGESIZE}M $IMAGE && \
+./$MKFS -b 1024 $IMAGE >/dev/null && \
+mount_fs && \
+pushd test >/dev/null
+test_op 'mkdir dir'
+test_op "cp $DATA data"
+test_op 'echo abc > dir/file'
+popd >/dev/null
+umount_fs && mount_fs && pushd test >/dev/null
+cmp -s $DATA data || echo "Failed, data differs with 1 KiB blocks"
+test $(cat dir/file) = "abc" || echo "Failed to write with 1 KiB blocks"
+test_op 'truncate -s 5000 data'
+test $(stat -c %s data) -eq 5000 || echo "Failed to truncate with 1 KiB blocks"
+rm -f $DATA
+
+sleep 1
+popd >/dev/null
+umount_fs
+if [ -z "$FUSE" ]; then
+    sudo rmmod simplefs
+fi
@@ -2,27 +2,43 @@
 #define SIMPLEFS_H
 
 /* source: https://en.wikipedia.org/wiki/Hexspeak */
-#define SIMPLEFS_MAGIC 0xDEADCELL
+#define SIMPLEFS_MAGIC 0xDEADCE11
+
+/*
+ * Magic of the volumes made before inline data, whose inodes take 72 bytes
+ * (the old definition, 0xDEADCELL, is 0xDEADCE with an LL suffix). They are
+ * refused, the inode store layout differs.
+ */
+#define SIMPLEFS_MAGIC_V1 0xDEADCE
 
 #define SIMPLEFS_SB_BLOCK_NR 0
 
-#define SIMPLEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define SIMPLEFS_MAX_EXTENTS \
-    ((SIMPLEFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct simplefs_extent))
-#define SIMPLEFS_MAX_BLOCKS_PER_EXTENT 8 /* It can be ~(uint32) 0 */
-#define SIMPLEFS_MAX_FILESIZE                                      \
-    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT *SIMPLEFS_BLOCK_SIZE \
-        *SIMPLEFS_MAX_EXTENTS)
+/* Block size is chosen by mkfs, from 1 KiB to 64 KiB */
+#define SIMPLEFS_MIN_BLOCK_SIZE_BITS 10
+#define SIMPLEFS_MAX_BLOCK_SIZE_BITS 16
+#define SIMPLEFS_BLOCK_SIZE_BITS 12 /* Default, and for volumes without
+                                       blocksize_bits in the superblock */
+#define SIMPLEFS_BLOCK_SIZE (1 << SIMPLEFS_BLOCK_SIZE_BITS) /* 4 KiB */
+#define SIMPLEFS_MIN_BLOCK_SIZE (1 << SIMPLEFS_MIN_BLOCK_SIZE_BITS)
 
-#define SIMPLEFS_FILENAME_LEN 255
+#define SIMPLEFS_MAX_BLOCKS_PER_EXTENT 8 /* It can be ~(uint16) 0 */
 
-#define SIMPLEFS_FILES_PER_BLOCK \
-    (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_file))
-#define SIMPLEFS_FILES_PER_EXT \
-    (SIMPLEFS_FILES_PER_BLOCK *SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+#define SIMPLEFS_FILENAME_LEN 255
 
-#define SIMPLEFS_MAX_SUBFILES \
-    (SIMPLEFS_FILES_PER_EXT *SIMPLEFS_MAX_EXTENTS)
+/*
+ * Geometry derived from the block size bs. The kernel module computes it once
+ * at mount time in struct simplefs_sb_info.
+ */
+#define SIMPLEFS_MAX_EXTENTS(bs) \
+    (((bs) - sizeof(uint32_t)) / sizeof(struct simplefs_extent))
+#define SIMPLEFS_MAX_FILESIZE(bs)                                 \
+    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT * (bs) *           \
+     SIMPLEFS_MAX_EXTENTS(bs))
+#define SIMPLEFS_FILES_PER_BLOCK(bs) ((bs) / sizeof(struct simplefs_file))
+#define SIMPLEFS_FILES_PER_EXT(bs) \
+    (SIMPLEFS_FILES_PER_BLOCK(bs) * SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+#define SIMPLEFS_MAX_SUBFILES(bs) \
+    (SIMPLEFS_FILES_PER_EXT(bs) * SIMPLEFS_MAX_EXTENTS(bs))
 
 #include <linux/version.h>
 
@@ -44,25 +60,76 @@
  * +---------------+
  */
 
-/* Each inode block contains 72 Bytes data */
+#define SIMPLEFS_INLINE_DATA_LEN 84 /* Symlink target or inline file data */
+#define SIMPLEFS_INLINE_DATA_LEN_64 76 /* Same, with the 64BIT feature */
+
+/* Inode flags (i_flags) */
+#define SIMPLEFS_INODE_INLINE 0x0001 /* File data is stored in i_data */
+
+/*
+ * Incompatible features (feature_incompat): a volume using a feature which is
+ * not known by the module must not be mounted.
+ */
+#define SIMPLEFS_FEATURE_INCOMPAT_64BIT 0x0001 /* 64-bit block numbers */
+#define SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE 0x0002 /* 256-byte inodes */
+#define SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE 0x0004 /* Inode store zeroed
+                                                        on demand */
+#define SIMPLEFS_FEATURE_INCOMPAT_SUPP                                      \
+    (SIMPLEFS_FEATURE_INCOMPAT_64BIT | SIMPLEFS_FEATURE_INCOMPAT_LARGE_INODE | \
+     SIMPLEFS_FEATURE_INCOMPAT_LAZY_ITABLE)
+
+/*
+ * Largest volume with the 64BIT feature: block numbers fit in the 48 bits of
+ * an extent (ee_start and the 16-bit ee_start_hi) and the number of bitmap
+ * blocks still fits in 32 bits.
+ */
+#define SIMPLEFS_MAX_BLOCKS_64 (1ULL << 46)
+
+/* Each inode contains 128 Bytes data */
 struct simplefs_inode {
     uint32_t i_mode;   /* File mode */
     uint32_t i_uid;    /* Owner id */
     uint32_t i_gid;    /* Group id */
-    uint32_t i_size;   /* Size in bytes */
+    uint32_t i_size;   /* Size in bytes (low 32 bits) */
     uint32_t i_ctime;  /* Inode change time */
     uint32_t i_atime;  /* Access time */
     uint32_t i_mtime;  /* Modification time */
     uint32_t i_blocks; /* Block count */
     uint32_t i_nlink;  /* Hard links count */
-    uint32_t ei_block;  /* Block with list of extents for this file */
-    char i_data[32]; /* store symlink content */
+    uint32_t ei_block;  /* Block with list of extents for this file (low) */
+    uint32_t i_flags;  /* Inode flags (SIMPLEFS_INODE_*) */
+    union {
+        char i_data[SIMPLEFS_INLINE_DATA_LEN]; /* store symlink content or
+                                                  inline file data */
+        struct {
+            /* 64BIT feature: the end of i_data holds the high words */
+            char i_data_64[SIMPLEFS_INLINE_DATA_LEN_64];
+            uint32_t i_size_hi;   /* High 32 bits of i_size */
+            uint32_t ei_block_hi; /* High 32 bits of ei_block */
+        };
+    };
 };
 
-#define SIMPLEFS_INODES_PER_BLOCK \ /* 4KiB/ 72B = 56 inodes/ block */
-    (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode)) 
+/*
+ * LARGE_INODE feature: inodes take 256 bytes, the inode above being followed
+ * by these fields. Timestamps get 64-bit seconds and nanoseconds.
+ */
+#define SIMPLEFS_LARGE_INODE_SIZE 256
 
-struct simplefs_sb_info {
+struct simplefs_inode_extra {
+    uint32_t i_ctime_hi;   /* High 32 bits of i_ctime */
+    uint32_t i_atime_hi;   /* High 32 bits of i_atime */
+    uint32_t i_mtime_hi;   /* High 32 bits of i_mtime */
+    uint32_t i_ctime_nsec; /* Nanoseconds of i_ctime */
+    uint32_t i_atime_nsec; /* Nanoseconds of i_atime */
+    uint32_t i_mtime_nsec; /* Nanoseconds of i_mtime */
+};
+
+/* 4KiB / 128B = 32 inodes / block, 16 with LARGE_INODE */
+#define SIMPLEFS_INODES_PER_BLOCK(bs, isize) ((bs) / (isize))
+
+/* On-disk superblock, stored at the start of block 0 */
+struct simplefs_super_block {
     uint32_t magic; /* Magic number */
 
     uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
@@ -75,29 +142,53 @@ struct simplefs_sb_info {
     uint32_t nr_free_inodes; /* Number of free inodes */
     uint32_t nr_free_blocks; /* Number of free blocks */
 
-#ifdef __KERNEL__
-    unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-    unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
-#endif
-};
+    uint32_t feature_incompat; /* SIMPLEFS_FEATURE_INCOMPAT_* */
 
-#ifdef __KERNEL__
+    /* 64BIT feature only, zero otherwise */
+    uint32_t nr_blocks_hi;      /* High 32 bits of nr_blocks */
+    uint32_t nr_free_blocks_hi; /* High 32 bits of nr_free_blocks */
 
-struct simplefs_inode_info {
-    uint32_t ei_block;  /* Block with list of extents for this file */
-    char i_data[32];
-    struct inode vfs_inode;
+    uint32_t blocksize_bits; /* log2 of the block size, 0 means 4 KiB */
+
+    /* LAZY_ITABLE feature only: log2 of the blocks per inode store region */
+    uint32_t itable_region_bits;
 };
 
+/*
+ * LAZY_ITABLE feature: mkfs does not zero the inode store. It is split in
+ * regions of 2^itable_region_bits blocks, and block 0 holds, from byte
+ * SIMPLEFS_ITABLE_MAP_OFFSET to the end of the block, a bitmap of the regions
+ * not zeroed yet (1 means not zeroed). All the inodes of such a region are
+ * free and must be read as zero; a region is zeroed, and its bit cleared,
+ * before its first inode is allocated.
+ */
+#define SIMPLEFS_ITABLE_MAP_OFFSET 512
+#define SIMPLEFS_ITABLE_MAX_REGIONS(bs) (((bs) - SIMPLEFS_ITABLE_MAP_OFFSET) * 8)
+
 struct simplefs_extent {
-    uint32_t ee_block; /* first logical block extent covers */
-    uint32_t ee_len;   /* number of blocks covered by extent */
-    uint32_t ee_start; /* first physical block extent covers */
+    uint32_t ee_block;    /* first logical block extent covers */
+    uint16_t ee_len;      /* number of blocks covered by extent */
+    uint16_t ee_start_hi; /* high 16 bits of ee_start (64BIT feature) */
+    uint32_t ee_start;    /* first physical block extent covers (low) */
 };
 
+/* Return the first physical block of ext, zero if ext is not used */
+static inline uint64_t simplefs_ext_start(const struct simplefs_extent *ext)
+{
+    return (uint64_t) ext->ee_start_hi << 32 | ext->ee_start;
+}
+
+static inline void simplefs_ext_set_start(struct simplefs_extent *ext,
+                                          uint64_t bno)
+{
+    ext->ee_start = (uint32_t) bno;
+    ext->ee_start_hi = (uint16_t) (bno >> 32);
+}
+
+/* Index block: SIMPLEFS_MAX_EXTENTS(block size) extents */
 struct simplefs_file_ei_block {
     uint32_t nr_files; /* Number of files in directory */
-    struct simplefs_extent extents[SIMPLEFS_MAX_EXTENTS];
+    struct simplefs_extent extents[];
 };
 
 struct simplefs_file {
@@ -105,32 +196,181 @@ struct simplefs_file {
     char filename[SIMPLEFS_FILENAME_LEN];
 };
 
+/* Directory block: SIMPLEFS_FILES_PER_BLOCK(block size) entries */
 struct simplefs_dir_block {
-    struct simplefs_file files[SIMPLEFS_FILES_PER_BLOCK];
+    struct simplefs_file files[0];
+};
+
+#ifdef __KERNEL__
+/* Number of bitmap blocks read in one batch when a chunk has to be loaded */
+#define SIMPLEFS_BITMAP_RA_BLOCKS 32
+
+/* Number of inode store blocks read in one batch on an inode cache miss */
+#define SIMPLEFS_INODE_RA_BLOCKS 8
+
+/*
+ * In-memory copy of an on-disk bitmap (ifree or bfree), split in one chunk per
+ * bitmap block. Chunks are separate page-sized allocations, read on first
+ * access, and only the modified ones are written back.
+ */
+struct simplefs_bitmap {
+    unsigned long **chunks; /* Chunks, NULL until loaded */
+    uint32_t *nr_free;      /* Free bits per chunk, valid once loaded */
+    unsigned long *dirty;   /* Chunks modified since last sync */
+    uint64_t *nr_free_total; /* Free counter in the superblock info */
+    uint32_t start;         /* First bitmap block on disk */
+    uint32_t nr_chunks;     /* Number of bitmap blocks */
+    uint64_t nr_bits;       /* Number of inodes or blocks tracked */
+    uint32_t hint;          /* Chunks before this one are full */
+    uint32_t chunk_shift;   /* log2 of the number of bits per chunk */
+    struct mutex lock;
+};
+
+/* In-memory superblock info, filled from struct simplefs_super_block */
+struct simplefs_sb_info {
+    uint64_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
+    uint32_t nr_inodes; /* Total number of inodes */
+
+    uint32_t nr_istore_blocks; /* Number of inode store blocks */
+    uint32_t nr_ifree_blocks;  /* Number of inode free bitmap blocks */
+    uint32_t nr_bfree_blocks;  /* Number of block free bitmap blocks */
+
+    uint64_t nr_free_inodes; /* Number of free inodes */
+    uint64_t nr_free_blocks; /* Number of free blocks */
+
+    uint32_t feature_incompat; /* SIMPLEFS_FEATURE_INCOMPAT_* */
+
+    /* Geometry derived from the block size (see SIMPLEFS_MAX_EXTENTS()...) */
+    uint32_t inode_size;       /* Size of an on-disk inode */
+    uint32_t inodes_per_block; /* Inodes in an inode store block */
+    uint32_t max_extents;      /* Extents in an index block */
+    uint32_t files_per_block;  /* Entries in a directory block */
+    uint32_t files_per_ext;    /* Entries in a directory extent */
+    uint32_t max_subfiles;     /* Entries in a directory */
+
+    struct simplefs_bitmap ifree_bitmap; /* In-memory free inodes bitmap */
+    struct simplefs_bitmap bfree_bitmap; /* In-memory free blocks bitmap */
+
+    /* LAZY_ITABLE feature: inode store regions not zeroed yet (1 bit each) */
+    unsigned long *itable_uninit;
+    uint32_t itable_region_bits; /* log2 of the blocks per region */
+    uint32_t nr_itable_regions;
+    struct mutex itable_lock; /* Serializes zeroing regions */
+
+    unsigned long mount_opt; /* Mount options (SIMPLEFS_MOUNT_*) */
+    struct super_block *sb;  /* Back pointer to the VFS superblock */
+};
+
+struct simplefs_inode_info {
+    uint64_t ei_block;  /* Block with list of extents for this file */
+    uint32_t i_flags;   /* Inode flags (SIMPLEFS_INODE_*) */
+    uint32_t i_valid_blocks; /* Allocated blocks below hold data or zeroes */
+    char i_data[SIMPLEFS_INLINE_DATA_LEN];
+    struct simplefs_dindex *i_dindex; /* Name index of a directory (dir.c) */
+    spinlock_t i_dindex_lock;
+    struct inode vfs_inode;
 };
 
 /* superblock functions */
 int simplefs_fill_super(struct super_block *sb, void *data, int silent);
+bool simplefs_discard_supported(struct super_block *sb);
+
+/* bitmap functions */
+int simplefs_bitmap_init(struct super_block *sb,
+                         struct simplefs_bitmap *map,
+                         uint32_t start,
+                         uint32_t nr_chunks,
+                         uint64_t nr_bits,
+                         uint64_t *nr_free);
+void simplefs_bitmap_destroy(struct simplefs_bitmap *map);
+void simplefs_bitmap_readahead(struct super_block *sb,
+                               struct simplefs_bitmap *map,
+                               uint32_t i,
+                               uint32_t nr);
+uint64_t simplefs_bitmap_alloc(struct super_block *sb,
+                               struct simplefs_bitmap *map,
+                               uint32_t len,
+                               uint64_t goal,
+                               int *errp);
+int simplefs_bitmap_free(struct super_block *sb,
+                         struct simplefs_bitmap *map,
+                         uint64_t bit,
+                         uint32_t len);
+void simplefs_bitmap_sync(struct super_block *sb, struct simplefs_bitmap *map);
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range);
 
 /* inode functions */
 int simplefs_init_inode_cache(void);
 void simplefs_destroy_inode_cache(void);
 struct inode *simplefs_iget(struct super_block *sb, unsigned long ino);
+void simplefs_zero_blocks(struct super_block *sb, uint64_t bno, uint32_t len);
+int simplefs_itable_init(struct super_block *sb, uint32_t ino);
+
+/* dir functions */
+int simplefs_init_dindex(void);
+void simplefs_destroy_dindex(void);
+int simplefs_dindex_build(struct inode *dir);
+bool simplefs_dindex_lookup(struct inode *dir,
+                            const struct qstr *name,
+                            uint32_t *ino);
+void simplefs_dindex_add(struct inode *dir, const struct qstr *name, uint32_t ino);
+void simplefs_dindex_del(struct inode *dir, const struct qstr *name);
+void simplefs_dindex_free(struct simplefs_inode_info *ci);
 
 /* file functions */
 extern const struct file_operations simplefs_file_ops;
 extern const struct file_operations simplefs_dir_ops;
 extern const struct address_space_operations simplefs_aops;
+int simplefs_truncate(struct inode *inode, loff_t newsize);
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* extent functions */
-extern uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
+extern uint32_t simplefs_ext_search(struct super_block *sb,
+                                    struct simplefs_file_ei_block *index,
                                     uint32_t iblock);
+int simplefs_fiemap(struct inode *inode,
+                    struct fiemap_extent_info *fieinfo,
+                    u64 start,
+                    u64 len);
+
+/* Mount options */
+#define SIMPLEFS_MOUNT_DISCARD 0x0001 /* Discard blocks when they are freed */
+#define SIMPLEFS_MOUNT_DIRCACHE 0x0002 /* Index directory names in memory */
+
+#define simplefs_test_opt(sbi, opt) ((sbi)->mount_opt & SIMPLEFS_MOUNT_##opt)
 
 /* Getters for superbock and inode */
-#define SIMPLEFS_SB(sb) (sb->s_fs_info)
+#define SIMPLEFS_SB(sb) ((struct simplefs_sb_info *) (sb)->s_fs_info)
 #define SIMPLEFS_INODE(inode) \
     (container_of(inode, struct simplefs_inode_info, vfs_inode))
 
+#define simplefs_has_inline_data(ci) ((ci)->i_flags & SIMPLEFS_INODE_INLINE)
+
+#define simplefs_has_feature(sbi, feat) \
+    ((sbi)->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_##feat)
+
+/* Room available in i_data on this volume */
+#define simplefs_inline_len(sb)                   \
+    (simplefs_has_feature(SIMPLEFS_SB(sb), 64BIT) \
+         ? SIMPLEFS_INLINE_DATA_LEN_64            \
+         : SIMPLEFS_INLINE_DATA_LEN)
+
+/* Return on-disk inode ino in data, the content of its inode store block */
+static inline struct simplefs_inode *simplefs_raw_inode(
+    struct simplefs_sb_info *sbi,
+    void *data,
+    unsigned long ino)
+{
+    return data + ino % sbi->inodes_per_block * sbi->inode_size;
+}
+
+/* Fields following raw inode cinode with the LARGE_INODE feature */
+static inline struct simplefs_inode_extra *simplefs_inode_extra(
+    struct simplefs_inode *cinode)
+{
+    return (struct simplefs_inode_extra *) (cinode + 1);
+}
+
 #endif /* __KERNEL__ */
 
 #endif /* SIMPLEFS_H */
@@ -1,9 +1,12 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 
@@ -16,6 +19,7 @@ static struct super_operations simplefs_super_ops = {
     .write_inode = simplefs_write_inode,
     .sync_fs = simplefs_sync_fs,
     .statfs = simplefs_statfs,
+    .show_options = simplefs_show_options,
 };
 
 /**
@@ -77,6 +81,9 @@ static struct inode *simplefs_alloc_inode(struct super_block *sb)
      * of the inode, so let the slab aware of that.
      */
     inode_init_once(&ci->vfs_inode);
+    ci->i_dindex = NULL;
+    ci->i_valid_blocks = 0;
+    spin_lock_init(&ci->i_dindex_lock);
     return &ci->vfs_inode; // Return vfs_inode to VFS.
 }
 
@@ -84,6 +91,8 @@ static void simplefs_destroy_inode(struct inode *inode)
 {
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
 
+    simplefs_dindex_free(ci);
+
     /* Free an object - ci which was previously allocated from this cache - simplefs_inode_cache. */
     kmem_cache_free(simplefs_inode_cache, ci);
 }
@@ -129,10 +138,7 @@ static int simplefs_write_inode(struct inode *inode,
     uint32_t ino = inode->i_ino;
 
     /* Number of blocks */
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
-
-    /* Remainder */
-    uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
+    uint32_t inode_block = (ino / sbi->inodes_per_block) + 1;
 
     if (ino >= sbi->nr_inodes)
         return 0;
@@ -143,8 +149,7 @@ static int simplefs_write_inode(struct inode *inode,
         return -EIO;
 
     /* Data read from sb_bread/ Read from inode_block */
-    disk_inode = (struct simplefs_inode *) bh->b_data;
-    disk_inode += inode_shift;
+    disk_inode = simplefs_raw_inode(sbi, bh->b_data, ino);
 
     /* Update the mode using what the generic inode has */
     disk_inode->i_mode = inode->i_mode;
@@ -157,13 +162,28 @@ static int simplefs_write_inode(struct inode *inode,
     disk_inode->i_blocks = inode->i_blocks;
     disk_inode->i_nlink = inode->i_nlink;
     disk_inode->ei_block = ci->ei_block;
+    disk_inode->i_flags = ci->i_flags;
 
-    /* 
-     * The function char *strncpy(char *dest, const char *src, size_t n) copies up to n copies up to n characters 
-     * from the string pointed to by src to dest. In case the length of src is less than n, the remainder or remainder 
-     * of dest will be filled with null values. 
-     */
-    strncpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+    /* Symlink target or inline file data */
+    memcpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+
+    /* High words, stored at the end of i_data with the 64BIT feature */
+    if (simplefs_has_feature(sbi, 64BIT)) {
+        disk_inode->i_size_hi = inode->i_size >> 32;
+        disk_inode->ei_block_hi = ci->ei_block >> 32;
+    }
+
+    /* High words of the timestamps and nanoseconds */
+    if (simplefs_has_feature(sbi, LARGE_INODE)) {
+        struct simplefs_inode_extra *extra = simplefs_inode_extra(disk_inode);
+
+        extra->i_ctime_hi = cpu_to_le32((uint64_t) inode->i_ctime.tv_sec >> 32);
+        extra->i_atime_hi = cpu_to_le32((uint64_t) inode->i_atime.tv_sec >> 32);
+        extra->i_mtime_hi = cpu_to_le32((uint64_t) inode->i_mtime.tv_sec >> 32);
+        extra->i_ctime_nsec = cpu_to_le32(inode->i_ctime.tv_nsec);
+        extra->i_atime_nsec = cpu_to_le32(inode->i_atime.tv_nsec);
+        extra->i_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
+    }
 
     /* 
      * Mark a buffer_head as needing writeout. It will set the dirty bit against the buffer, then set its backing page
@@ -191,8 +211,9 @@ static void simplefs_put_super(struct super_block *sb)
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     if (sbi) {
         /* Free previously allocated memory */
-        kfree(sbi->ifree_bitmap);
-        kfree(sbi->bfree_bitmap);
+        simplefs_bitmap_destroy(&sbi->ifree_bitmap);
+        simplefs_bitmap_destroy(&sbi->bfree_bitmap);
+        kfree(sbi->itable_uninit);
         kfree(sbi);
     }
 }
@@ -210,8 +231,7 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
 
     /* Super block in disk */
-    struct simplefs_sb_info *disk_sb;
-    int i;
+    struct simplefs_super_block *disk_sb;
 
     /* Flush superblock/ sb_bread reads the corresponding block - block 0 from the device specified in sb and stores it in a buffer*/
     struct buffer_head *bh = sb_bread(sb, 0);
@@ -219,7 +239,7 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
         return -EIO;
 
     /* Data read from sb_bread/ Read from super block */
-    disk_sb = (struct simplefs_sb_info *) bh->b_data;
+    disk_sb = (struct simplefs_super_block *) bh->b_data;
 
     disk_sb->nr_blocks = sbi->nr_blocks;
     disk_sb->nr_inodes = sbi->nr_inodes;
@@ -228,6 +248,10 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
     disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
     disk_sb->nr_free_inodes = sbi->nr_free_inodes;
     disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+    if (simplefs_has_feature(sbi, 64BIT)) {
+        disk_sb->nr_blocks_hi = sbi->nr_blocks >> 32;
+        disk_sb->nr_free_blocks_hi = sbi->nr_free_blocks >> 32;
+    }
 
     /* 
      * Mark a buffer_head as needing writeout. It will set the dirty bit against the buffer, then set its backing page
@@ -247,71 +271,10 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
     /* Frees the specified buffer. */    
     brelse(bh);
 
-    /* Flush free inodes bitmask */
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        /* Iterate over all blocks of ifree */
-        int idx = sbi->nr_istore_blocks + i + 1;
+    /* Flush the modified parts of free inodes and free blocks bitmasks */
+    simplefs_bitmap_sync(sb, &sbi->ifree_bitmap);
+    simplefs_bitmap_sync(sb, &sbi->bfree_bitmap);
 
-        /* sb_bread reads the corresponding block - block idx from the device specified in sb and stores it in a buffer*/
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
-
-        /* Copy SIMPLEFS_BLOCK_SIZE KB from source to dest/ or all bit of ifree_bitmap to bh->b_data */
-        memcpy(bh->b_data, (void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
-
-        /* 
-         * Mark a buffer_head as needing writeout. It will set the dirty bit against the buffer, then set its backing page
-         * dirty, then tag the page as dirty in its address_space's radix tree and then attach the address_space's inode to 
-         * its superblock's dirty inode list. 
-         */
-        mark_buffer_dirty(bh);
-
-        if (wait)
-            /*
-             * For a data-integrity writeout, we need to wait upon any in-progress I/O
-             * and then start new I/O and then wait upon it.  The caller must have a ref on
-             * the buffer_head.
-             */
-            sync_dirty_buffer(bh);
-
-        /* Frees the specified buffer. */  
-        brelse(bh);
-    }
-
-    /* Flush free blocks bitmask */
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        /* Iterate over all blocks of ifree */
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        /* sb_bread reads the corresponding block - block idx from the device specified in sb and stores it in a buffer*/
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
-
-        /* Copy SIMPLEFS_BLOCK_SIZE KB from source to dest/ or all bit of bfree_bitmap to bh->b_data */
-        memcpy(bh->b_data, (void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
-
-        /* 
-         * Mark a buffer_head as needing writeout. It will set the dirty bit against the buffer, then set its backing page
-         * dirty, then tag the page as dirty in its address_space's radix tree and then attach the address_space's inode to 
-         * its superblock's dirty inode list. 
-         */
-        mark_buffer_dirty(bh);
-
-        if (wait)
-            /*
-             * For a data-integrity writeout, we need to wait upon any in-progress I/O
-             * and then start new I/O and then wait upon it.  The caller must have a ref on
-             * the buffer_head.
-             */
-            sync_dirty_buffer(bh);
-
-        /* Frees the specified buffer. */    
-        brelse(bh);
-    }
     return 0;
 }
 
@@ -332,7 +295,7 @@ static int simplefs_statfs(struct dentry *dentry, struct kstatfs *stat)
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
 
     stat->f_type = SIMPLEFS_MAGIC;
-    stat->f_bsize = SIMPLEFS_BLOCK_SIZE;
+    stat->f_bsize = sb->s_blocksize;
     stat->f_blocks = sbi->nr_blocks;
     stat->f_bfree = sbi->nr_free_blocks;
     stat->f_bavail = sbi->nr_free_blocks;
@@ -343,9 +306,117 @@ static int simplefs_statfs(struct dentry *dentry, struct kstatfs *stat)
     return 0;
 }
 
+/* Show the mount options which differ from the default in /proc/mounts */
+static int simplefs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(root->d_sb);
+
+    if (simplefs_test_opt(sbi, DISCARD))
+        seq_puts(m, ",discard");
+    if (simplefs_test_opt(sbi, DIRCACHE))
+        seq_puts(m, ",dircache");
+
+    return 0;
+}
+
+/* Return true if the device under sb can discard blocks */
+bool simplefs_discard_supported(struct super_block *sb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    return bdev_max_discard_sectors(sb->s_bdev) != 0;
+#else
+    return blk_queue_discard(bdev_get_queue(sb->s_bdev));
+#endif
+}
+
+/*
+ * LAZY_ITABLE feature: read the map of the inode store regions which are not
+ * zeroed yet from block 0, once the block size of the volume is set.
+ * Return 0 on success, a negative error code otherwise.
+ */
+static int simplefs_load_itable_map(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct buffer_head *bh;
+
+    if (sbi->itable_region_bits >= 32) {
+        pr_err("Invalid inode store region size 2^%u\n",
+               sbi->itable_region_bits);
+        return -EINVAL;
+    }
+    sbi->nr_itable_regions =
+        DIV_ROUND_UP(sbi->nr_istore_blocks,
+                     (uint64_t) 1 << sbi->itable_region_bits);
+    if (sbi->nr_itable_regions > SIMPLEFS_ITABLE_MAX_REGIONS(sb->s_blocksize)) {
+        pr_err("Too many inode store regions (%u)\n", sbi->nr_itable_regions);
+        return -EINVAL;
+    }
+
+    sbi->itable_uninit = kcalloc(BITS_TO_LONGS(sbi->nr_itable_regions),
+                                 sizeof(unsigned long), GFP_KERNEL);
+    if (!sbi->itable_uninit)
+        return -ENOMEM;
+
+    bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+    if (!bh)
+        return -EIO;
+    memcpy(sbi->itable_uninit, bh->b_data + SIMPLEFS_ITABLE_MAP_OFFSET,
+           DIV_ROUND_UP(sbi->nr_itable_regions, 8));
+    brelse(bh);
+    mutex_init(&sbi->itable_lock);
+
+    return 0;
+}
+
+enum { Opt_discard, Opt_dircache, Opt_err };
+
+static const match_table_t tokens = {
+    {Opt_discard, "discard"},
+    {Opt_dircache, "dircache"},
+    {Opt_err, NULL},
+};
+
+/*
+ * Parse the comma separated mount options in options and store them in the
+ * superblock info. Return 0 on success, -EINVAL on an unknown option.
+ */
+static int simplefs_parse_options(struct super_block *sb, char *options)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+
+        switch (match_token(p, tokens, args)) {
+        case Opt_discard:
+            sbi->mount_opt |= SIMPLEFS_MOUNT_DISCARD;
+            break;
+        case Opt_dircache:
+            sbi->mount_opt |= SIMPLEFS_MOUNT_DIRCACHE;
+            break;
+        default:
+            pr_err("Unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+
+    if (simplefs_test_opt(sbi, DISCARD) && !simplefs_discard_supported(sb)) {
+        pr_warn("Device does not support discard, ignoring \"discard\"\n");
+        sbi->mount_opt &= ~SIMPLEFS_MOUNT_DISCARD;
+    }
+
+    return 0;
+}
+
 /**
- * @brief Called to terminate the superblock initialization. Reads out superblocks, ifree_bitmap, bfree_bitmap in the file system and allocates a copy of the same information
- * in kernel memory. Initialize the inode of the root directory.
+ * @brief Called to terminate the superblock initialization. Reads out the superblock in the file system and allocates a copy of the same information
+ * in kernel memory. The ifree and bfree bitmaps are only set up here, their blocks are read on demand. Initialize the inode of the root directory.
  * 
  * @param sb The VFS superblock
  * @param data Mount options
@@ -358,29 +429,56 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
      * a page (via a page_mapping) and for wrapping bio submission for backward compatibility reasons (e.g. submit_bh).
      */
     struct buffer_head *bh = NULL;
-    struct simplefs_sb_info *csb = NULL;
+    struct simplefs_super_block *csb = NULL;
 
     /* Kernel memory */
     struct simplefs_sb_info *sbi = NULL;
     struct inode *root_inode = NULL;
-    int ret = 0, i;
+    unsigned int blocksize_bits;
+    int ret = 0;
 
     /* Init sb */
     sb->s_magic = SIMPLEFS_MAGIC;
-    sb_set_blocksize(sb, SIMPLEFS_BLOCK_SIZE);
-    sb->s_maxbytes = SIMPLEFS_MAX_FILESIZE;
     sb->s_op = &simplefs_super_ops;
 
+    /*
+     * The superblock sits at the start of block 0 whatever the block size of
+     * the volume, read it with the smallest block size the device accepts.
+     */
+    if (!sb_min_blocksize(sb, SIMPLEFS_MIN_BLOCK_SIZE))
+        return -EINVAL;
+
     /* Read sb from disk (block 0) and store it in a buffer*/
     bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
     if (!bh)
         return -EIO;
 
-    csb = (struct simplefs_sb_info *) bh->b_data;
+    csb = (struct simplefs_super_block *) bh->b_data;
 
     /* Check magic number */
     if (csb->magic != sb->s_magic) {
-        pr_err("Wrong magic number\n");
+        if (csb->magic == SIMPLEFS_MAGIC_V1)
+            pr_err("Volume with 72-byte inodes, reformat it\n");
+        else
+            pr_err("Wrong magic number\n");
+        ret = -EINVAL;
+        goto release;
+    }
+
+    /* Refuse volumes using a format this module does not understand */
+    if (csb->feature_incompat & ~SIMPLEFS_FEATURE_INCOMPAT_SUPP) {
+        pr_err("Unsupported incompatible features %#x\n",
+               csb->feature_incompat & ~SIMPLEFS_FEATURE_INCOMPAT_SUPP);
+        ret = -EINVAL;
+        goto release;
+    }
+
+    /* Volumes made before the block size was configurable use 4 KiB */
+    blocksize_bits = csb->blocksize_bits ? csb->blocksize_bits
+                                         : SIMPLEFS_BLOCK_SIZE_BITS;
+    if (blocksize_bits < SIMPLEFS_MIN_BLOCK_SIZE_BITS ||
+        blocksize_bits > SIMPLEFS_MAX_BLOCK_SIZE_BITS) {
+        pr_err("Invalid block size 2^%u\n", blocksize_bits);
         ret = -EINVAL;
         goto release;
     }
@@ -405,59 +503,93 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
     sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
+    sbi->feature_incompat = csb->feature_incompat;
+    if (simplefs_has_feature(sbi, 64BIT)) {
+        sbi->nr_blocks |= (uint64_t) csb->nr_blocks_hi << 32;
+        sbi->nr_free_blocks |= (uint64_t) csb->nr_free_blocks_hi << 32;
+    }
+    if (simplefs_has_feature(sbi, LAZY_ITABLE))
+        sbi->itable_region_bits = csb->itable_region_bits;
+    sbi->sb = sb;
     sb->s_fs_info = sbi;
 
+    /* Parse mount options */
+    ret = simplefs_parse_options(sb, data);
+    if (ret)
+        goto free_sbi;
+
     /* Frees the specified buffer. */
     brelse(bh);
+    bh = NULL;
 
-    /* From here, comment similar to implefs_sync_fs */
-    /* Alloc and copy ifree_bitmap */
-    sbi->ifree_bitmap =
-        kzalloc(sbi->nr_ifree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
-    if (!sbi->ifree_bitmap) {
-        ret = -ENOMEM;
+    /* Switch to the block size of the volume */
+    if (!sb_set_blocksize(sb, 1 << blocksize_bits)) {
+        pr_err("Block size %u is not supported by this device or kernel\n",
+               1 << blocksize_bits);
+        ret = -EINVAL;
         goto free_sbi;
     }
 
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_ifree;
-        }
-
-        memcpy((void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
-
-        brelse(bh);
+    /* Geometry derived from the block size */
+    sbi->inode_size = simplefs_has_feature(sbi, LARGE_INODE)
+                          ? SIMPLEFS_LARGE_INODE_SIZE
+                          : sizeof(struct simplefs_inode);
+    sbi->inodes_per_block =
+        SIMPLEFS_INODES_PER_BLOCK(sb->s_blocksize, sbi->inode_size);
+    sbi->max_extents = SIMPLEFS_MAX_EXTENTS(sb->s_blocksize);
+    sbi->files_per_block = SIMPLEFS_FILES_PER_BLOCK(sb->s_blocksize);
+    sbi->files_per_ext = SIMPLEFS_FILES_PER_EXT(sb->s_blocksize);
+    sbi->max_subfiles = SIMPLEFS_MAX_SUBFILES(sb->s_blocksize);
+    sb->s_maxbytes = SIMPLEFS_MAX_FILESIZE(sb->s_blocksize);
+
+    /* Inode store regions left for the first allocations to zero */
+    if (simplefs_has_feature(sbi, LAZY_ITABLE)) {
+        ret = simplefs_load_itable_map(sb);
+        if (ret)
+            goto free_sbi;
     }
 
-    /* Alloc and copy bfree_bitmap */
-    sbi->bfree_bitmap =
-        kzalloc(sbi->nr_bfree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
-    if (!sbi->bfree_bitmap) {
-        ret = -ENOMEM;
-        goto free_ifree;
+    /* Timestamps are 32-bit seconds, or 64-bit seconds and nanoseconds */
+    if (simplefs_has_feature(sbi, LARGE_INODE)) {
+        sb->s_time_gran = 1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+        sb->s_time_min = S64_MIN;
+        sb->s_time_max = S64_MAX;
+#endif
+    } else {
+        sb->s_time_gran = NSEC_PER_SEC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+        sb->s_time_min = 0;
+        sb->s_time_max = U32_MAX;
+#endif
     }
 
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_bfree;
-        }
+    /*
+     * Set up free inodes and free blocks bitmasks. Their blocks are read on
+     * first use (see bitmap.c), so mounting a large volume stays cheap.
+     */
+    ret = simplefs_bitmap_init(sb, &sbi->ifree_bitmap,
+                               sbi->nr_istore_blocks + 1, sbi->nr_ifree_blocks,
+                               sbi->nr_inodes, &sbi->nr_free_inodes);
+    if (ret)
+        goto free_sbi;
 
-        memcpy((void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
+    ret = simplefs_bitmap_init(sb, &sbi->bfree_bitmap,
+                               sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1,
+                               sbi->nr_bfree_blocks, sbi->nr_blocks,
+                               &sbi->nr_free_blocks);
+    if (ret)
+        goto free_ifree;
 
-        brelse(bh);
-    }
+    /*
+     * The first allocations will need the head of both bitmaps: start reading
+     * it now, in one batch, while the root inode is read.
+     */
+    simplefs_bitmap_readahead(sb, &sbi->ifree_bitmap, 0,
+                              SIMPLEFS_BITMAP_RA_BLOCKS);
+    simplefs_bitmap_readahead(sb, &sbi->bfree_bitmap, 0,
+                              SIMPLEFS_BITMAP_RA_BLOCKS);
 
-    
     /* Create root inode, get inode from d */
     root_inode = simplefs_iget(sb, 0);
     if (IS_ERR(root_inode)) {
@@ -483,10 +615,11 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 iput:
     iput(root_inode);
 free_bfree:
-    kfree(sbi->bfree_bitmap);
+    simplefs_bitmap_destroy(&sbi->bfree_bitmap);
 free_ifree:
-    kfree(sbi->ifree_bitmap);
+    simplefs_bitmap_destroy(&sbi->ifree_bitmap);
 free_sbi:
+    kfree(sbi->itable_uninit);
     kfree(sbi);
 release:
     brelse(bh);